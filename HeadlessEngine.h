@@ -0,0 +1,425 @@
+//Headless stand-in for the parts of the TL-Engine interface used by the game
+//Compile with HEADLESS defined to run the simulation without a window or GPU (e.g. on Linux)
+
+#ifndef HEADLESS_ENGINE_H
+#define HEADLESS_ENGINE_H
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <chrono>
+#include <cstdlib>
+
+namespace tle
+{
+	enum EEngineType { kTLX };
+	enum ECameraType { kManual, kFPS };
+	enum EHorizAlignment { kLeft, kCentre, kRight };
+	enum EVertAlignment { kTop, kVCentre, kBottom };
+	enum EColour { kBlack = 0xFF000000, kWhite = 0xFFFFFFFF, kRed = 0xFFFF0000, kGreen = 0xFF00FF00, kBlue = 0xFF0000FF,
+		kYellow = 0xFFFFFF00, kCyan = 0xFF00FFFF, kMagenta = 0xFFFF00FF, kGrey = 0xFF808080 };
+
+	//Virtual key codes, same values as the real engine
+	enum EKeyCode
+	{
+		Key_Tab = 0x09, Key_Return = 0x0D, Key_Escape = 0x1B, Key_Space = 0x20,
+		Key_Left = 0x25, Key_Up = 0x26, Key_Right = 0x27, Key_Down = 0x28,
+		Key_0 = 0x30, Key_1, Key_2, Key_3, Key_4, Key_5, Key_6, Key_7, Key_8, Key_9,
+		Key_A = 0x41, Key_B, Key_C, Key_D, Key_E, Key_F, Key_G, Key_H, Key_I, Key_J, Key_K, Key_L, Key_M,
+		Key_N, Key_O, Key_P, Key_Q, Key_R, Key_S, Key_T, Key_U, Key_V, Key_W, Key_X, Key_Y, Key_Z,
+		Key_F1 = 0x70, Key_F2, Key_F3, Key_F4, Key_F5, Key_F6, Key_F7, Key_F8, Key_F9, Key_F10, Key_F11, Key_F12,
+		kMaxKeyCodes = 0x100
+	};
+
+	class I3DEngine;
+
+	//All transforms of one engine, stored in flat arrays and addressed by node index
+	struct SceneData
+	{
+		std::vector<float> local; //16 floats per node, row major, position in the last row
+		std::vector<int> parent; //Index of the parent node, -1 if not attached
+
+		int AddNode(float x, float y, float z)
+		{
+			float m[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1 };
+			local.insert(local.end(), m, m + 16);
+			parent.push_back(-1);
+			return int(parent.size()) - 1;
+		}
+
+		float* Local(int node) { return &local[node * 16]; }
+
+		void World(int node, float* out) //World matrix of a node
+		{
+			const float* l = Local(node);
+			for (int i = 0; i < 16; i++) out[i] = l[i];
+			if (parent[node] >= 0)
+			{
+				float p[16];
+				World(parent[node], p);
+				Multiply(l, p, out);
+			}
+		}
+
+		static void Multiply(const float* a, const float* b, float* out) //out = a * b (row vectors)
+		{
+			float r[16];
+			for (int i = 0; i < 4; i++) for (int j = 0; j < 4; j++)
+				r[i * 4 + j] = a[i * 4] * b[j] + a[i * 4 + 1] * b[4 + j] + a[i * 4 + 2] * b[8 + j] + a[i * 4 + 3] * b[12 + j];
+			for (int i = 0; i < 16; i++) out[i] = r[i];
+		}
+
+		static void Inverse3(const float* m, float* out) //Inverse of the 3x3 rotation/scale part, written into a 4x4 with no translation
+		{
+			float det = m[0] * (m[5] * m[10] - m[6] * m[9]) - m[1] * (m[4] * m[10] - m[6] * m[8]) + m[2] * (m[4] * m[9] - m[5] * m[8]);
+			float d = (det != 0.0f) ? 1.0f / det : 0.0f;
+			out[0] = (m[5] * m[10] - m[6] * m[9]) * d;
+			out[1] = (m[2] * m[9] - m[1] * m[10]) * d;
+			out[2] = (m[1] * m[6] - m[2] * m[5]) * d;
+			out[4] = (m[6] * m[8] - m[4] * m[10]) * d;
+			out[5] = (m[0] * m[10] - m[2] * m[8]) * d;
+			out[6] = (m[2] * m[4] - m[0] * m[6]) * d;
+			out[8] = (m[4] * m[9] - m[5] * m[8]) * d;
+			out[9] = (m[1] * m[8] - m[0] * m[9]) * d;
+			out[10] = (m[0] * m[5] - m[1] * m[4]) * d;
+			out[3] = out[7] = out[11] = out[12] = out[13] = out[14] = 0.0f;
+			out[15] = 1.0f;
+		}
+
+		void WorldToLocalDirection(int node, float& x, float& y, float& z) //Convert a world space offset into the parent's space
+		{
+			if (parent[node] < 0) return;
+			float p[16], inv[16];
+			World(parent[node], p);
+			Inverse3(p, inv);
+			float rx = x * inv[0] + y * inv[4] + z * inv[8];
+			float ry = x * inv[1] + y * inv[5] + z * inv[9];
+			float rz = x * inv[2] + y * inv[6] + z * inv[10];
+			x = rx; y = ry; z = rz;
+		}
+
+		void SetWorldPosition(int node, float x, float y, float z)
+		{
+			float* l = Local(node);
+			if (parent[node] >= 0)
+			{
+				float p[16];
+				World(parent[node], p);
+				x -= p[12]; y -= p[13]; z -= p[14];
+				WorldToLocalDirection(node, x, y, z);
+			}
+			l[12] = x; l[13] = y; l[14] = z;
+		}
+
+		void Rotate(int node, int axis, float degrees, bool localSpace)
+		{
+			float a = degrees * 3.1415926f / 180.0f;
+			float c = cos(a), s = sin(a);
+			float r[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 };
+			if (axis == 0) { r[5] = c; r[6] = s; r[9] = -s; r[10] = c; }
+			else if (axis == 1) { r[0] = c; r[2] = -s; r[8] = s; r[10] = c; }
+			else { r[0] = c; r[1] = s; r[4] = -s; r[5] = c; }
+
+			float* l = Local(node);
+			float pos[3] = { l[12], l[13], l[14] };
+			l[12] = l[13] = l[14] = 0.0f;
+			if (localSpace) Multiply(r, l, l);
+			else Multiply(l, r, l);
+			l[12] = pos[0]; l[13] = pos[1]; l[14] = pos[2];
+		}
+
+		float AxisScale(int node, int axis)
+		{
+			float* l = Local(node) + axis * 4;
+			return sqrt(l[0] * l[0] + l[1] * l[1] + l[2] * l[2]);
+		}
+
+		void SetRotation(int node, const float* xAxis, const float* yAxis, const float* zAxis) //Set the orientation while keeping the scale
+		{
+			float* l = Local(node);
+			float sx = AxisScale(node, 0), sy = AxisScale(node, 1), sz = AxisScale(node, 2);
+			for (int i = 0; i < 3; i++)
+			{
+				l[i] = xAxis[i] * sx;
+				l[4 + i] = yAxis[i] * sy;
+				l[8 + i] = zAxis[i] * sz;
+			}
+		}
+	};
+
+	class ISceneNode
+	{
+	public:
+		SceneData* scene;
+		int node;
+
+		ISceneNode(SceneData* s, int index) : scene(s), node(index) {}
+
+		//Position
+		float GetX() { float m[16]; scene->World(node, m); return m[12]; }
+		float GetY() { float m[16]; scene->World(node, m); return m[13]; }
+		float GetZ() { float m[16]; scene->World(node, m); return m[14]; }
+		float GetLocalX() { return scene->Local(node)[12]; }
+		float GetLocalY() { return scene->Local(node)[13]; }
+		float GetLocalZ() { return scene->Local(node)[14]; }
+
+		void SetPosition(float x, float y, float z) { scene->SetWorldPosition(node, x, y, z); }
+		void SetX(float x) { SetPosition(x, GetY(), GetZ()); }
+		void SetY(float y) { SetPosition(GetX(), y, GetZ()); }
+		void SetZ(float z) { SetPosition(GetX(), GetY(), z); }
+		void SetLocalPosition(float x, float y, float z) { float* l = scene->Local(node); l[12] = x; l[13] = y; l[14] = z; }
+		void SetLocalX(float x) { scene->Local(node)[12] = x; }
+		void SetLocalY(float y) { scene->Local(node)[13] = y; }
+		void SetLocalZ(float z) { scene->Local(node)[14] = z; }
+
+		//Movement
+		void Move(float x, float y, float z)
+		{
+			scene->WorldToLocalDirection(node, x, y, z);
+			float* l = scene->Local(node);
+			l[12] += x; l[13] += y; l[14] += z;
+		}
+		void MoveX(float x) { Move(x, 0.0f, 0.0f); }
+		void MoveY(float y) { Move(0.0f, y, 0.0f); }
+		void MoveZ(float z) { Move(0.0f, 0.0f, z); }
+		void MoveLocal(int axis, float d)
+		{
+			float* l = scene->Local(node);
+			float s = scene->AxisScale(node, axis);
+			if (s == 0.0f) return;
+			for (int i = 0; i < 3; i++) l[12 + i] += l[axis * 4 + i] / s * d;
+		}
+		void MoveLocalX(float x) { MoveLocal(0, x); }
+		void MoveLocalY(float y) { MoveLocal(1, y); }
+		void MoveLocalZ(float z) { MoveLocal(2, z); }
+
+		//Rotation
+		void RotateX(float a) { scene->Rotate(node, 0, a, false); }
+		void RotateY(float a) { scene->Rotate(node, 1, a, false); }
+		void RotateZ(float a) { scene->Rotate(node, 2, a, false); }
+		void RotateLocalX(float a) { scene->Rotate(node, 0, a, true); }
+		void RotateLocalY(float a) { scene->Rotate(node, 1, a, true); }
+		void RotateLocalZ(float a) { scene->Rotate(node, 2, a, true); }
+
+		void ResetOrientation()
+		{
+			const float x[3] = { 1, 0, 0 }, y[3] = { 0, 1, 0 }, z[3] = { 0, 0, 1 };
+			scene->SetRotation(node, x, y, z);
+		}
+
+		void LookAt(float tx, float ty, float tz) //Face a world position, keeping the world Y axis up
+		{
+			float m[16];
+			scene->World(node, m);
+			float z[3] = { tx - m[12], ty - m[13], tz - m[14] };
+			float len = sqrt(z[0] * z[0] + z[1] * z[1] + z[2] * z[2]);
+			if (len == 0.0f) return;
+			for (int i = 0; i < 3; i++) z[i] /= len;
+
+			float x[3] = { z[2], 0.0f, -z[0] }; //Up x Z
+			float xLen = sqrt(x[0] * x[0] + x[2] * x[2]);
+			if (xLen == 0.0f) { x[0] = 1.0f; xLen = 1.0f; }
+			x[0] /= xLen; x[2] /= xLen;
+			float y[3] = { z[1] * x[2] - z[2] * x[1], z[2] * x[0] - z[0] * x[2], z[0] * x[1] - z[1] * x[0] }; //Z x X
+
+			if (scene->parent[node] >= 0) //Express the world orientation relative to the parent
+			{
+				scene->WorldToLocalDirection(node, x[0], x[1], x[2]);
+				scene->WorldToLocalDirection(node, y[0], y[1], y[2]);
+				scene->WorldToLocalDirection(node, z[0], z[1], z[2]);
+			}
+			scene->SetRotation(node, x, y, z);
+		}
+		void LookAt(ISceneNode* target) { LookAt(target->GetX(), target->GetY(), target->GetZ()); }
+
+		void Scale(float s) { float* l = scene->Local(node); for (int i = 0; i < 11; i++) if (i % 4 != 3) l[i] *= s; }
+
+		//Hierarchy
+		void AttachToParent(ISceneNode* p) { scene->parent[node] = p->node; }
+		void DetachFromParent()
+		{
+			float m[16];
+			scene->World(node, m);
+			float* l = scene->Local(node);
+			for (int i = 0; i < 16; i++) l[i] = m[i];
+			scene->parent[node] = -1;
+		}
+
+		//Matrix
+		void GetMatrix(float* matrix) { scene->World(node, matrix); }
+		void SetMatrix(const float* matrix) { float* l = scene->Local(node); for (int i = 0; i < 16; i++) l[i] = matrix[i]; }
+	};
+
+	class IModel : public ISceneNode
+	{
+	public:
+		IModel(SceneData* s, int index) : ISceneNode(s, index) {}
+		void SetSkin(const std::string&) {}
+	};
+
+	class ICamera : public ISceneNode
+	{
+	public:
+		ICamera(SceneData* s, int index) : ISceneNode(s, index) {}
+	};
+
+	class IMesh
+	{
+	public:
+		I3DEngine* engine;
+		IMesh(I3DEngine* e) : engine(e) {}
+		IModel* CreateModel(float x = 0.0f, float y = 0.0f, float z = 0.0f);
+	};
+
+	class ISprite
+	{
+	public:
+		float x, y, z;
+		ISprite(float sx, float sy, float sz) : x(sx), y(sy), z(sz) {}
+		void SetX(float sx) { x = sx; }
+		void SetY(float sy) { y = sy; }
+		void SetZ(float sz) { z = sz; }
+		void SetPosition(float sx, float sy) { x = sx; y = sy; }
+		float GetX() { return x; }
+		float GetY() { return y; }
+	};
+
+	class IFont
+	{
+	public:
+		int draws = 0; //Number of text draws requested, for sanity checks
+		void Draw(const std::string&, int, int, unsigned int = kBlack, EHorizAlignment = kLeft, EVertAlignment = kTop) { draws++; }
+	};
+
+	//Headless engine, driven by a scripted input source and a controllable clock
+	class I3DEngine
+	{
+	public:
+		SceneData scene;
+		std::deque<IModel> models;
+		std::deque<ICamera> cameras;
+		std::deque<IMesh> meshes;
+		std::deque<ISprite> sprites;
+		std::deque<IFont> fonts;
+
+		//Clock
+		float frameTime = 1.0f / 60.0f; //Value returned by Timer(), 0 to measure real time instead
+		std::chrono::steady_clock::time_point lastTimer = std::chrono::steady_clock::now();
+
+		//Input
+		struct InputEvent
+		{
+			long long frame; //Frame at which the key changes state
+			EKeyCode key;
+			bool down;
+		};
+		std::vector<InputEvent> script; //Key changes, sorted by frame
+		size_t nextEvent = 0;
+		bool held[kMaxKeyCodes] = {};
+		bool hit[kMaxKeyCodes] = {};
+
+		//State
+		long long frame = 0;
+		long long frameLimit = -1; //IsRunning() returns false after this many frames, -1 for no limit
+		bool running = true;
+
+		I3DEngine() { ApplyInput(); }
+
+		//Setup
+		void StartWindowed(int = 0, int = 0) {}
+		void StartFullscreen(int = 0, int = 0) {}
+		void AddMediaFolder(const std::string&) {}
+		void Delete() { delete this; }
+
+		IMesh* LoadMesh(const std::string&) { meshes.push_back(IMesh(this)); return &meshes.back(); }
+		IModel* CreateModel(float x, float y, float z) { models.push_back(IModel(&scene, scene.AddNode(x, y, z))); return &models.back(); }
+		ICamera* CreateCamera(ECameraType = kManual, float x = 0.0f, float y = 0.0f, float z = 0.0f) { cameras.push_back(ICamera(&scene, scene.AddNode(x, y, z))); return &cameras.back(); }
+		ISprite* CreateSprite(const std::string&, float x = 0.0f, float y = 0.0f, float z = 0.5f) { sprites.push_back(ISprite(x, y, z)); return &sprites.back(); }
+		IFont* LoadFont(const std::string&, int = 0) { fonts.push_back(IFont()); return &fonts.back(); }
+
+		//Main loop
+		bool IsRunning() { return running && (frameLimit < 0 || frame < frameLimit); }
+		void Stop() { running = false; }
+		void DrawScene()
+		{
+			frame++;
+			for (int i = 0; i < kMaxKeyCodes; i++) hit[i] = false;
+			ApplyInput();
+		}
+
+		float Timer()
+		{
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			float elapsed = std::chrono::duration<float>(now - lastTimer).count();
+			lastTimer = now;
+			return frameTime > 0.0f ? frameTime : elapsed;
+		}
+
+		//Input
+		bool KeyHit(EKeyCode key) { bool h = hit[key]; hit[key] = false; return h; }
+		bool KeyHeld(EKeyCode key) { return held[key]; }
+		int GetMouseMovementX() { return 0; }
+		int GetMouseMovementY() { return 0; }
+		void StartMouseCapture() {}
+		void StopMouseCapture() {}
+
+		void PressKey(EKeyCode key) { if (!held[key]) hit[key] = true; held[key] = true; }
+		void ReleaseKey(EKeyCode key) { held[key] = false; }
+
+		void AddInput(long long atFrame, EKeyCode key, bool down) //Add a key change to the script, kept sorted by frame
+		{
+			InputEvent e = { atFrame, key, down };
+			size_t i = script.size();
+			while (i > nextEvent && script[i - 1].frame > atFrame) i--;
+			script.insert(script.begin() + i, e);
+			if (atFrame <= frame) ApplyInput();
+		}
+
+		bool LoadInputScript(const std::string& file) //Lines of "frame key 1/0", keys given by name (W, Space, F1...)
+		{
+			std::ifstream in(file);
+			if (!in) return false;
+
+			long long f;
+			std::string name;
+			int down;
+			while (in >> f >> name >> down)
+			{
+				EKeyCode key;
+				if (KeyFromName(name, key)) AddInput(f, key, down != 0);
+			}
+			return true;
+		}
+
+		static bool KeyFromName(const std::string& name, EKeyCode& key)
+		{
+			struct NamedKey { const char* name; EKeyCode key; };
+			static const NamedKey keys[] = { { "Tab", Key_Tab }, { "Return", Key_Return }, { "Escape", Key_Escape }, { "Space", Key_Space },
+				{ "Left", Key_Left }, { "Up", Key_Up }, { "Right", Key_Right }, { "Down", Key_Down } };
+			for (const NamedKey& k : keys) if (name == k.name) { key = k.key; return true; }
+
+			if (name.size() == 1 && ((name[0] >= 'A' && name[0] <= 'Z') || (name[0] >= '0' && name[0] <= '9'))) { key = EKeyCode(name[0]); return true; }
+			if (name.size() >= 2 && name[0] == 'F') { int n = atoi(name.c_str() + 1); if (n >= 1 && n <= 12) { key = EKeyCode(Key_F1 + n - 1); return true; } }
+			return false;
+		}
+
+	private:
+		void ApplyInput() //Apply the script's key changes for the current frame
+		{
+			while (nextEvent < script.size() && script[nextEvent].frame <= frame)
+			{
+				if (script[nextEvent].down) PressKey(script[nextEvent].key);
+				else ReleaseKey(script[nextEvent].key);
+				nextEvent++;
+			}
+		}
+	};
+
+	inline IModel* IMesh::CreateModel(float x, float y, float z) { return engine->CreateModel(x, y, z); }
+
+	inline I3DEngine* New3DEngine(EEngineType) { return new I3DEngine(); }
+}
+
+#endif
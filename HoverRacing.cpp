@@ -1,12 +1,51 @@
 //Justyna Kwiatkowska G20714950
 
+#ifdef HEADLESS
+#include "HeadlessEngine.h" //Windowless stand-in for the engine, used to run the simulation without a GPU
+#else
 #include <TL-Engine.h>	// TL-Engine include file and namespace
+#endif
 #include <cmath>
 #include <fstream> //Files
 #include <vector> //Dynamic arrays
 #include <sstream> //Joining and storing text
 #include <iomanip> //Leading zeros
 #include <algorithm> //Vector shuffle
+#include <iostream> //Console output
+#include <chrono> //Measuring load times
+#include <cstring> //Copying raw track data
+#include <thread> //Batch races run in parallel
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <condition_variable> //Waking the collision threads every tick
+#include <atomic>
+#include <memory> //Profiler buffers
+
+//SIMD obstacle tests, AVX if the compiler targets it, otherwise SSE2 which every x64 processor has
+#if defined(__AVX__)
+#include <immintrin.h>
+#define OBSTACLE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OBSTACLE_SSE
+#endif
+#if defined(OBSTACLE_AVX) || defined(OBSTACLE_SSE)
+#define CAR_BATCH_SSE //The AI steering and car movement step four cars at a time
+#define RANDOM_SSE //Particles get their random numbers four at a time
+#endif
+
+//Memory mapping of compiled tracks
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
 
 using namespace tle;
 using namespace std;
@@ -21,6 +60,34 @@ struct Time
 //Given a number of seconds return time in hours, minutes and seconds
 Time GetTime(float seconds);
 
+//Random numbers, every part of a race draws from a stream of its own made from the race seed, so the parts can be stepped on any thread in any order and still draw the same numbers
+enum RandomStreamKind { streamStartGrid, streamCars, streamParticles, streamTools }; //What a stream is for, so streams with the same index don't repeat each other
+
+struct RandomStream //Counter-based random numbers, the nth number is a hash of the stream's key and n so any run of numbers can be made at once
+{
+	unsigned int key[2] = { 0, 0 }; //Made from the seed, the kind of stream and its index
+	unsigned int counter = 0; //Numbers drawn so far
+
+	//Lets shuffle draw from a stream
+	typedef unsigned int result_type;
+	static constexpr unsigned int min() { return 0; }
+	static constexpr unsigned int max() { return 0xFFFFFFFFu; }
+
+	RandomStream() {}
+	RandomStream(unsigned int seed, RandomStreamKind kind, unsigned int index); //Stream number index of a kind, made from the race seed
+	unsigned int operator () (); //Next 32 random bits
+	int Int(); //Next number from 0 to 2^31 - 1, used in place of rand()
+	float Float(); //Next number from 0 up to but not including 1
+	void Fill(float* out, int count); //Next count numbers exactly as Float would give them, four at a time with SSE
+};
+
+unsigned long long SplitMix(unsigned long long x); //Scramble 64 bits, turns a seed and a stream number into a key
+unsigned int RandomMix(unsigned int x); //Scramble 32 bits so that every bit in changes about half of the bits out
+#ifdef RANDOM_SSE
+__m128i MultiplyLow(__m128i a, unsigned int b); //Low 32 bits of each lane times b
+__m128i RandomMix(__m128i x); //Same for four numbers at once
+#endif
+
 struct Vector3D
 {
 	float x;
@@ -81,33 +148,65 @@ struct Vector2D
 	bool operator == (Vector2D v2);
 };
 
-Vector2D FacingVector(IModel* m); //Calculate the facing vector or a model
+Vector2D FacingVector(float yaw); //Calculate the facing vector from a rotation around the Y axis
+float FacingYaw(float x, float z); //Rotation around the Y axis that faces along a vector, the other way round from FacingVector
+#ifdef CAR_BATCH_SSE
+__m128 FacingYaw(__m128 x, __m128 z); //Same for four vectors at once, giving exactly the same angles
+#endif
+
+struct GridCoord //A grid square, any pair of integers so the grid isn't limited to a fixed area
+{
+	int x;
+	int z;
+};
 
 //General constants
 const Vector3D kGravity = { 0.0f, -50.0f, 0.0f };
 const float kPi = 3.1415926f;
+const float kAtan[] = { -0.3333314528f, 0.1999355085f, -0.1420889944f, 0.1065626393f, -0.0752896400f, 0.0429096138f, -0.0161657367f, 0.0028662257f }; //atan(a) = a + a^3 * (kAtan[0] + kAtan[1] * a^2 + ...) for a from 0 to 1, Abramowitz and Stegun 4.4.49
 const float kMpsToKmph = 3.6f;
 
 //Game constants
 const float kScale = 1.3f; //Metres per units
 const int kLaps = 2; //Total number of laps
 const int kMaxCars = 4; //Maximum number of cars in game
+const int kMaxRaceCars = 256; //Most cars -cars can ask for, the ones past kMaxCars start in rows behind the start line
 const int kMaxHP = 100; //Full health of a hover car
 const float kLowHP = 0.3f; //Percentage of health where boost stops working
 const float kUpPerSec = 0.2f; //Updates per second, applied to the speed display
 const float kMaxCount = 3.0f; //Starting value when counting down
 const float kBoostTime = 3.0f; //Max time of boost before overheat
-const int kLaneNumber = 2; //Number of lanes that the AIs can choose from
+const float kLaneSwitchGap = 20.0f; //AI cars only switch to lanes that run at most this far from the one they're on
+const int kMaxLanes = 64; //Most AI lanes a level can have, a "Lane" line numbered past them makes the level invalid
+
+//Simulation constants
+const float kSimRate = 120.0f; //Default number of simulation ticks per second, independent of the frame rate
+const int kMaxSimSteps = 8; //Most ticks run in one frame, time beyond that is dropped so a long stall can't snowball
+const int kSimSpins = 200; //Times an idle simulation thread yields before it starts sleeping
+const int kSimSleep = 100; //Microseconds it sleeps for at a time
+const float kBatchTimeLimit = 600.0f; //Batch races are stopped after this much simulated time in case a car never finishes
+const float kKeyframeTime = 5.0f; //Seconds between replay keyframes, seeking simulates at most this much from the nearest one
+const float kReplaySeekStep = 10.0f; //Seconds skipped by the seek keys during playback
 
 //Grid constants
-const int kGridSize = 40;
-const int kTerrainSize = 2000;
-const int kGridSquares = kTerrainSize / kGridSize;
+const float kGridSize = 40.0f; //Default width of a grid square, a level can set its own with a "GridSize width 0 0" line before its objects
+const float kMinGridSize = 20.0f; //Obstacles are only stored in the square their centre is in, so a square has to be wider than the biggest one reaches plus a car
+const int kMaxGridCoord = 1 << 28; //Grid coordinates are clamped to this, far enough for any track and small enough that the squares around one can't overflow
 
 /****Media****/
 const string kMediaFolder = ".\\Media";
 
 const string kLevelFile = "level.txt";
+const string kTrackFile = "level.trk"; //Compiled version of the level file, loaded instead of it when present
+const string kReplayFile = "last.rpl"; //Every race is recorded here unless another file is given
+
+#ifdef HEADLESS
+const long long kHeadlessFrames = 10000; //Frames simulated by a headless run unless told otherwise
+const string kBatchFile = "batch.csv"; //Results of a batch of races, one row per car
+#endif
+#ifdef PROFILING
+const string kTraceFile = "trace.json"; //Timed scopes are written here when the game closes
+#endif
 
 //Scenery
 const string kMeshSky = "Skybox 07.x";
@@ -158,6 +257,9 @@ const EKeyCode kKeyCarLeft = Key_A;
 const EKeyCode kKeyStart = Key_Space;
 const EKeyCode kKeyBoost = Key_Space;
 
+const EKeyCode kKeySeekBack = Key_F5; //Replay playback only
+const EKeyCode kKeySeekForward = Key_F6;
+
 //Size/position constants
 const Vector2D kWindowSize{ 1280.0f, 720.0f };
 
@@ -165,6 +267,7 @@ const Vector3D kPosSky = { 0.0f, -960.0f, 0.0f };
 
 const float kStartPosDistance = -9.0f; //Distance of the starting line from the first checkpoint
 const float kStartPositions[kMaxCars]{ -5.2f, -1.9f, 1.9f, 5.2f }; //Positions of each car in the beginning, from the first checkpoint's center
+const float kStartRowGap = 8.0f; //Distance between rows of the start grid when there are more cars than fit on the first row
 
 const float kIsleWid = 1.8f; //Half the width of an isle
 const float kIsleLen = 2.5f; //Half the length of an isle
@@ -172,7 +275,6 @@ const float kWallWid = 0.9f; //Half the width of a wall
 const float kWallLen = 4.8f; //Half the length of a wall
 const float kCheckpointRad = 1.3f; //Struct radius
 const float kCheckpointLen = 9.7f; //Length from the middle of a checkpoint to each struct
-const float kCheckpointWidth = 1.0f; //Width of the collision box that determines whether the checkpoint was crossed
 const float kWorldLen = 999.0f; //Distance of world edges from origin
 
 const float kTankScale = 0.4f;
@@ -203,37 +305,106 @@ const float kSkyscraper2Radius = 4.2f; //Round part's radius
 const float kTankFireHeight = 1.9f;
 const float kTankFireRad = 2.0f;
 
-enum ParticleType { fire, smoke, exhaust, explosion };
-//Particles
-struct Particle
+const float kSpeedPointRange = 3.0f; //Range at which AI speed points are reacted to
+const float kBombRadius = 1.6f; //Radius of a bomb's trigger area
+const float kExplosionRadius = 10.0f; //Radius of a bomb's explosion
+const int kMaxTriggers = 8; //Most trigger volumes a car keeps track of being in at once, any past that are ignored
+
+//Snapshots
+struct SimState //Everything the simulation changes, written field by field and read back in the same order
 {
-	IModel* particle;
+	vector <char> data;
+	size_t readPos = 0;
+	bool loading = false; //Fields are read from the data instead of written to it
 
-	Vector3D origin; //Starting position
-	float radius; //Radius of the origin area
+	template <class T>
+	void Field(T &value) //Write or read a plain value
+	{
+		if (loading)
+		{
+			memcpy(&value, &data[readPos], sizeof(T));
+			readPos += sizeof(T);
+		}
+		else data.insert(data.end(), (const char*)&value, (const char*)&value + sizeof(T));
+	}
 
-	Vector3D v; //Velocity
-	Vector3D sv; //Starting velocity
+	template <class T>
+	void Array(vector <T> &values) //Write or read an array of plain values along with its size
+	{
+		unsigned int count = (unsigned int)values.size();
+		Field(count);
+		if (loading) values.resize(count);
+		if (count == 0) return;
 
-	ParticleType type; //Type of the particle
-	float totalLife; //Total time the particle lives
-	float maxLife; //Max lifetime possible
-	float minLife; //Min lifetime possible
-	float life = 0.0f; //Time passed since creation
-	float minVel; //Respawn if velocity becomes shorter than this
-	float angle;
+		if (loading)
+		{
+			memcpy(&values[0], &data[readPos], count * sizeof(T));
+			readPos += count * sizeof(T);
+		}
+		else data.insert(data.end(), (const char*)&values[0], (const char*)&values[0] + count * sizeof(T));
+	}
 
-	//Functions
-	void CreateParticle(IMesh* particleMesh, string skin, Vector3D particleOrigin, float originRadius, Vector3D startVelocity, float minLifetime, float maxLifetime, float minVelocity,
-		ParticleType pType, float pAngle = 0.0f); //Create a new particle model and set its skin and variables
+	void Load() //Start reading from the beginning
+	{
+		loading = true;
+		readPos = 0;
+	}
+};
 
-	float RandomAngle(float angle); //Generate a random angle within a specified range
-	void Spawn(Vector2D momentum = { 0.0f, 0.0f }); //Reset a particle's position and velocity
+//Particles
+struct ParticleSnapshot //Where every particle is and which skin it has, copied out after a tick for the render thread to draw
+{
+	vector <float> x;
+	vector <float> y;
+	vector <float> z;
+	vector <int> skin;
+};
 
-	void Update(float fTime, Vector3D acceleration, Vector3D partOrigin, ICamera* *camera, bool isActive, Vector2D momentum = { 0.0f, 0.0f }, Vector3D newStartingVelocity = { 0.0f, 0.0f, 0.0f });
-	//Update orientation and velocity, move and respawn after death
+struct ParticlePool //Every particle in the race, with each value in its own array so that an emitter's particles are updated in one tight loop
+{
+	static const int kSpawnRandoms = 6; //Random numbers used by each spawn
+	static const int kSpawnBatch = 8; //Dead particles given their numbers in one go when respawning
+
+	IMesh* mesh = nullptr; //Quad used for every particle
+	unsigned int seed = 0; //Race seed, each emitter draws from a stream made from it and the emitter's first particle
+	vector <string> skins; //Every skin a particle can have, each emitter adds its own when it's made
+
+	//Per particle
+	vector <int> skin; //Index in skins, -1 until the particle is emitted
+	vector <float> x; //Position
+	vector <float> y;
+	vector <float> z;
+	vector <float> vx; //Velocity
+	vector <float> vy;
+	vector <float> vz;
+	vector <float> svx; //Starting velocity
+	vector <float> svy;
+	vector <float> svz;
+	vector <float> life; //Time passed since spawning
+	vector <float> totalLife; //Total time the particle lives
+	vector <char> dead; //Set by Update when a particle has to be respawned or hidden
+
+	//Presentation, only touched by the render thread
+	vector <IModel*> model; //Created when the particle is first drawn
+	vector <int> shownSkin; //Skin each model was given
+
+	int Reserve(int count); //Make room for an emitter's particles, returns the index of the first one
+	int AddSkins(const vector <string> &names); //Add an emitter's skins to the table unless they're already in it, returns the index of the first one
+	void Emit(int i, int skinIndex, RandomStream &random, Vector3D origin, float radius, Vector3D startVelocity, float lifeRange, bool fireShape, float angle = 0.0f); //Give a particle its skin and spawn it
+	void Spawn(int i, const float* r, Vector3D origin, float radius, float lifeRange, bool fireShape, float angle, Vector2D momentum = { 0.0f, 0.0f }); //Reset a particle's position, velocity and life from kSpawnRandoms random numbers
+
+	int Update(int first, int count, float fTime, Vector3D acceleration, float drag, float minVel); //Move and age a range of particles, returns how many died
+	void Respawn(int first, int count, bool isActive, RandomStream &random, Vector3D origin, float radius, float lifeRange, bool fireShape, float angle, Vector2D momentum); //Respawn dead particles, or hide them if the emitter is off
+
+	void Capture(ParticleSnapshot &snapshot) const; //Copy what the render thread draws
+	void Draw(ICamera* camera, const ParticleSnapshot &snapshot); //Move the models to the particles of a snapshot, all facing the camera
+
+	void Serialize(SimState &s); //Write the particles to a snapshot or read them back
+	void Restore(int first, int count, int firstSkin, int skinCount); //Give a skin to restored particles that haven't been emitted in this run
 };
 
+float RandomAngle(float r, float angle); //Turn a random number from 0 to 1 into an angle within a specified range
+
 struct ExplosionEmitter
 {
 	const vector<string> explosionSkin{ "Explosion1.jpg", "Explosion2.jpg", "Explosion3.jpg", "Explosion4.jpg", "Explosion5.jpg" };
@@ -250,8 +421,10 @@ struct ExplosionEmitter
 
 	const float kParticleHeight = 1.5f; //Y position of the particle origin
 
-	IMesh* eMesh;
-	Particle particle[kMaxParticles];
+	ParticlePool* pool;
+	int first; //Index of the emitter's first particle in the pool
+	int firstSkin; //Index of the emitter's first skin in the pool
+	RandomStream random; //Made from the race seed and the emitter's first particle
 
 	Vector3D sVelocity = { 0.0f, 0.0f, 0.0f }; //Starting velocity
 	float radius; //Radius of the emitter 
@@ -262,12 +435,13 @@ struct ExplosionEmitter
 
 	float timer = 0.0f; //Counts the time between particle spawns
 
-	ExplosionEmitter(IMesh* explosionMesh, Vector3D emitterOrigin, float explosionRadius = 0.1f, float velocityRatio = 1.0f); //Constructor
+	ExplosionEmitter(ParticlePool* particles, Vector3D emitterOrigin, float explosionRadius = 0.1f, float velocityRatio = 1.0f); //Constructor
 	void NewParticle(); //Add a new particle to to the array of particles
 	Vector3D NewSV(); //Generate a random starting vector so that the explosion particles can shoot in any direction
 
-	void Update(float fTime, ICamera* *camera, bool isActive = 1, Vector2D momentum = { 0, 0 }); //Spawn more particles and update the existing ones
+	void Update(float fTime, bool isActive = 1, Vector2D momentum = { 0, 0 }); //Spawn more particles and update the existing ones
 	void UpdateOrigin(Vector3D particleOrigin); //Change origin position if it had moved
+	void Serialize(SimState &s); //Write the emitter's state to a snapshot or read it back
 };
 
 struct SmokeEmitter
@@ -286,8 +460,10 @@ struct SmokeEmitter
 	const float kMaxLife = 1.8f; //Maximum life of each particle
 
 
-	IMesh* sMesh;
-	Particle particle[kMaxParticles];
+	ParticlePool* pool;
+	int first; //Index of the emitter's first particle in the pool
+	int firstSkin; //Index of the emitter's first skin in the pool
+	RandomStream random; //Made from the race seed and the emitter's first particle
 
 	float radius; //Radius of the emitter 
 	Vector3D origin;
@@ -297,11 +473,12 @@ struct SmokeEmitter
 
 	float timer = 0.0f; //Counts the time between particle spawns
 
-	SmokeEmitter(IMesh* fireMesh, Vector3D emitterOrigin, float smokeRadius = 2.5f, float velocityRatio = 1.0f); //Constructor
+	SmokeEmitter(ParticlePool* particles, Vector3D emitterOrigin, float smokeRadius = 2.5f, float velocityRatio = 1.0f); //Constructor
 	void NewParticle(); //Add a new particle to to the array of particles
 
-	void Update(float fTime, ICamera* *camera, bool isActive = 1, Vector2D momentum = { 0, 0 }); //Spawn more particles and update the existing ones
+	void Update(float fTime, bool isActive = 1, Vector2D momentum = { 0, 0 }); //Spawn more particles and update the existing ones
 	void UpdateOrigin(Vector3D particleOrigin); //Change origin position if it had moved
+	void Serialize(SimState &s); //Write the emitter's state to a snapshot or read it back
 };
 
 struct FireEmitter
@@ -332,9 +509,12 @@ struct FireEmitter
 
 
 	//Particles
-	IMesh* fMesh;
-	Particle particle[kMaxParticles];
-	Particle particle2[kMaxParticles2];
+	ParticlePool* pool;
+	int first; //Index of the emitter's first particle in the pool
+	int firstSkin; //Index of the emitter's first skin in the pool
+	RandomStream random; //Made from the race seed and the emitter's first particle
+	int first2; //Index of the first type 2 particle
+	int firstSkin2; //Index of the first type 2 skin
 
 	float radius; //Radius of the emitter 
 	Vector3D origin;
@@ -346,13 +526,14 @@ struct FireEmitter
 	float timer = 0.0f; //Counts the time between particle spawns
 	float timer2 = 0.0f; //Counts the time between particle spawns of the second type
 
-	FireEmitter(IMesh* fireMesh, Vector3D emitterOrigin, float fireRadius = 2.5f, float velocityRatio = 1.0f); //Constructor
+	FireEmitter(ParticlePool* particles, Vector3D emitterOrigin, float fireRadius = 2.5f, float velocityRatio = 1.0f); //Constructor
 	void NewParticle(); //Add a new particle to to the array of particles
 	void NewParticle2(); //Add a new particle to to the second array of particles
 
 
-	void Update(float fTime, ICamera* *camera, bool isActive = 1, Vector2D momentum = { 0.0f, 0.0f }); //Spawn more particles and update the existing ones
+	void Update(float fTime, bool isActive = 1, Vector2D momentum = { 0.0f, 0.0f }); //Spawn more particles and update the existing ones
 	void UpdateOrigin(Vector3D particleOrigin); //Change origin position if it had moved
+	void Serialize(SimState &s); //Write the emitter's state to a snapshot or read it back
 };
 
 struct ExhaustEmitter
@@ -371,8 +552,10 @@ struct ExhaustEmitter
 	const float kAngle = 17.0f; //Max angle the particles can shoot from
 
 
-	IMesh* eMesh;
-	Particle particle[kMaxParticles];
+	ParticlePool* pool;
+	int first; //Index of the emitter's first particle in the pool
+	int firstSkin; //Index of the emitter's first skin in the pool
+	RandomStream random; //Made from the race seed and the emitter's first particle
 
 	float radius; //Radius of the emitter 
 	Vector3D origin; //Location the particles spawn from
@@ -384,16 +567,47 @@ struct ExhaustEmitter
 	float timer = 0.0f; //Counts the time between particle spawns
 	float timer2 = 0.0f; //Counts the time between particle spawns of the second type
 
-	ExhaustEmitter(IMesh* exhaustMesh, Vector3D emitterOrigin, float exhaustRadius = 0.1f, float velocityRatio = 1.0f); //Constructor
+	ExhaustEmitter(ParticlePool* particles, Vector3D emitterOrigin, float exhaustRadius = 0.1f, float velocityRatio = 1.0f); //Constructor
 	void NewParticle(); //Add a new particle to to the array of particles
 
-	void Update(float fTime, ICamera* *camera, bool isActive = 1, Vector2D momentum = { 0.0f, 0.0f }); //Spawn more particles and update the existing ones
+	void Update(float fTime, bool isActive = 1, Vector2D momentum = { 0.0f, 0.0f }); //Spawn more particles and update the existing ones
 	void UpdateOrigin(Vector3D particleOrigin); //Change origin position if it had moved
+	void Serialize(SimState &s); //Write the emitter's state to a snapshot or read it back
+};
+
+//Player input
+struct PlayerInput //Player's keys, read once per frame and used by the simulation ticks
+{
+	bool forward = false;
+	bool backward = false;
+	bool left = false;
+	bool right = false;
+	bool boost = false;
+	bool startHit = false; //Hits are kept until a tick uses them
+	bool restartHit = false;
+
+	void Read(I3DEngine* e); //Update held keys and collect hits
+	void ClearHits(); //Forget hits after a tick has used them
+	unsigned char Pack(); //Keys as a byte with a bit each, for replays
+	void Unpack(unsigned char keys); //Keys from a packed byte
 };
 
 //Hover cars
 enum ColAxis { colX, colZ, both, none }; //Used to determine how the car bounces off square obstacles
 enum Speed { fast, slow }; //AI speed ranges
+struct TrackData; //Shared track data, defined with the compiled track
+
+struct CarPose //A car's transform over the latest tick, all the render thread needs to place its models
+{
+	Vector2D lastPos; //Position at the start of the tick
+	Vector2D pos; //Position at the end of it
+	float lastYaw;
+	float yaw;
+	float height;
+	float bobbleY;
+	float tilt;
+	float lean;
+};
 
 struct HoverCar
 {
@@ -431,6 +645,7 @@ struct HoverCar
 	const float kDamageFactor = 0.04f; //Multiplied by the current speed to determine damage taken on collision
 	const float kCarColRadiusMult = 2.5f; //During car collision the radius is multiplied by this number. The extra 0.5 is to make collisions look more natural
 	const float kCarColImpact = 1.9f; //New momentum is multiplied by this number to push cars away
+	const float kContactGap = 0.01f; //Cars that hit an obstacle stop this far short of touching it
 
 	const float kBombDamage = 15.0f; //Damage taken from explosion, divided by distance from the bomb
 	const float kBombImpact = -280.0f; //Multiplied by distance from bomb and vector between it and car to create a pushback effect
@@ -462,10 +677,18 @@ struct HoverCar
 	//Engine
 	I3DEngine* e;
 
-	//Models
+	//Models, only moved by the render thread
 	IModel* dummy; //Basic movements, chase camera
 	IModel* car; //Tilting/leaning/bobbling, first person camera
 
+	//Transform, owned by the simulation and copied to the models by Present through a CarPose
+	Vector2D pos; //Position of the dummy
+	float height; //Y position of the dummy
+	float yaw = 0.0f; //Rotation of the dummy around the Y axis
+	float bobbleY = 0.0f; //Y position of the car model relative to the dummy
+	Vector2D lastPos; //Position at the start of the latest tick, used to interpolate between ticks
+	float lastYaw = 0.0f; //Rotation at the start of the latest tick
+
 	//Time
 	float fTime; //Frame time, used as speed multiplier
 	float raceTime = 0; //Counts time since start of the race
@@ -485,7 +708,7 @@ struct HoverCar
 	float lean = 0.0f;
 
 	//Collision detection
-	Vector2D currentSquare;
+	GridCoord currentSquare;
 
 	float r = kCarScale * kCarRadius; //Car radius
 
@@ -493,12 +716,18 @@ struct HoverCar
 	int colIndexSphere = -1; //Tracks spheres collided with
 	int colIndexBox = -1; //Tracks boxes collided with
 	int colIndexCar = -1; //Tracks cars collided with
+	int trigger[kMaxTriggers] = {}; //Trigger volumes the car was in at the end of the last tick
+	int triggerCount = 0;
 
 	//Race
 	string name; //Name to display if the car wins
 	size_t nextCheck = 0; //Next checkpoint that the car has to fly through
 	int lap = 1; //Current lap number
 	int racePos = 1;
+	float progress = 0.0f; //Checkpoints passed plus the fraction of the way to the next one, used to rank the cars
+	vector<float> lapTimes; //Race time at the end of each finished lap
+	int collisions = 0; //Obstacles and cars bumped into, reported by the batch simulator
+	RandomStream random; //Hover height, bobbing and AI speed changes, made from the race seed and the car's number
 
 	//Health
 	int hp = kMaxHP; //Health points
@@ -518,8 +747,8 @@ struct HoverCar
 	float burnDamageTimer = 0.0f;
 
 	/****Non-player cars****/
-	const float kGoalSpeed = 270.0f; //Speed at which the goal dummy moves towards the next waypoint, divided by distance to car
-	const float kMaxGoalDist = 8.0f; //The car needs to be this close to the goal dummy for it to move forward
+	const float kGoalSpeed = 270.0f; //Speed at which the goal moves along the lane, divided by distance to car
+	const float kMaxGoalDist = 8.0f; //The car needs to be this close to the goal for it to move forward
 
 	const float kMinThrust = 0.55f; //Minimum AI thrust multiplier (applied in place of player's boost multiplier)
 	const float kMidThrust = 1.15f; //New thrust is selected from values between this and min or max
@@ -532,47 +761,53 @@ struct HoverCar
 	const float kMedHPPenalty = 0.9f; //Multiplier applied if hp is at 60%
 
 	bool isAI; //True if the car is not controlled by player
-	vector<vector<Vector2D>> path; //Used to store the route to be taken by computer-contolled car 
-	size_t lane = 0; //Index in the first dimension of the path vector, determines the set of waypoints that's followed
-	size_t currentGoal = 0; //Index in the second dimension of the path vector, determines the next position to be taken
-	IModel* goal; //A dummy model that the car automatically follows
-	IModel* nextWaypoint; //Dummy model that the goal dummy moves towards;
+	shared_ptr <const TrackData> track; //Holds the lanes taken by computer-controlled cars, shared by every car on the track
+	size_t lane = 0; //Lane that's followed
+	float goalDist = 0.0f; //Distance along the lane of the goal the car steers towards
+	int goalSample = 0; //Lane sample the goal is on or just past
 	float newThrust = 1.0f; //New thrust multiplier for AI to slowly change to
 	float speedChangeCD = 0.0f; //Cooldown on speed changes
 
 	/****Functions****/
-	HoverCar(IMesh* dummyMesh, IMesh* carMesh, IMesh* particleMesh, vector<vector<Vector2D>> &paths, float startX, float startZ, string carName, int carNo, bool ai = 1); //Constructor
+	HoverCar(IMesh* dummyMesh, IMesh* carMesh, ParticlePool* particles, shared_ptr <const TrackData> trackData, float startX, float startZ, string carName, int carNo, unsigned int seed, bool ai = 1); //Constructor
 
 	void Reset(float startX, float startZ); //Reset the car's variables and move it to a given starting position
 
-	void AIFollowPath(); //Update AI orientation and speed, move the goal dummy and change waypoints when needed
+	void AIFollowPath(); //Update AI orientation and speed and move the goal along the lane, CarBatch::Steer does the same for four cars at a time
+	void AIMoveGoal(float step); //Move the goal a distance along the lane, wrapping round at its end
 	void AINewSpeed(Speed speed); //Switch to a random speed in a slow or fast range
-	void AINextWaypoint(); //Switch to next waypoint on AI's path
-	void AISwitchLane(); //Switch to a different lane
-	void ComparePosition(HoverCar *car2, IModel* &checkpoint); //Compare position in the race with another racer
+	void AIStartLane(); //Follow the lane closest to the car, from its first waypoint
+	void AISwitchLane(); //Switch to the closest lane that runs alongside the current one
+	void UpdateProgress(Vector2D from, Vector2D to, int checkpoints); //Work out track progress from the checkpoints on either side of the car
 
 	void UpdateTime(); //Update race time
 	void UpdateDamage(); //Damage related updates
-	void UpdateParticles(ICamera* *camera); //Update fire, smoke and exhaust fire particles coming from the car
+	void UpdateParticles(); //Update fire, smoke and exhaust fire particles coming from the car
 
-	void Controls(I3DEngine* e); //Take keyboard input and react accordingly
+	void Controls(PlayerInput input); //Take keyboard input and react accordingly
 
 	void TakeDamage(int damage); //Subtract damage and disable thrust if hp goes too low
 	void ResetCollision(); //Return to normal speed and enable collisions when the car slows down enough
-	void SphereCollision(int index); //Collision with a sphere shaped obstacle
-	void BoxCollision(int index, ColAxis a); //Collision with a box shaped obstacle
-	bool CarCollision(HoverCar *car2, int index); //Collision with another car
-	void Burn(ICamera* *camera); //Emit fire particles and take damage
-	void Explosion(IModel* *bomb); //Push the car away from bomb and take damage
-
-	void Move(); //Move the car according to its momentum
-	void Rotate(); //Update car's orientation based on lean and tilt values
+	Vector2D Contact(float time); //Point the car reached along this tick's move when it touched an obstacle, stopped just short of it
+	void SphereCollision(int index, Vector2D contact); //Collision with a sphere shaped obstacle
+	void BoxCollision(int index, ColAxis a, Vector2D contact); //Collision with a box shaped obstacle
+	bool Touching(const HoverCar &car2) const; //True if the two cars overlap
+	void CarCollision(HoverCar *car2, int index); //Bounce two touching cars off each other
+	void Burn(); //Emit fire particles and take damage
+	void Explosion(Vector2D bomb); //Push the car away from a bomb and take damage
+
+	void Move(); //Move the car according to its momentum, CarBatch::Move does the same for four cars at a time
+	void Rotate(); //Update lean and tilt values
 	void Bobble(); //Move the car up and down
 	void Tilt(float dir); //Update the tilt value, takes a direction multiplier of 1 or -1
 	void Lean(float dir); //Update the lean value, takes a direction multiplier of 1 or -1
-	void Boost(I3DEngine* e); //Checks performed when player attempts to use boost, along with consecutive actions
+	void Boost(PlayerInput input); //Checks performed when player attempts to use boost, along with consecutive actions
 
-	void Update(float frameTime, ICamera* *camera); //Actions performed every frame
+	void BeginTick(float tickTime); //Remember the transform from before the tick and set the time step
+	void Update(float frameTime); //Actions performed every tick, after the race has moved the car
+	CarPose Pose() const; //Transform over the latest tick, for a snapshot
+	void Present(const CarPose &pose, float alpha); //Move the models to the transform of a snapshot interpolated between its last two ticks
+	void Serialize(SimState &s); //Write everything a tick can change to a snapshot or read it back
 };
 
 struct Camera
@@ -614,14 +849,15 @@ struct Camera
 	//Shake
 	float shakeTimer = 0.0f; //Keeps track of how long the camera has been shaking for
 	float yGoal = 0.0f; //Local Y position the camera should be at
+	int shakes = 0; //Explosions that have shaken the camera, the race counts them
 
 	//Functions
-	Camera(I3DEngine* e, IMesh* dummyMesh, HoverCar player); //Constructor
+	Camera(I3DEngine* e, IMesh* dummyMesh, const HoverCar &player); //Constructor
 
 	void Controls(I3DEngine* e, HoverCar *player); //Take key input to move the camera and change its modes
 	void SetMode(int i); //Use the passed index to select one of the modes and set the camera position and rotation accordingly
 	void Shake(); //Trigger camera shaking
-	void Update(I3DEngine* e, float frameTime, HoverCar *player); //Update frame time and take input
+	void Update(I3DEngine* e, float frameTime, HoverCar *player, int raceShakes); //Update frame time and take input, and shake if the race counted a new explosion
 };
 
 struct BoundingBox
@@ -634,7 +870,8 @@ struct BoundingBox
 	BoundingBox(float xPos = 0.0f, float zPos = 0.0f, float halfWidth = 0.0f, float halfLength = 0.0f); //Constructor
 	void Initialise(float xPos, float zPos, float halfWidth, float halfLength); //Separated to make an early definition possible (needed for checkpoints)
 
-	ColAxis Collision(HoverCar *car); //Collision detection with a hover car, returns collision direction
+	ColAxis Collision(HoverCar *car) const; //Collision detection with a hover car, returns collision direction
+	ColAxis Collision(Vector2D pos, Vector2D prevPos, float radius) const; //Same test for a circle that moved from prevPos to pos
 };
 
 struct BoundingSphere
@@ -645,7 +882,8 @@ struct BoundingSphere
 
 	BoundingSphere(float xPos, float zPos, float radius); //Constructor
 
-	bool Collision(HoverCar *car); //Collision detection with a hover car
+	bool Collision(HoverCar *car) const; //Collision detection with a hover car
+	bool Collision(Vector2D pos, float radius) const; //Same test for a circle
 };
 
 struct Object
@@ -660,20 +898,86 @@ struct Checkpoint
 	const float kCrossScale = 0.25f; //Scale of the cross model
 	const float kCrossHeight = 4.8f; //Height at which the cross is positioned
 	const float kCrossTime = 3.0f; //Time the cross appears for
+	const float kGateReach = kCheckpointLen - kCheckpointRad; //Cars have to go through between the struts
+	const float kWideGateReach = kCheckpointLen * 3.0f; //Computer-controlled cars only have to go past close to the checkpoint, their lanes don't always go between the struts
 
 	IModel* m; //Checkpoint model
-	BoundingBox check; //Bounding box for detecting checkpoint crossing
-	BoundingBox checkWide; //Bounding box for detecting checkpoint crossing by the AI
+	Vector2D pos; //Used to measure how far the cars are along the track
+	Vector2D across; //Along the gate, from one strut towards the other
+	Vector2D forward; //Way the cars have to go through the gate, set by Aim
 
-	IModel* cross; //Cross model
+	IModel* cross; //Cross model, only moved by the render thread
 	float timer = 0.0f; //Cross timer
+	bool crossUp = false; //Whether the cross is showing
+	bool crossShown = false; //Whether the render thread has put the cross model up
 
 	Checkpoint(IMesh* checkpointMesh, IMesh* crossMesh, float x, float y, float z, float r); //Constructor
 
+	void Aim(Vector2D previous, Vector2D next); //Work out which way the gate is crossed from the checkpoints before and after it
+	bool Crossed(Vector2D from, Vector2D to, bool wide) const; //True if a car that moved between two points went through the gate forwards, anywhere along the move
 	void ShowCross(); //Show a cross to signify that the checkpoint has been crossed
 	void HideCross(); //Hide the cross underground
 
 	void Update(float fTime); //Update cross timer and hide it when time runs out
+	void Present(bool up); //Raise or lower the cross model to match a snapshot
+	void Serialize(SimState &s); //Write the cross timer to a snapshot or read it back
+};
+
+struct HudText //A line of HUD text formatted in place, its buffer is reserved up front so changing the text never allocates
+{
+	static const size_t kCapacity = 64; //Longer text is cut short
+
+	string text;
+
+	HudText() { text.reserve(kCapacity); }
+	HudText& Clear() { text.clear(); return *this; }
+	const string& str() const { return text; }
+
+	HudText& operator << (const char* s); //Append text
+	HudText& operator << (const string &s);
+	HudText& operator << (int n); //Append a whole number
+	HudText& operator << (Time t); //Append a time as mm:ss:cc
+	void Append(const char* s, size_t length);
+};
+
+struct Hud //HUD text and the values it was made from, kept up to date by the simulation and drawn by the UI from a snapshot
+{
+	//Text holders
+	HudText status;
+	HudText lap;
+	HudText health;
+	HudText speed;
+	HudText time;
+	HudText pos;
+	HudText endStatus;
+	HudText endStatus2;
+
+	//Values the text was last made from, it's only remade when they change
+	int shownSpeed = -1; //km/h
+	int shownTime = -1; //Hundredths of a second
+	int shownPos = -1;
+	int shownCars = -1;
+	int shownHP = -1;
+	int shownCountdown = -1; //Whole seconds left, 0 once it says "Go!"
+
+	//Status
+	int hpColour; //Changes to magenta when health is low
+	bool end = 0; //True if player dies or finishes race
+	int resets = 0; //Times the HUD was reset, so the UI knows to reset its own state too
+
+	//Functions
+	Hud(); //Constructor
+	void Reset(); //Reset the HUD to its state from before the race started
+
+	void ShowEndStatus(); //Make the end backdrop and text visible, triggered on death and race completion
+
+	void UpdateWinner(string name, Time t); //When the first car completes a race the end text is updated with its name and time
+	void UpdateStatus(int nCheck, int cLap, int lastCheck); //Updates to the status message, triggered when crossing checpoints
+	void UpdateHP(int hp); //After a damage check the hp status is updated to show player's current hp
+	void UpdateGeneral(float s, Time t, int playerPos, int carNumber); //Update to speed, time elapsed and race position text
+
+	void UpdateCountdown(float countdown); //Countdown text at the start of race
+	void GameOver(); //Updates text and shows end status when the player dies
 };
 
 struct UI
@@ -718,43 +1022,27 @@ struct UI
 	IFont* uiFont;
 	IFont* uiEndFont;
 
-	//Text holders
-	stringstream status;
-	stringstream lap;
-	stringstream health;
-	stringstream speed;
-	stringstream time;
-	stringstream boost;
-	stringstream pos;
-	stringstream endStatus;
-	stringstream endStatus2;
-
-	//Status
-	int hpColour; //Changes to magenta when health is low
-	bool end = 0; //True if player dies or finishes race
-
-	//Time
-	float countdown = -1.0f;
+	//Boost message, flashed by the UI itself at the frame rate
+	HudText boost;
+	int shownBoost = -1; //Boost message: 0 none, 1 boost down, 2 overheat
 	float boostTimer = -1.0f;
 
+	//State of the HUD the sprites were last set for
+	bool endShown = 0;
+	int resets = 0;
+
 	//Functions
 	UI(I3DEngine* e); //Constructor
-	void Reset(); //Reset the UI to its state from before the race started
-
-	void ShowEndStatus(); //Make the end backdrop and text visible, triggered on death and race completion
 
-	void UpdateWinner(string name, Time t); //When the first car completes a race the end text is updated with its name and time
-	void UpdateStatus(int nCheck, int cLap, int lastCheck); //Updates to the status message, triggered when crossing checpoints
-	void UpdateHP(int hp); //After a damage check the hp status is updated to show player's current hp
-	void UpdateGeneral(float s, Time t, int playerPos, int carNumber); //Update to speed, time elapsed and race position text
 	void UpdateBoost(float bTime); //Boost bar update, takes player's boost time
-
-	bool Countdown(); //Countdown at the start of race, returns true when it finishes
-	void GameOver(); //Updates text and shows end status when the player dies
-
-	void Update(float frameTime, float boostTime); //Display all UI text and update boost bar
+	void Update(float frameTime, float boostTime, const Hud &hud); //Display the HUD of a snapshot and update boost bar
 };
 
+#ifdef HEADLESS
+thread_local long long allocations = 0; //Heap allocations made by the thread, counted by operator new to check the HUD doesn't make any
+int HudCheckTool(); //Drive the HUD through changing race values and check it doesn't allocate once it's set up, copying it as snapshots do
+#endif
+
 enum BombState { active, inactive, exploding };
 
 struct Bomb
@@ -768,570 +1056,1042 @@ struct Bomb
 	const float kBombXRot = 90.0f; //Rotation of the model on the X axis
 	const float kBombYPos = 0.3f; //Position on the Y axis
 
-	const float kBombRadius = 1.6f; //Radius of the trigger area
-	const float kExplosionRadius = 10.0f; //Radius of the explosion area
-
 	const float kCooldown = 40.0f; //Time before a bomb respawns
 	const float kExplosionTime = 0.5f; //Duration of the explosion
 
-	IModel* bomb; //Bomb model
-	vector <BoundingSphere> colSphere; //Collidiong with this area triggers the bomb
-	vector <BoundingSphere> explosionRange; //Range of the explosion
+	IModel* bomb; //Bomb model, only changed by the render thread
+	BombState shown = active; //State the model was last put in
+	Vector2D pos; //Where the bomb is, cars are pushed away from it
 	vector <ExplosionEmitter> explosionParticles; //Explosion
 
 	float cd = 0.0f; //Cooldown
 	float eTime = 0.0f; //Explosion duration
 
 	//Functions
-	Bomb(IMesh* bombMesh, IMesh* particleMesh, float x, float z, float r); //Constructor
+	Bomb(IMesh* bombMesh, ParticlePool* particles, float x, float z, float r); //Constructor
 
 	void Trigger(); //Trigger the explosion
 	void Explosion(); //Change state to inactive if explosion ended
 	void Deactivate(); //Hide the bomb and set a cooldown
 	void Reset(); //Activate the bomb and put it in sight
 
-	void Update(float fTime, ICamera* camera); //Update timers and explosion particles
+	void Update(float fTime); //Update timers and explosion particles
+	void Present(BombState s); //Hide the model or change its skin to match a snapshot
+	void Serialize(SimState &s); //Write the bomb's state to a snapshot or read it back
 };
 
-struct GridSquare //A piece of grid that holds obstacles
+struct GridSlot //Entry of a sparse grid's hash table
 {
-	const float kSpeedPointRange = 3.0f; //Range at which speed points are reacted to
+	GridCoord coord;
+	int index; //Square in the grid's list, -1 if the slot is empty
+};
 
-	//Collision areas in the grid square
-	vector <BoundingBox> boxObstacle;
-	vector <BoundingSphere> sphereObstacle;
+template <class T>
+struct SparseGrid //Grid that only stores the squares something was put in and finds them through a hash table of their coordinates, so it covers any area and its memory follows what's on the track
+{
+	float squareSize = kGridSize; //Width of a grid square
+	vector <GridCoord> coord; //Coordinates of each stored square
+	vector <T> square; //Contents of each stored square, in the order they were added
+	vector <GridSlot> slot; //Open addressing table, a power of two in size and never more than half full
+
+	size_t size() const { return square.size(); }
+	GridCoord Coord(float x, float z) const; //Grid square a position is in
+	const T* Find(GridCoord c) const; //Square at a coordinate, null if nothing was stored there
+	T& Add(GridCoord c); //Square at a coordinate, stored empty first if it's new
+	void Rehash(size_t slots); //Rebuild the table with a new number of slots
+};
 
-	//Points on the track where the AI speed changes
-	vector <BoundingSphere> slowPoint;
-	vector <BoundingSphere> fastPoint;
+int GridIndex(float f); //Grid coordinate along one axis of a position already divided by the square size
+unsigned int GridHash(GridCoord c); //Mix both coordinates of a square into a hash table index
 
-	//Fire zones
-	vector <BoundingSphere> fire;
-};
+struct BombManager //Every bomb on the track, cars reach them through the bomb and blast trigger volumes numbered by bomb
+{
+	vector <Bomb> bomb;
 
-Vector2D GetCoord(float x, float z); //Used to obtain coordinates based on a position
+	void Add(const Bomb &b) { bomb.push_back(b); }
+	void Update(float fTime); //Update every bomb's timers and explosion particles once
+	void Serialize(SimState &s); //Write every bomb's state to a snapshot or read it back
+};
 
-void main()
+template <class T>
+struct TrackList //Read-only view of an array stored in the track image
 {
-	// Create a 3D engine (using TLX engine here) and open a window for it
-	I3DEngine* myEngine = New3DEngine(kTLX);
-	myEngine->StartWindowed();
+	const T* data = nullptr;
+	size_t count = 0;
 
-	// Add default folder for meshes and other media
-	myEngine->AddMediaFolder(kMediaFolder);
+	size_t size() const { return count; }
+	const T& operator [] (size_t i) const { return data[i]; }
+};
 
-	//Set seed for the random number generator
-	srand(int(time(NULL)));
+//Obstacles are stored as one array per coordinate, so a car can be tested against several of them with one instruction
+const int kObstacleBlock = 8; //Each list is padded to a multiple of this with obstacles that nothing can touch
+const float kNoObstacle = 1e18f; //Position of the padding obstacles, far enough away but still small enough to square
 
-	/**** Set up your scene here ****/
+struct SweepHit //Earliest obstacle a moving circle runs into
+{
+	float time = 1.0f; //Fraction of the move made before touching it, 0 if the circle already overlapped it
+	Vector2D normal = { 0.0f, 0.0f }; //Points out of the obstacle where it was touched
+	ColAxis axis = none; //Side of a box that was touched, none if nothing was hit
+	int index = -1; //Number of the obstacle across the whole track, -1 if nothing was hit
+	bool box = false; //True for a box obstacle, false for a sphere
+};
 
-	//Object meshes
-	IMesh* hillsMesh = myEngine->LoadMesh(kMeshHills);
-	IMesh* isleMesh = myEngine->LoadMesh(kMeshIsle);
-	IMesh* isle2Mesh = myEngine->LoadMesh(kMeshIsle2);
-	IMesh* wallMesh = myEngine->LoadMesh(kMeshWall);
-	IMesh* checkpointMesh = myEngine->LoadMesh(kMeshCheckpoint);
-	IMesh* crossMesh = myEngine->LoadMesh(kMeshCross);
-	IMesh* walkwayMesh = myEngine->LoadMesh(kMeshWalkway);
-	IMesh* tribuneMesh = myEngine->LoadMesh(kMeshTribune);
-	IMesh* skyscraperMesh = myEngine->LoadMesh(kMeshSkyscraper);
-	IMesh* skyscraper2Mesh = myEngine->LoadMesh(kMeshSkyscraper2);
-	IMesh* buildingMesh = myEngine->LoadMesh(kMeshBuilding);
-	IMesh* bushMesh = myEngine->LoadMesh(kMeshBush);
-	IMesh* tank1Mesh = myEngine->LoadMesh(kMeshTank1);
-	IMesh* tank2Mesh = myEngine->LoadMesh(kMeshTank2);
-	IMesh* bombMesh = myEngine->LoadMesh(kMeshBomb);
+struct BoxList //Box obstacles of a grid square
+{
+	const float* xStart = nullptr;
+	const float* xEnd = nullptr;
+	const float* zStart = nullptr;
+	const float* zEnd = nullptr;
+	const int* id = nullptr; //Number of each box across the whole track, the same whichever list it's found in
+	size_t count = 0; //Real boxes, the padding after them is only read by the SIMD test
+
+	size_t size() const { return count; }
+	BoundingBox operator [] (size_t i) const;
+
+	int FirstHit(Vector2D pos, float radius) const; //Index of the first box a circle overlaps, -1 if there isn't one
+	int FirstHitScalar(Vector2D pos, float radius) const; //Same test one box at a time
+	void Sweep(Vector2D from, Vector2D to, float radius, SweepHit &hit) const; //Keep the box a circle moving from one point to another touches first, if it's earlier than the hit so far
+};
 
-	//Object arrays
-	IModel* hills;
-	vector <Object> isle;
-	vector <Object> wall;
-	vector <Object> walkway;
-	vector <Object> building;
-	vector <Object> bush;
-	vector <Object> tank;
-	vector <Checkpoint> checkpoint;
-	vector <Bomb> bomb;
+struct SphereList //Sphere obstacles or trigger volumes of a grid square
+{
+	const float* x = nullptr;
+	const float* z = nullptr;
+	const float* r = nullptr; //Squared radius
+	const int* id = nullptr; //Number of each sphere across the whole track, the same whichever list it's found in
+	size_t count = 0; //Real spheres, the padding after them is only read by the SIMD test
+
+	size_t size() const { return count; }
+	BoundingSphere operator [] (size_t i) const;
+
+	int FirstHit(Vector2D pos, float radius) const; //Index of the first sphere a circle overlaps, -1 if there isn't one
+	int FirstHitScalar(Vector2D pos, float radius) const; //Same test one sphere at a time
+	int Hits(Vector2D pos, float radius, int* hits, int maxHits) const; //Write the index of every sphere a circle overlaps, up to maxHits, and return how many there were
+	int HitsScalar(Vector2D pos, float radius, int* hits, int maxHits) const; //Same test one sphere at a time
+	void Sweep(Vector2D from, Vector2D to, float radius, SweepHit &hit) const; //Keep the sphere a circle moving from one point to another touches first, if it's earlier than the hit so far
+};
 
-	vector<vector <Vector2D>> path; //Waypoints for the AI
-	vector <Vector2D> emptyVector;
-	for (int i = 0; i < kLaneNumber; i++) path.push_back(emptyVector); //Put empty vectors in to fill later
+struct GridSquare //A piece of grid that holds obstacles
+{
+	//Collision areas in the grid square
+	BoxList boxObstacle;
+	SphereList sphereObstacle;
 
-	vector <Vector2D> startPos; //Positions that cars start at
+	//Fire zones, speed points and bomb areas, each with TriggerType bits looked up by id
+	SphereList trigger;
+};
 
-	GridSquare grid[kGridSquares][kGridSquares]; //Parts of the terrain
 
-	//Particles
-	IMesh* particleMesh = myEngine->LoadMesh("quad.x");
-	vector<FireEmitter> fire;
+/****Compiled track****/
+//The level file is compiled offline into a binary image holding the object instances, the baked grid collision lists, the AI lanes and the start positions.
+//The game maps that file and points the grid straight into it, so nothing has to be parsed or allocated per object on startup.
+const unsigned int kTrackMagic = 0x4B525448; //"HTRK"
+const unsigned int kTrackVersion = 5; //Increase whenever the layout of the image changes
+const unsigned int kReplayVersion = 13; //Increase whenever what the snapshots hold or how a tick plays out changes, older replays would go out of sync
+const unsigned int kTrackAlignment = 32; //Sections start on this boundary so obstacle arrays line up with SIMD loads
+
+enum ObjectType { objIsle, objIsle2, objWall, objCheckpoint, objHills, objWalkway, objTank1, objTank2, objSkyscraper, objSkyscraper2, objBuilding, objTribune,
+	objSmallestBush, objSmallBush, objBush, objBigBush, objBomb, objTypes };
+const string kObjectNames[objTypes] = { "Isle", "Isle2", "Wall", "Checkpoint", "Hills", "Walkway", "Tank1", "Tank2", "Skyscraper", "Skyscraper2", "Building", "Tribune",
+	"Smallestbush", "Smallbush", "Bush", "Bigbush", "Bomb" }; //Names used in the level file
+
+//Trigger volumes are spheres that do something to the cars inside them instead of stopping them. Every kind lives in one list per grid square and is told apart by its type bits,
+//so a car finds all the volumes it's in with one query a tick and gets an enter, stay or exit event for each
+enum TriggerType { triggerFire = 1, triggerSlow = 2, triggerFast = 4, triggerBomb = 8, triggerBlast = 16 }; //Bits of a volume's type, one volume can have several
+enum TriggerPhase { triggerEnter, triggerStay, triggerExit };
+const int kLevelTriggers = 3;
+const string kTriggerNames[kLevelTriggers] = { "Fire", "Slow", "Fast" }; //Volumes a level file can place with a "Name x z radius" line, radius 0 for the default
+const unsigned int kTriggerTypes[kLevelTriggers] = { triggerFire, triggerSlow, triggerFast };
+const float kTriggerRadius[kLevelTriggers] = { kTankFireRad + 0.1f, kSpeedPointRange, kSpeedPointRange }; //Default radius of each
+
+struct TriggerEvent //A car going into, staying in or leaving a trigger volume
+{
+	int id; //Number of the volume among the track's spheres
+	unsigned int type; //TriggerType bits
+	int payload; //Bomb number for bomb and blast volumes
+	TriggerPhase phase;
+};
 
-	/*****Build level****/
-	string type;
+struct ObjectInstance //An object placed in the level, turned into a model on startup
+{
+	int type;
 	float x;
 	float z;
 	float r;
+};
 
-	ifstream lFile;
-	lFile.open(kLevelFile);
+struct TrackSection //Location of an array in the track image
+{
+	unsigned int offset; //Bytes from the start of the image
+	unsigned int count; //Number of elements
+};
 
-	while (!lFile.eof())
-	{
-		//Get "words" from file and put them in temporary variables
-		lFile >> type;
-		lFile >> x;
-		lFile >> z;
-		lFile >> r;
+struct TrackRange //Part of one of the obstacle arrays
+{
+	unsigned int first;
+	unsigned int count;
+};
 
-		Vector2D gs = GetCoord(x, z); //Grid square coordinates for the current object
+struct TrackCell //Obstacles of one grid square, only squares that have any are stored
+{
+	GridCoord coord;
+	TrackRange box;
+	TrackRange sphere;
+	TrackRange trigger; //Trigger volumes, in the same arrays as the sphere obstacles
+};
 
-		//Put the obtained object in an array that matches its type
-		if (type == "Isle")
-		{
-			isle.push_back(Object(isleMesh, x, 0, z, r));
-			if (r == 0 || r == 180) grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kIsleWid, kIsleLen));
-			else grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kIsleLen, kIsleWid));
-		}
-		else if (type == "Isle2")
-		{
-			isle.push_back(Object(isle2Mesh, x, 0, z, r));
-			if (r == 0 || r == 180) grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kIsleWid, kIsleLen));
-			else grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kIsleLen, kIsleWid));
-		}
-		else if (type == "Wall")
-		{
-			wall.push_back(Object(wallMesh, x, 0, z, r));
-			if (r == 0 || r == 180) grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kWallWid, kWallLen));
-			else grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kWallLen, kWallWid));
-		}
-		else if (type == "Checkpoint")
-		{
-			checkpoint.push_back(Checkpoint(checkpointMesh, crossMesh, x, 0, z, r));
-			if (r == 0 || r == 180)
-			{
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x - kCheckpointLen + kCheckpointRad, z, kCheckpointRad));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x + kCheckpointLen - kCheckpointRad, z, kCheckpointRad));
+struct TrackLink //Waypoints of two lanes that are level with each other, from a "Link laneA waypointA laneB waypointB" line
+{
+	unsigned int laneA;
+	unsigned int waypointA;
+	unsigned int laneB;
+	unsigned int waypointB;
+};
 
-				if (checkpoint.size() == 1) for (int i = 0; i < kMaxCars; i++) //If it's the first checkpoint add start positions
-				{
-					if (r == 0) startPos.push_back({ x + kStartPositions[i], z + kStartPosDistance });
-					else startPos.push_back({ x + kStartPositions[i], z - kStartPosDistance });
-				}
-			}
-			else
-			{
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x, z - kCheckpointLen + kCheckpointRad, kCheckpointRad));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x, z + kCheckpointLen - kCheckpointRad, kCheckpointRad));
+struct TrackHeader
+{
+	unsigned int magic;
+	unsigned int version;
+	float gridSize; //Width of the grid squares the collision lists were baked for
+	unsigned int size; //Size of the whole image in bytes
+
+	TrackSection objects; //ObjectInstance
+	TrackSection cells; //TrackCell
+	TrackSection boxXStart; //float, one array per box edge with each cell's list padded to kObstacleBlock
+	TrackSection boxXEnd;
+	TrackSection boxZStart;
+	TrackSection boxZEnd;
+	TrackSection sphereX; //float, shared by obstacles and trigger volumes and padded the same way
+	TrackSection sphereZ;
+	TrackSection sphereR; //Squared radius
+	TrackSection sphereType; //unsigned int, TriggerType bits of each sphere, 0 for obstacles and padding
+	TrackSection spherePayload; //int, bomb number of bomb and blast volumes
+	TrackSection lanes; //TrackRange into the waypoints
+	TrackSection waypoints; //Vector2D
+	TrackSection startPos; //Vector2D
+	TrackSection links; //TrackLink
+};
 
-				if (checkpoint.size() == 1) for (int i = 0; i < kMaxCars; i++) //If it's the first checkpoint add start positions
-				{
-					if (r == 90) startPos.push_back({ x + kStartPosDistance, z + kStartPositions[i] });
-					else startPos.push_back({ x - kStartPosDistance, z + kStartPositions[i] });
-				}
-			}
-		}
-		else if (type == "Hills")
-		{
-			hills = hillsMesh->CreateModel(x, kHillY, z);
-			hills->RotateY(r);
-			hills->Scale(kHillScale);
-		}
-		else if (type == "Walkway")
-		{
-			walkway.push_back(Object(walkwayMesh, x, 0, z, r));
-			walkway.back().m->Scale(kWalkwayScale);
-		}
-		else if (type == "Tank1")
-		{
-			tank.push_back(Object(tank1Mesh, x, 0, z, r));
-			tank.back().m->Scale(kTankScale);
-			grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x, z, kTankRad));
-		}
-		else if (type == "Tank2")
-		{
-			tank.push_back(Object(tank2Mesh, x, kTank2Y, z, r));
-			tank.back().m->Scale(kTankScale);
-			tank.back().m->RotateLocalX(kTank2Rot);
-			grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x, z, kTankRad));
-			fire.push_back(FireEmitter(particleMesh, { x, kTankFireHeight, z }));
-			grid[int(gs.x)][int(gs.z)].fire.push_back(BoundingSphere(x, z, kTankFireRad + 0.1f));
-		}
-		else if (type == "Skyscraper")
-		{
-			building.push_back(Object(skyscraperMesh, x, 0, z, r));
-			building.back().m->Scale(kSkyscraperScale);
+struct TriggerVolume //A trigger sphere while the level is being read
+{
+	BoundingSphere sphere;
+	unsigned int type; //TriggerType bits
+	int payload; //Bomb number for bomb and blast volumes
+};
 
-			float adjustment; //Model has to be moved a little because its center is not in the mesh's origin
-			if (r == 0 || r == 90) adjustment = kSkyscraperAdjustment;
-			else adjustment = -kSkyscraperAdjustment;
+struct BuilderSquare //Collision lists of a grid square while the level is being read
+{
+	vector <BoundingBox> boxObstacle;
+	vector <BoundingSphere> sphereObstacle;
+	vector <TriggerVolume> trigger;
+};
 
-			if (r == 0 || r == 180)
-			{
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z + adjustment, kSkyscraperLength1, kSkyscraperWidth1));
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z + adjustment, kSkyscraperLength2, kSkyscraperWidth2));
-			}
-			else
-			{
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x + adjustment, z, kSkyscraperWidth1, kSkyscraperLength1));
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x + adjustment, z, kSkyscraperWidth2, kSkyscraperLength2));
-			}
-		}
-		else if (type == "Skyscraper2")
-		{
-			building.push_back(Object(skyscraper2Mesh, x, 0, z, r));
-			building.back().m->Scale(kSkyscraper2Scale);
+struct TrackBuilder //Level data read from the text file, before it gets baked into an image
+{
+	vector <ObjectInstance> objects;
+	SparseGrid <BuilderSquare> grid; //Collision lists of every grid square something was put in
 
-			if (r == 0)
-			{
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Length, kSkyscraper2Width));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Length - kSkyscraper2Radius, z + kSkyscraper2Radius, kSkyscraper2Radius));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Length - kSkyscraper2Radius, z - kSkyscraper2Radius, kSkyscraper2Radius));
-			}
-			else if (r == 180)
-			{
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Length, kSkyscraper2Width));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Length + kSkyscraper2Radius, z + kSkyscraper2Radius, kSkyscraper2Radius));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Length + kSkyscraper2Radius, z - kSkyscraper2Radius, kSkyscraper2Radius));
-			}
-			else if (r == 90)
-			{
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Width, kSkyscraper2Length));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Radius, z - kSkyscraper2Length + kSkyscraper2Radius, kSkyscraper2Radius));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Radius, z - kSkyscraper2Length + kSkyscraper2Radius, kSkyscraper2Radius));
-			}
-			else if (r == 270)
-			{
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Width, kSkyscraper2Length));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Radius, z + kSkyscraper2Length - kSkyscraper2Radius, kSkyscraper2Radius));
-				grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Radius, z + kSkyscraper2Length - kSkyscraper2Radius, kSkyscraper2Radius));
-			}
-		}
-		else if (type == "Building")
-		{
-			building.push_back(Object(buildingMesh, x, 0, z, r));
-			building.back().m->Scale(kBuildingScale);
+	vector <vector <Vector2D>> path; //Waypoints of each AI lane
+	vector <TrackLink> links; //Where lanes are level with each other
+	vector <Vector2D> startPos; //Positions that cars start at
+	int checkpoints = 0;
+	int bombs = 0;
+
+	BuilderSquare& Square(float x, float z); //Lists of the grid square a position is in
+	void AddTrigger(unsigned int type, float x, float z, float radius, int payload = 0); //Add a trigger volume to the grid square its centre is in
+	void AddWaypoint(int lane, float x, float z); //Add a waypoint to the end of a lane, making the lane if it's new
+	bool ValidLanes(); //Check that no lane is left without waypoints and that links point at real waypoints
+	void AddObject(ObjectType type, float x, float z, float r); //Add an object to the instance table and its collision areas to the grid
+	void AddWorldEdges(); //Add world edges as box obstacles
+};
 
-			grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x, z, kBuildingWidth, kBuildingWidth)); //Big box
-			for (int i = -1; i < 2; i += 2) for (int j = -1; j < 2; j += 2)
-				grid[int(gs.x)][int(gs.z)].boxObstacle.push_back(BoundingBox(x + i * kBuildingWidth - i, z + j * kBuildingWidth - j, kBuildingWidh2, kBuildingWidh2)); //Small edge boxes
-		}
-		else if (type == "Tribune")
-		{
-			building.push_back(Object(tribuneMesh, x, 0, z, r));
-			building.back().m->Scale(kTribuneScale);
-			grid[int(gs.x)][int(gs.z)].sphereObstacle.push_back(BoundingSphere(x, z, kTribuneRad));
-		}
-		else if (type == "Smallestbush")
-		{
-			bush.push_back(Object(bushMesh, x, 0, z, r));
-			bush.back().m->Scale(kBushScale[0]);
-		}
-		else if (type == "Smallbush")
-		{
-			bush.push_back(Object(bushMesh, x, 0, z, r));
-			bush.back().m->Scale(kBushScale[1]);
-		}
-		else if (type == "Bush")
-		{
-			bush.push_back(Object(bushMesh, x, 0, z, r));
-			bush.back().m->Scale(kBushScale[2]);
-		}
-		else if (type == "Bigbush")
-		{
-			bush.push_back(Object(bushMesh, x, 0, z, r));
-			bush.back().m->Scale(kBushScale[3]);
-		}
-		else if (type == "Waypoint")
-		{
-			path[0].push_back({ x, z });
-		}
-		else if (type == "Waypoint2")
-		{
-			path[1].push_back({ x, z });
-		}
-		else if (type == "Slow")
-		{
-			grid[int(gs.x)][int(gs.z)].slowPoint.push_back(BoundingSphere(x, z, grid[int(gs.x)][int(gs.z)].kSpeedPointRange));
-		}
-		else if (type == "Fast")
-		{
-			grid[int(gs.x)][int(gs.z)].fastPoint.push_back(BoundingSphere(x, z, grid[int(gs.x)][int(gs.z)].kSpeedPointRange));
-		}
-		else if (type == "Bomb")
-		{
-			bomb.push_back(Bomb(bombMesh, particleMesh, x, z, r));
-		}
+struct Track //Compiled track image, either mapped from a file or built in memory
+{
+	vector <char> buffer; //Holds the image if it was compiled in memory
+	const char* image = nullptr;
+	size_t size = 0;
+	bool mapped = false;
+
+	const TrackHeader* Header() const { return (const TrackHeader*)image; }
+
+	template <class T>
+	TrackList <T> Section(TrackSection s, TrackRange r = { 0, 0xFFFFFFFF }) const //View of a section, or part of it
+	{
+		TrackList <T> list;
+		list.data = (const T*)(image + s.offset) + r.first;
+		list.count = (r.count == 0xFFFFFFFF) ? s.count : r.count;
+		return list;
 	}
-	lFile.close();
+};
 
-	//Add world edges as box obstacles
-	for (int i = 1; i < kGridSquares - 1; i++) grid[1][i].boxObstacle.push_back(BoundingBox(-kWorldLen, 0, 0, kWorldLen));
-	for (int i = 1; i < kGridSquares - 1; i++) grid[kGridSquares - 2][i].boxObstacle.push_back(BoundingBox(kWorldLen, 0, 0, kWorldLen));
-	for (int i = 1; i < kGridSquares - 1; i++) grid[i][1].boxObstacle.push_back(BoundingBox(0, -kWorldLen, kWorldLen, 0));
-	for (int i = 1; i < kGridSquares - 1; i++) grid[i][kGridSquares - 2].boxObstacle.push_back(BoundingBox(0, kWorldLen, kWorldLen, 0));
+bool ParseLevel(string levelFile, TrackBuilder &builder); //Read objects, waypoints and speed points from the level file
+void BakeTrack(TrackBuilder &builder, vector <char> &image); //Lay out the level data as a track image
+bool ValidTrack(const char* image, size_t size); //Check that an image is complete and was made for this version of the game
+bool SaveTrack(string trackFile, vector <char> &image); //Write an image to a file
+bool MapTrack(string trackFile, Track &track); //Map a compiled track file into memory, fails if it's missing or outdated
+bool CompileTrack(string levelFile, Track &track); //Parse and bake the level file in memory
+void UnloadTrack(Track &track); //Unmap or free the image
+void SetupGrid(Track &track, SparseGrid <GridSquare> &grid, const vector <int> &ids); //Point each grid square at its obstacles in the image, numbering them by where they are in it
 
-	/******Basic setup*****/
-	IMesh* skyMesh = myEngine->LoadMesh(kMeshSky);
-	IModel* sky = skyMesh->CreateModel(kPosSky.x, kPosSky.y, kPosSky.z);
+struct LaneSpline //An AI lane as a closed Catmull-Rom curve through its waypoints, sampled finely enough to be followed as a polyline
+{
+	static const int kSteps = 4; //Samples per waypoint
 
-	IMesh* groundMesh = myEngine->LoadMesh(kMeshGround);
-	IModel* ground = groundMesh->CreateModel(0, 0, 0);
+	vector <Vector2D> point; //Samples in order around the lane
+	vector <float> distance; //Arc length from the first sample to each one, with one more entry for the way back to the first
 
-	//Cars
-	IMesh* dummyMesh = myEngine->LoadMesh(kMeshDummy);
-	IMesh* carMesh = myEngine->LoadMesh(kMeshCar);
+	void Build(const vector <Vector2D> &waypoints); //Sample the curve and measure it
+	float Length() const { return distance.back(); }
+	int Sample(float s, int hint = -1) const; //Sample at the start of the segment a distance falls on, walking on from a sample at or before it if there is one, otherwise by binary search
+	Vector2D At(float s, int hint = -1) const; //Point a distance along the lane, wrapping around past the end
+};
+
+struct LanePoint //A sample on one of the lanes
+{
+	int lane;
+	int sample;
+};
+
+struct TrackData //Everything the simulation reads about the track, built once and never changed afterwards so every car, race and thread can share one copy
+{
+	Track image; //Compiled track the rest points into, unloaded along with the data
+	unsigned long long hash = 0; //Hash of the image, replays only play back on the track they were recorded on
+	SparseGrid <GridSquare> grid; //Obstacles of every grid square that has any
+	SparseGrid <GridSquare> near; //Everything that can touch a car in each square, from the square and the eight around it, packed into one block per square
+	vector <float> nearData; //Blocks the near lists point into
+	vector <int> nearId; //Obstacle numbers of the near lists
+	vector <int> obstacleId; //0, 1, 2... for the obstacles in the image, which holds each one once
+	TrackList <unsigned int> triggerType; //TriggerType bits of every sphere by id, 0 for obstacles
+	TrackList <int> triggerPayload; //Bomb number of every sphere by id
+	TrackList <ObjectInstance> objects; //Every object placed on the track
+	vector <ObjectInstance> checkpoint; //Checkpoints in the order they're crossed
+	vector <vector <Vector2D>> path; //Waypoints of each AI lane
+	vector <LaneSpline> lane; //Curve through each lane's waypoints that the AI follows
+	vector <vector <vector <int>>> laneMap; //laneMap[a][b][i] is the sample of lane b level with sample i of lane a, or -1 where b is too far away to switch to
+	SparseGrid <vector <LanePoint>> laneCells; //Samples of every lane in each grid square they pass through
+	vector <Vector2D> startPos; //Start grid
+
+	LanePoint NearestLane(Vector2D p, int onlyLane = -1) const; //Closest lane sample to a point, or closest sample of one lane
+	SweepHit Sweep(Vector2D from, Vector2D to, float radius) const; //First sphere or box obstacle a circle runs into on its way between two points, from the near list if it stays in one square
+	SweepHit SweepSquares(Vector2D from, Vector2D to, float radius) const; //Same, going through every grid square the move passes near
+	int Triggers(GridCoord square, Vector2D pos, float radius, int* inside, int maxInside) const; //Ids of the trigger volumes a circle in a square is in, up to maxInside, from the square's near list
+
+	TrackData() {}
+	TrackData(const TrackData&) = delete; //A copy would unload the image a second time
+	TrackData& operator = (const TrackData&) = delete;
+	~TrackData() { UnloadTrack(image); }
+};
+
+shared_ptr <const TrackData> ShareTrack(Track &track); //Move a loaded track into shared data and unpack its grid, checkpoints, lanes and start grid
+void BakeNeighbourhoods(TrackData &data); //Gather the obstacles and trigger volumes around every square into its near list
+void MapLanes(TrackData &data, TrackList <TrackLink> links); //Bucket the lane samples by grid square and work out which samples of each pair of lanes are level with each other
+shared_ptr <const TrackData> LoadTrackData(string levelFile, string trackFile, bool &mapped); //Map the compiled track if it's up to date, otherwise compile the level file, null if neither can be read
+int CompileTrackTool(string levelFile, string trackFile); //Offline track compiler, reports how long both ways of loading take
+int CollisionBenchTool(string levelFile, int queries); //Times the obstacle tests against the one-struct-at-a-time loop they replaced
+bool FileNewer(string file, string than); //True if the first file was modified after the second one
+double Milliseconds(chrono::high_resolution_clock::time_point start); //Time passed since a given point
+
+/****Race****/
+enum GameState { start, race, over };
+
+struct CarPairs //Sweep and prune broadphase, finds the cars close enough to collide with each other
+{
+	vector <int> sorted; //Car indices sorted by the start of their range on the sweep axis, kept between ticks so it's nearly sorted already
+	vector <float> sweepMin; //Range each car covered this tick on the axis the cars are most spread out on, from its previous position to its current one
+	vector <float> sweepMax;
+	vector <float> crossMin; //Same on the other axis
+	vector <float> crossMax;
+
+	vector <int> first; //Where each car's partners start in the partner list, with one more entry for the end of the last car's
+	vector <int> partner; //Cars each car may collide with, in order of index
+	vector <int> pairA; //Pairs found by the sweep, each once
+	vector <int> pairB;
+	vector <int> fill; //Next free place in each car's group while the partner list is filled
+
+	void Update(vector <HoverCar> &cars, int numOfCars, float reach); //Find every pair of cars that came within reach of each other on both axes
+};
+
+#ifdef CAR_BATCH_SSE
+__m128 Blend(__m128 mask, __m128 a, __m128 b); //a where the mask is set and b everywhere else, SSE2 has no blend instruction
+#endif
+
+struct CarBatch //What the AI steering and the movement of the cars read and write, with each value in its own array so that four cars are stepped at a time, without SSE each car steers and moves itself
+{
+	//Steering, per car
+	vector <char> steer; //Cars driven by the AI this tick
+	vector <float> goalX; //From the car to the point on its lane it steers towards
+	vector <float> goalZ;
+	vector <float> faceX; //Facing vector from the last tick
+	vector <float> faceZ;
+	vector <float> yaw;
+	vector <float> tilt;
+	vector <float> thMult;
+	vector <float> boostMult;
+	vector <float> newThrust;
+	vector <float> speedChangeCD;
+	vector <int> hp;
+	vector <int> racePos;
+	vector <int> ai; //Low HP slows computer-controlled cars down more
+	vector <float> goalStep; //How far the goal moves along the lane, 0 if the car is too far behind it
+
+	//Movement, per car
+	vector <float> posX;
+	vector <float> posZ;
+	vector <float> momX;
+	vector <float> momZ;
+	vector <float> thrustX;
+	vector <float> thrustZ;
+	vector <float> dragX;
+	vector <float> dragZ;
+	vector <float> drMult;
+
+	int Resize(int numOfCars); //Make room for every car, rounded up to a multiple of four, returns the rounded count
+	void Steer(vector <HoverCar> &cars, int numOfCars, bool everyone, float fTime); //Steer the computer-controlled cars, or every car that's alive, towards their goals and set their thrust
+	void Move(vector <HoverCar> &cars, int numOfCars, float fTime); //Move every car according to its momentum
+};
+
+const int kCarsPerTask = 16; //Cars each collision detection task looks at, so small races detect on one thread without waking any others
+const int kFiresPerTask = 8; //Tank fires each particle task updates
+
+struct CarContacts //What collision detection found for one car this tick, applied to the cars afterwards in car order
+{
+	GridCoord square; //Grid square the car is in
+	SweepHit obstacle; //Earliest obstacle on the car's move
+	Vector2D contact; //Where the car touched it
+	int trigger[kMaxTriggers]; //Trigger volumes the car is in once the obstacle has stopped it
+	int triggerCount = 0;
+	vector <int> touching; //Cars it overlaps, in the order of its partners
+};
+
+struct ThreadPool; //Threads kept waiting between ticks, defined with the batch simulation
+
+struct WorkQueue //Tasks waiting for one worker, which takes them from the front while idle workers steal from the back
+{
+	mutex lock;
+	deque <int> tasks;
+
+	void Push(int task); //Add a task to the front, where the worker takes its next one from
+	bool Pop(int &task, bool back); //Take a task from either end, false if the queue is empty
+};
 
+struct GraphTask //A phase of the tick, run once every task it depends on has finished
+{
+	const char* name;
+	function <void()> run;
+	vector <int> after; //Tasks it depends on
+	vector <int> next; //Tasks that depend on it
+	double time = 0.0; //Milliseconds spent in it while the graph was timed
+};
+
+struct TaskGraph //Phases of a tick as tasks that wait for the ones they depend on, each ready task is taken by whichever thread is free and idle threads steal from busy ones
+{
+	vector <GraphTask> tasks; //In the order they were added, which is an order they can run in one after another
+	unique_ptr <atomic <int>[]> pending; //Dependencies of each task that haven't finished in this run
+	vector <WorkQueue> queues; //Ready tasks, one queue per thread
+	atomic <int> left; //Tasks that haven't finished in this run
+	atomic <int> queued{ 0 }; //Ready tasks no thread has taken yet
+	atomic <int> parked{ 0 }; //Threads waiting for a task to be queued or the run to end
+	mutex parkLock;
+	condition_variable wake; //Signalled when a task is queued while threads are parked, and when the last task finishes
+	bool timing = false; //Time every task, for finding the critical path
+	long long runs = 0; //Runs timed
+
+	void Clear(); //Remove every task
+	int Add(const char* name, function <void()> run, vector <int> after = {}); //Add a task that runs once the given ones are done, returns its number
+	void Run(ThreadPool* pool); //Run every task once, on the pool's threads if there is one
+	void Work(int w); //Loop of each thread, w is its queue
+	void Ready(int w, int t); //Queue a task whose dependencies have all finished, waking a parked thread for it
+	void Wake(bool all); //Wake one or every parked thread, if there are any
+	void Execute(int t); //Run a task, timing it if asked to
+	double CriticalPath(vector <char> &onPath) const; //Longest chain of tasks by their average times in milliseconds, marking the tasks on it
+};
+struct WorldSnapshot; //What the render thread draws, defined with the simulation thread
+
+struct Race //Everything stepped by the simulation, advanced in fixed ticks independently of rendering
+{
+	//Track
+	shared_ptr <const TrackData> track; //Shared with the cars and with any other race on the same track
+	vector <Checkpoint> checkpoint;
+	BombManager bombs;
+	vector <FireEmitter> fire; //Fires of the burning tanks
+	vector <Vector2D> startPos; //Positions that cars start at
+	RandomStream random; //Shuffles the start grid
+
+	//Cars
 	vector <HoverCar> cars;
 	int numOfCars = kMaxCars;
+	CarPairs carPairs; //Cars close enough to collide this tick
+	CarBatch carBatch; //Steers and moves the cars
+	vector <CarContacts> contacts; //Collisions found this tick, one entry per car
+	ThreadPool* pool = nullptr; //Runs the tick's tasks on more threads, null runs them one after another on the thread running the race
+	int carsPerTask = kCarsPerTask; //Cars in each detection task
+
+	//Tick tasks
+	TaskGraph graph; //Made on the first tick
+	int graphCarsPerTask = 0; //Cars per detection task the graph was made with
+	float step = 0.0f; //Time the running tick simulates
+	PlayerInput keys; //Player's keys for it
+	GameState phase = start; //Game state it started in, which decides what it does
 
-	random_shuffle(startPos.begin(), (startPos.begin() + startPos.size() - 1)); //Shuffle the vector of starting positions to make the cars start at random spots
-
-	for (int i = 0; i < numOfCars; i++) //Create cars at random positions
-	{
-		Vector2D sPos = startPos[i];
-		stringstream n;
-		n << "CAR" << (i + 1);
-		if (i == 0) cars.push_back(HoverCar(dummyMesh, carMesh, particleMesh, path, sPos.x, sPos.z, "YOU", i, 0));
-		else cars.push_back(HoverCar(dummyMesh, carMesh, particleMesh, path, sPos.x, sPos.z, n.str(), i, 1));
-	}
+	//Particles
+	ParticlePool particles; //Shared by every emitter on the track
 
-	Camera camera(myEngine, dummyMesh, cars[0]);
+	//Meshes
+	IMesh* dummyMesh; //Also used for the camera's dummy
 
-	UI ui(myEngine);
+	//Player's view, the render thread gets these through snapshots
+	Hud hud; //Kept up to date with the player's status
+	int shakes = 0; //Explosions near the player, each one shakes the camera
 
 	//States
-	enum GameState { start, race, over };
 	GameState gameState = start; //Overall state of the game, changes to over if player car dies or finishes race
 	GameState raceState = start; //State of the race, changes to over if any car finishes the race
+	float countdown = -1.0f; //Time left before the race starts, -1 until the player starts the countdown
+	float updateSpeed = 0.0f; //Used to limit the frequency of UI speed updates
+	long long tick = 0; //Number of ticks simulated
+
+	vector <int> order; //Car indices from first place to last
+
+	void Build(I3DEngine* engine, shared_ptr <const TrackData> trackData, int carCount, bool player, unsigned int seed); //Create the checkpoints, bombs, tank fires and cars, car 0 is the player's unless every car is computer controlled, with every random stream made from the seed
+	void AddStartRows(); //Add rows behind the start grid until there is a position for every car
+	void Restart(); //Put the cars back on the start grid and reset the checkpoints and UI
+	void Rank(); //Sort the cars by track progress to get their race positions
+	void Tick(float tickTime, PlayerInput input); //Step the whole simulation forward by one tick
+	void BuildTickGraph(); //Split the tick into tasks, each waiting for the tasks that change what it reads
+	void Checkpoints(); //Move cars that went through their next checkpoint on to the one after it, and finish their laps and race
+	void DetectCollisions(int first, int last); //Find the obstacle, trigger volumes and cars each car from first to last - 1 touches, only reading the race so cars can be split between threads
+	void ResolveCollisions(); //Apply every car's contacts in car order, so the race comes out the same however detection was split
+	void CarTriggers(int i, const int* inside, int count); //Send car i an event for each trigger volume it went into, stayed in or left, from the volumes it's in now
+	void OnTrigger(int i, TriggerEvent e); //What happens to a car going into, staying in or leaving a volume, by the volume's type bits
+	void Capture(WorldSnapshot &snapshot) const; //Copy everything the render thread draws
+	void Present(const WorldSnapshot &snapshot, float alpha); //Move the models to a snapshot, with the cars between its last tick and the next one
+	bool Finished(); //True once every car has finished the race or died
+	void Serialize(SimState &s); //Write the whole simulation to a snapshot or read it back
+	void WriteResults(ostream &out, int raceNo, unsigned int seed); //Write a CSV row for each car with its place, lap times, collisions and whether it died
+};
 
-	//Frame speed tracker
-	float frameTime;
-	myEngine->Timer();
+/****Replays****/
+struct Replay //Recorded race: the seed and the player's keys for every tick, with keyframes of the whole simulation so playback can seek
+{
+	unsigned int seed = 0;
+	float simRate = kSimRate;
+	int carCount = kMaxCars;
+	unsigned long long trackHash = 0; //Replays only play back on the track they were recorded on
+
+	vector <unsigned char> input; //Player's keys used by each tick
+	vector <long long> keyTick; //Tick each keyframe was taken at
+	vector <vector <char>> keyframe; //Keyframes, each stored as the run length encoded difference from the one before
+	SimState last; //Latest keyframe in full, the next one is stored as the difference from it
+
+	//Keyframes are encoded on a thread of their own, so the tick that takes one only pays for copying the race out
+	SimState next; //Keyframe waiting to be encoded, its buffer is reused for every keyframe
+	vector <char> changes; //Encoder's scratch space
+	thread encoder; //Started with the first keyframe
+	mutex encodeLock;
+	condition_variable encodeWake;
+	bool encodePending = false; //Next holds a keyframe the encoder hasn't finished with
+	bool encodeQuit = false;
+	double recordTime = 0.0; //Milliseconds the ticks spent taking keyframes
+	double encodeTime = 0.0; //Milliseconds the encoder spent on them
+
+	~Replay(); //Stop the encoder
+	void Begin(unsigned int raceSeed, float rate, int cars, const TrackData &track); //Start a new recording
+	void Record(Race &race, PlayerInput keys); //Keep the keys a tick is about to use, and take a keyframe every kKeyframeTime seconds
+	void Encode(); //Loop of the encoder thread
+	void Flush(); //Wait until every keyframe taken so far is encoded
+	long long Ticks() { return (long long)input.size(); }
+	PlayerInput Input(long long tick); //Keys used by a tick
+	void Keyframe(int index, SimState &state); //Rebuild a keyframe from the differences before it
+	void Seek(Race &race, long long tick); //Restore the last keyframe before a tick and simulate up to it
+	bool Save(string file); //Write the replay to a file
+	bool Load(string file); //Read a replay, false if it's missing or from an older version
+};
 
-	float updateSpeed = 0.0f; //Used to limit the frequency of UI speed updates
+void PutNumber(vector <char> &out, unsigned long long n); //Append a number using as few bytes as it needs
+unsigned long long GetNumber(const vector <char> &in, size_t &pos); //Read a number written by PutNumber
+void EncodeDelta(const vector <char> &state, const vector <char> &previous, vector <char> &out, vector <char> &changes); //Run length encode the bytes that changed since the previous state, changes is scratch space kept between calls
+void DecodeDelta(const vector <char> &delta, vector <char> &state); //Turn the previous state into the one a delta was made from
+unsigned long long Hash(const char* data, size_t size); //FNV-1a hash, used to match replays to tracks and to compare simulation states
+int ReplayCheckTool(string replayFile, int threads); //Play a replay through, then seek around it and check every seek ends in the same state, and play it again with the tick's tasks on more threads and on the simulation thread
 
-	// The main game loop, repeat until engine is stopped
-	while (myEngine->IsRunning())
+/****Simulation thread****/
+struct WorldSnapshot //Everything the render thread draws, copied out of the race after a tick so drawing never reads the race while it's being stepped
+{
+	long long tick = -1; //Tick the race had got to
+	long long commands = 0; //Commands the simulation had carried out
+	vector <CarPose> cars;
+	ParticleSnapshot particles;
+	vector <BombState> bombs;
+	vector <char> crosses; //Checkpoints showing their cross
+	Hud hud;
+	float boostTimer = kBoostTime; //Player's, for the boost bar
+	int shakes = 0; //Explosions near the player so far
+};
 
+struct SnapshotBuffer //Two snapshots, the simulation fills one while the render thread draws the other, handed over without locks
+{
+	WorldSnapshot slot[2];
+	atomic <int> published{ -1 }; //Slot holding the latest finished snapshot, -1 until there is one
+	atomic <int> reading{ -1 }; //Slot the render thread is drawing from, -1 while it isn't drawing
+	int writing = 0; //Slot the simulation is filling, only used by the simulation
+
+	WorldSnapshot& Back(); //Slot the simulation can fill, waits if the render thread is still drawing from it
+	void Publish(); //Make the slot Back returned the latest
+	const WorldSnapshot* Acquire(); //Latest snapshot, which isn't written to until Release, null before the first one
+	void Release(); //Done drawing from the snapshot
+};
+
+struct SimCommand //Something for the simulation to do, carried out in the order the render thread asked for them
+{
+	int seek; //Ticks to seek the replay by, 0 to run a tick instead
+	unsigned char keys; //Player's keys for the tick, packed
+};
+
+struct SimThread //Steps the race on a thread of its own, given the commands of each frame by the render thread and publishing a snapshot once it has caught up with them
+{
+	static const int kQueueSize = 1024; //Commands the render thread can get ahead by before it has to wait
+
+	Race* race;
+	Replay* replay;
+	bool playback; //Ticks play the replay's keys back instead of recording the pushed ones
+	float simStep; //Time simulated by each tick
+	SnapshotBuffer snapshots;
+
+	//Ring of commands, written only by the render thread and read only by the simulation thread
+	SimCommand queue[kQueueSize];
+	atomic <long long> pushed{ 0 }; //Commands put in the ring
+	atomic <long long> done{ 0 }; //Commands carried out
+	atomic <bool> quit{ false };
+
+	thread worker; //Not started when the simulation runs on the render thread
+
+	SimThread(Race* simRace, Replay* simReplay, bool play, float step); //Constructor
+	void Start(bool threaded); //Publish the starting state, and hand the race to a thread of its own if threaded
+	void Push(SimCommand c); //Queue a command for the simulation thread, or carry it out straight away if there isn't one
+	void Stop(); //Let the simulation thread finish the queue and wait for it
+	void Run(); //Loop of the simulation thread
+	void Do(SimCommand c); //Seek or run a tick
+	void Publish(); //Snapshot the race for the render thread
+};
+
+/****Batch simulation****/
+void RunParallel(int taskCount, int threadCount, function <void(int)> task); //Run tasks 0 to taskCount - 1 on a pool of threads that steal work from each other
+
+struct ThreadPool //Threads that wait between jobs, for work too short to start threads for each time like a tick's tasks
+{
+	vector <thread> workers;
+	mutex lock;
+	condition_variable wake; //Workers wait on this for a new job
+	condition_variable done; //Run waits on this for the workers to finish the job
+	function <void(int)> job;
+	int jobTasks = 0;
+	atomic <int> next; //Next task of the job to take
+	int working = 0; //Workers that haven't finished the current job yet
+	long long generation = 0; //Counts jobs, so a worker knows when there's a new one
+	bool quit = false;
+
+	ThreadPool(int threadCount); //Start threadCount - 1 workers, the thread calling Run is the last one
+	~ThreadPool();
+	int Threads() const { return int(workers.size()) + 1; }
+	void Run(int taskCount, function <void(int)> task); //Run tasks 0 to taskCount - 1 on every thread of the pool, returns once they're all done
+	void Work(); //Loop of each worker
+	void Take(); //Run tasks of the current job until there are none left
+};
+#ifdef HEADLESS
+int BatchTool(int argc, char* argv[]); //Run many races with only computer controlled cars across all cores and write the results to a CSV file
+int AIBenchTool(int carCount, int ticks); //Times the batched AI steering and movement against the one car at a time functions and checks both drive the cars the same way
+int TickBenchTool(int carCount, int ticks, int maxThreads); //Times every task of the tick and the critical path through them, then the whole tick on 1 to maxThreads threads, checking each gives the same race
+int RandomBenchTool(int count, int rounds); //Times filling count random numbers at once against drawing them one at a time and checks both give the same numbers
+#endif
+
+/****Profiling****/
+//Scoped timers for finding where the frame goes, only compiled in when PROFILING is defined
+#ifdef PROFILING
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_NAME(a, b) PROFILE_JOIN(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_NAME(profileScope, __LINE__)(name) //Time from here to the end of the enclosing block
+
+struct ProfileEvent //One timed scope
+{
+	const char* name;
+	long long start; //Nanoseconds since the program started
+	long long end;
+	int depth; //Number of timed scopes it's inside of
+};
+
+struct ProfileBuffer //Latest scopes timed on one thread, the oldest get overwritten once it's full
+{
+	static const int kSize = 1 << 16;
+
+	vector <ProfileEvent> events = vector <ProfileEvent>(kSize);
+	unsigned long long count = 0; //Events recorded so far, the next one goes in count % kSize
+	int depth = 0; //Scopes open right now
+	int thread = 0; //Thread number used in the trace
+};
+
+struct ProfileScope //Records how long the block it's declared in took to the thread's buffer when the block ends
+{
+	ProfileBuffer* buffer;
+	const char* name;
+	long long start;
+
+	ProfileScope(const char* scopeName);
+	~ProfileScope();
+};
+
+struct ProfileSummary //Average time per frame spent in each scope over the last second, drawn in the corner of the screen
+{
+	const string kFont = "Consolas";
+	const int kFontSize = 14;
+	const int kX = 10;
+	const int kY = 10;
+	const int kLineHeight = 15;
+	const long long kWindow = 1000000000; //Nanoseconds averaged over
+	const float kRefresh = 0.5f; //Seconds between text updates
+
+	IFont* font;
+	float timer = 0.0f;
+	vector <string> lines;
+
+	ProfileSummary(I3DEngine* e);
+	void Update(float frameTime); //Recount the calling thread's scopes every kRefresh seconds and draw the result
+};
+
+vector <unique_ptr <ProfileBuffer>> profileBuffers; //Every thread's buffer, kept after the thread ends so the trace can be written
+mutex profileLock;
+thread_local ProfileBuffer* threadProfile = nullptr;
+
+long long ProfileNow(); //Nanoseconds since the program started
+ProfileBuffer* ThreadProfile(); //The calling thread's buffer, made the first time it times something
+bool WriteChromeTrace(string file); //Write every buffered scope in the Chrome trace format, to be opened in chrome://tracing or ui.perfetto.dev
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+int main(int argc, char* argv[])
+{
+	//Offline track compiler
+	if (argc > 1 && string(argv[1]) == "-compile")
 	{
-		// Draw the scene
-		myEngine->DrawScene();
-		frameTime = myEngine->Timer(); //Get number of frames needed to draw scene
+		return CompileTrackTool(argc > 2 ? argv[2] : kLevelFile, argc > 3 ? argv[3] : kTrackFile);
+	}
 
-		/**** Update your scene each frame here ****/
+	//Obstacle test benchmark
+	if (argc > 1 && string(argv[1]) == "-bench-collision")
+	{
+		return CollisionBenchTool(argc > 2 ? argv[2] : kLevelFile, argc > 3 ? atoi(argv[3]) : 100000);
+	}
 
-		//Particles
-		if (fire.size() > 0) for (size_t i = 0; i < fire.size(); i++) fire[i].Update(frameTime, &camera.camera, 1); //Update each fire emitter's particles
+#ifdef HEADLESS
+	//Batch of races with no player, for tuning the AI
+	if (argc > 1 && string(argv[1]) == "-batch")
+	{
+		return BatchTool(argc, argv);
+	}
 
-		//Start
-		if (gameState == start)
-		{
-			if (myEngine->KeyHit(kKeyStart) && ui.countdown == -1) ui.countdown = kMaxCount; //Start the countdown
-			if (ui.countdown >= 0) if (ui.Countdown())
-			{
-				//After countdown passes start race
-				gameState = race;
-				raceState = race;
-			}
-		}
-		//Race
-		else if (gameState == race)
-		{
-			//Car input
-			cars[0].Controls(myEngine); //Take input to move the player car
+	//AI update benchmark
+	if (argc > 1 && string(argv[1]) == "-bench-ai")
+	{
+		return AIBenchTool(argc > 2 ? atoi(argv[2]) : 64, argc > 3 ? atoi(argv[3]) : int(kSimRate * 60.0f));
+	}
 
-			//Car timer
-			for (int i = 0; i < numOfCars; i++) cars[i].UpdateTime();
+	//Tick task graph benchmark
+	if (argc > 1 && string(argv[1]) == "-bench-tick")
+	{
+		return TickBenchTool(argc > 2 ? atoi(argv[2]) : 64, argc > 3 ? atoi(argv[3]) : int(kSimRate * 20.0f), argc > 4 ? atoi(argv[4]) : 16);
+	}
 
-			//AI movement
-			for (int i = 1; i < numOfCars; i++) cars[i].AIFollowPath();
+	//Random number benchmark
+	if (argc > 1 && string(argv[1]) == "-bench-random")
+	{
+		return RandomBenchTool(argc > 2 ? atoi(argv[2]) : ParticlePool::kSpawnBatch * ParticlePool::kSpawnRandoms, argc > 3 ? atoi(argv[3]) : 200000);
+	}
 
-			//Checkpoint checks
-			for (int i = 0; i < numOfCars; i++)
-			{
-				//If it's AI then the checkpoint doesn't actually need to be crossed - a wider collision box is used for the ckeckpoint
-				if ((i == 0 && checkpoint[cars[i].nextCheck].check.Collision(&cars[i]) != none) || (i > 0 && checkpoint[cars[i].nextCheck].checkWide.Collision(&cars[i]) != none))
-				{
-					if (i == 0) checkpoint[cars[0].nextCheck].ShowCross();
+	//Replay check
+	if (argc > 1 && string(argv[1]) == "-check-replay")
+	{
+		return ReplayCheckTool(argc > 2 ? argv[2] : kReplayFile, argc > 3 ? atoi(argv[3]) : max(2, int(thread::hardware_concurrency())));
+	}
 
-					cars[i].nextCheck++;
+	//HUD allocation check
+	if (argc > 1 && string(argv[1]) == "-check-hud")
+	{
+		return HudCheckTool();
+	}
+#endif
 
-					if (cars[i].nextCheck >= checkpoint.size())
-					{
-						cars[i].nextCheck = 0;
-						cars[i].lap++;
-
-						if (cars[i].lap > kLaps) //If finished race
-						{
-							if (raceState == race)
-							{
-								ui.UpdateWinner(cars[i].name, GetTime(cars[i].raceTime)); //Set end message
-								raceState = over; //The winner can't be overridden
-							}
-
-							if (i == 0) //End game if player
-							{
-								ui.ShowEndStatus(); //Start showing end message
-								gameState = over;
-							}
-						}
-					}
-					if (i == 0) ui.UpdateStatus(cars[0].nextCheck, cars[0].lap, checkpoint.size()); //Update status to reflect position changes
-				}
-			}
-		}
-		//Over
-		else if (gameState == over)
+	// Create a 3D engine (using TLX engine here) and open a window for it
+	I3DEngine* myEngine = New3DEngine(kTLX);
+	myEngine->StartWindowed();
+
+	//Options
+	float simRate = kSimRate; //Simulation ticks per second
+	unsigned int seed = (unsigned int)time(NULL); //Same seed and inputs give the same race
+	int carCount = kMaxCars; //Cars in the race, more than fit on the start line are put in rows behind it
+	string recordFile = kReplayFile; //The race is recorded here
+	string replayFile; //Recording to play back instead of taking the player's input
+	float seekTime = 0.0f; //Point in the recording playback starts from
+	int threads = 1; //Threads collision detection is spread over, any number gives the same race
+	bool simThread = false; //Step the race on a thread of its own while this one draws
+#ifdef PROFILING
+	string traceFile = kTraceFile; //Timed scopes are written here at the end
+#endif
+#ifdef HEADLESS
+	//Headless runs are driven by a scripted input file and a fixed clock instead of the keyboard and real time
+	myEngine->frameLimit = kHeadlessFrames;
+#endif
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		string option = argv[i];
+		if (option == "-rate") simRate = float(atof(argv[i + 1]));
+		else if (option == "-seed") seed = (unsigned int)atoll(argv[i + 1]);
+		else if (option == "-cars") carCount = atoi(argv[i + 1]);
+		else if (option == "-record") recordFile = argv[i + 1];
+		else if (option == "-replay") replayFile = argv[i + 1];
+		else if (option == "-seek") seekTime = float(atof(argv[i + 1]));
+		else if (option == "-threads") threads = atoi(argv[i + 1]);
+		else if (option == "-sim-thread") simThread = atoi(argv[i + 1]) != 0;
+#ifdef PROFILING
+		else if (option == "-trace") traceFile = argv[i + 1];
+#endif
+#ifdef HEADLESS
+		else if (option == "-frames") myEngine->frameLimit = atoll(argv[i + 1]);
+		else if (option == "-dt") myEngine->frameTime = float(atof(argv[i + 1]));
+		else if (option == "-input" && !myEngine->LoadInputScript(argv[i + 1])) cout << "Could not read " << argv[i + 1] << endl;
+#endif
+	}
+
+	//Playing a replay back uses the race settings it was recorded with
+	Replay replay;
+	bool playback = !replayFile.empty();
+	if (playback)
+	{
+		if (!replay.Load(replayFile))
 		{
-			//Move cars
-			for (int i = 0; i < numOfCars; i++) cars[i].AIFollowPath(); //All cars that are not dead are controlled by computer
+			cout << "Could not read " << replayFile << endl;
+			myEngine->Delete();
+			return 1;
+		}
+		seed = replay.seed;
+		simRate = replay.simRate;
+		carCount = replay.carCount;
+	}
+	if (simRate <= 0.0f) simRate = kSimRate;
+	carCount = min(max(carCount, 1), kMaxRaceCars);
 
-			//Reset level
-			if (myEngine->KeyHit(kKeyRestart))
-			{
-				//Change game state
-				gameState = start;
-				raceState = start;
+	// Add default folder for meshes and other media
+	myEngine->AddMediaFolder(kMediaFolder);
 
-				//Reset cars
-				random_shuffle(startPos.begin(), (startPos.begin() + startPos.size() - 1)); //Shuffle the vector of starting positions to make the cars start at random spots
-				for (int i = 0; i < numOfCars; i++)
-				{
-					Vector2D sPos = startPos[i];
-					stringstream n;
-					cars[i].Reset(sPos.x, sPos.z);
-				}
+	/**** Set up your scene here ****/
 
-				//Reset checkpoints
-				for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].HideCross();
+	//Object meshes
+	IMesh* hillsMesh = myEngine->LoadMesh(kMeshHills);
+	IMesh* isleMesh = myEngine->LoadMesh(kMeshIsle);
+	IMesh* isle2Mesh = myEngine->LoadMesh(kMeshIsle2);
+	IMesh* wallMesh = myEngine->LoadMesh(kMeshWall);
+	IMesh* walkwayMesh = myEngine->LoadMesh(kMeshWalkway);
+	IMesh* tribuneMesh = myEngine->LoadMesh(kMeshTribune);
+	IMesh* skyscraperMesh = myEngine->LoadMesh(kMeshSkyscraper);
+	IMesh* skyscraper2Mesh = myEngine->LoadMesh(kMeshSkyscraper2);
+	IMesh* buildingMesh = myEngine->LoadMesh(kMeshBuilding);
+	IMesh* bushMesh = myEngine->LoadMesh(kMeshBush);
+	IMesh* tank1Mesh = myEngine->LoadMesh(kMeshTank1);
+	IMesh* tank2Mesh = myEngine->LoadMesh(kMeshTank2);
 
-				//Reset UI
-				ui.Reset();
-			}
-		}
+	/*****Load track****/
+	//Use the compiled track if there is an up to date one, otherwise compile the level file in memory
+	chrono::high_resolution_clock::time_point loadStart = chrono::high_resolution_clock::now();
+	bool trackMapped;
+	shared_ptr <const TrackData> track = LoadTrackData(kLevelFile, kTrackFile, trackMapped);
+	if (!track)
+	{
+		cout << "Could not load " << kLevelFile << endl;
+		myEngine->Delete();
+		return 1;
+	}
+	double loadTime = Milliseconds(loadStart);
 
-		//Compare race position
-		for (int i = 0; i < numOfCars; i++) for (int j = 0; j < numOfCars; j++) //Check each pair of cars
+	if (playback && track->hash != replay.trackHash)
+	{
+		cout << replayFile << " was recorded on a different track" << endl;
+		myEngine->Delete();
+		return 1;
+	}
 
-			if (i != j) cars[i].ComparePosition(&cars[j], checkpoint[cars[i].nextCheck].m); //Compare if it's a different car
+	const TrackList <ObjectInstance> &objects = track->objects;
 
+	Race myRace; //Simulated part of the game
 
-		//Update
-		updateSpeed += frameTime; //Timer used to limit speed updates
-		if (updateSpeed > kUpPerSec)
+	//Object arrays
+	IModel* hills;
+	vector <Object> isle;
+	vector <Object> wall;
+	vector <Object> walkway;
+	vector <Object> building;
+	vector <Object> bush;
+	vector <Object> tank;
+
+	/*****Build level****/
+	chrono::high_resolution_clock::time_point buildStart = chrono::high_resolution_clock::now();
+
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		float x = objects[i].x;
+		float z = objects[i].z;
+		float r = objects[i].r;
+
+		//Create a model for each object and put it in an array that matches its type
+		switch (objects[i].type)
 		{
-			ui.UpdateGeneral(sqrt(cars[0].momentum.Length()) * kScale * kMpsToKmph, GetTime(cars[0].raceTime), cars[0].racePos, numOfCars); //Show current speed
-			updateSpeed = 0.0f;
+		case objIsle:
+			isle.push_back(Object(isleMesh, x, 0, z, r));
+			break;
+		case objIsle2:
+			isle.push_back(Object(isle2Mesh, x, 0, z, r));
+			break;
+		case objWall:
+			wall.push_back(Object(wallMesh, x, 0, z, r));
+			break;
+		case objHills:
+			hills = hillsMesh->CreateModel(x, kHillY, z);
+			hills->RotateY(r);
+			hills->Scale(kHillScale);
+			break;
+		case objWalkway:
+			walkway.push_back(Object(walkwayMesh, x, 0, z, r));
+			walkway.back().m->Scale(kWalkwayScale);
+			break;
+		case objTank1:
+			tank.push_back(Object(tank1Mesh, x, 0, z, r));
+			tank.back().m->Scale(kTankScale);
+			break;
+		case objTank2:
+			tank.push_back(Object(tank2Mesh, x, kTank2Y, z, r));
+			tank.back().m->Scale(kTankScale);
+			tank.back().m->RotateLocalX(kTank2Rot);
+			break;
+		case objSkyscraper:
+			building.push_back(Object(skyscraperMesh, x, 0, z, r));
+			building.back().m->Scale(kSkyscraperScale);
+			break;
+		case objSkyscraper2:
+			building.push_back(Object(skyscraper2Mesh, x, 0, z, r));
+			building.back().m->Scale(kSkyscraper2Scale);
+			break;
+		case objBuilding:
+			building.push_back(Object(buildingMesh, x, 0, z, r));
+			building.back().m->Scale(kBuildingScale);
+			break;
+		case objTribune:
+			building.push_back(Object(tribuneMesh, x, 0, z, r));
+			building.back().m->Scale(kTribuneScale);
+			break;
+		case objSmallestBush:
+		case objSmallBush:
+		case objBush:
+		case objBigBush:
+			bush.push_back(Object(bushMesh, x, 0, z, r));
+			bush.back().m->Scale(kBushScale[objects[i].type - objSmallestBush]);
+			break;
 		}
-		ui.Update(frameTime, cars[0].boostTimer); //Show updated UI text
+	}
 
-		for (int i = 0; i < numOfCars; i++) cars[i].Update(frameTime, &camera.camera); //Move cars according to their momentums
-		camera.Update(myEngine, frameTime, &cars[0]); //Move camera
+	cout << "Track loaded from " << (trackMapped ? kTrackFile + " (mapped)" : kLevelFile + " (parsed)") << " in " << loadTime << " ms, "
+		<< objects.size() << " objects built in " << Milliseconds(buildStart) << " ms" << endl;
 
-		for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].Update(frameTime); //Update checkpoint (make cross disappear)
+	/******Basic setup*****/
+	IMesh* skyMesh = myEngine->LoadMesh(kMeshSky);
+	IModel* sky = skyMesh->CreateModel(kPosSky.x, kPosSky.y, kPosSky.z);
 
-		//Collision detection
-		for (int i = 0; i < numOfCars; i++)
-		{
-			float x = cars[i].dummy->GetX();
-			float z = cars[i].dummy->GetZ();
-			Vector2D gs = GetCoord(x, z); //Current grid square
-			cars[i].currentSquare = gs;
+	IMesh* groundMesh = myEngine->LoadMesh(kMeshGround);
+	IModel* ground = groundMesh->CreateModel(0, 0, 0);
 
-			bool hit = 0; //True if there's a collision
+	//Checkpoints, bombs, tank fires and cars
+	myRace.Build(myEngine, track, carCount, true, seed);
+	vector <HoverCar> &cars = myRace.cars;
+	ThreadPool pool(max(threads, 1));
+	myRace.pool = &pool;
 
-			//Check the current and nearby squares for collisions
-			for (int k = -1; k <= 1; k++) if (int(gs.x) + k >= 0 && int(gs.x) + k <= kGridSquares - 1) for (int l = -1; l <= 1; l++) if (int(gs.z) + l >= 0 && int(gs.z) + l <= kGridSquares - 1)
-			{
-				//Fire collision
-				if (grid[int(gs.x) + k][int(gs.z) + l].fire.size() > 0) //If there are fires in the square
-					for (size_t j = 0; j < grid[int(gs.x) + k][int(gs.z) + l].fire.size(); j++) //Go through each
-					{
-						if (grid[int(gs.x) + k][int(gs.z) + l].fire[j].Collision(&cars[i])) //If collision occurred
-						{
-							cars[i].burnTimer = cars[i].kBurnTime; //Update burn time
-							break;
-						}
-					}
+	Camera camera(myEngine, myRace.dummyMesh, cars[0]);
+	UI ui(myEngine);
 
-				//Sphere collision
-				if (grid[int(gs.x) + k][int(gs.z) + l].sphereObstacle.size() > 0) //If there are sphere obstacles in the grid square
-				{
-					for (size_t j = 0; j < grid[int(gs.x) + k][int(gs.z) + l].sphereObstacle.size(); j++) //Go through each
-					{
-						if (grid[int(gs.x) + k][int(gs.z) + l].sphereObstacle[j].Collision(&cars[i])) //If collision occurred
-						{
-							cars[i].SphereCollision(j); //Change momentum and apply damage
+	//Replay
+	if (!playback) replay.Begin(seed, simRate, carCount, *track); //Record the race
+	else if (seekTime > 0.0f) replay.Seek(myRace, (long long)(seekTime * simRate)); //Start playback part way through
 
-							hit = 1;
-							break; //Break to avoid getting stuck between two objects
-						}
-					}
-				}
+	//Frame speed tracker
+	float frameTime;
+	myEngine->Timer();
 
-				//Box collision
-				if (!hit && grid[int(gs.x) + k][int(gs.z) + l].boxObstacle.size() > 0) //If no collision was detected before and there are box obstacles in the grid square
-				{
-					for (size_t j = 0; j < grid[int(gs.x) + k][int(gs.z) + l].boxObstacle.size(); j++) //Go through each
-					{
-						ColAxis a = grid[int(gs.x) + k][int(gs.z) + l].boxObstacle[j].Collision(&cars[i]); //Check if collision happened and at what direction
-						if (a != none)  //If collision occurred
-						{
-							cars[i].BoxCollision(j, a); //Change momentum and apply damage
-
-							hit = 1;
-							break; //Break to avoid getting stuck between two objects
-						}
-					}
-				}
+	//Fixed simulation ticks, decided here and carried out by the simulation, which only hands back snapshots to draw
+	const float simStep = 1.0f / simRate; //Time simulated by each tick
+	float simTime = 0.0f; //Time waiting to be simulated
+	PlayerInput input;
+	SimThread sim(&myRace, &replay, playback, simStep);
+	sim.Start(simThread); //From here on only the simulation touches the race, apart from the models
 
-				//Car collision
-				if (!hit) for (int m = 0; m < numOfCars; m++)  //If no collision was detected before and there are other cars nearby
-					if (m != i && cars[m].currentSquare.x == gs.x + k && cars[m].currentSquare.z == gs.z + l && cars[m].colIndexCar != i) //Check for collision with cars on this square
-					{
-						if (cars[i].CarCollision(&cars[m], m)) break; //If collided with another car stop checking against other cars (in case two cars are close
-					}
+#ifdef HEADLESS
+	chrono::high_resolution_clock::time_point runStart = chrono::high_resolution_clock::now();
+#endif
+#ifdef PROFILING
+	ProfileSummary profileSummary(myEngine);
+#endif
 
-				//AI speed change
-				if ((i != 0 || gameState == over) && grid[int(gs.x) + k][int(gs.z) + l].slowPoint.size() > 0) //If car is an AI an it came within the range of a slow point
-					for (size_t j = 0; j < grid[int(gs.x) + k][int(gs.z) + l].slowPoint.size(); j++) //For each slow point in the grid square
-						if (grid[int(gs.x) + k][int(gs.z) + l].slowPoint[j].Collision(&cars[i])) //If car is within range
-							cars[i].AINewSpeed(slow); //Randomly change the thrust multiplier to something within the range of low speeds
+	// The main game loop, repeat until engine is stopped
+	while (myEngine->IsRunning())
 
-				if ((i != 0 || gameState == over) && grid[int(gs.x) + k][int(gs.z) + l].fastPoint.size() > 0) //If car is an AI an it came within the range of a fast point
-					for (size_t j = 0; j < grid[int(gs.x) + k][int(gs.z) + l].fastPoint.size(); j++) //For each fast point in the grid square
-						if (grid[int(gs.x) + k][int(gs.z) + l].fastPoint[j].Collision(&cars[i])) //If car is within range
-							cars[i].AINewSpeed(fast); //Randomly change the thrust multiplier to something within he range of high speeds
-			}
+	{
+		PROFILE_SCOPE("Frame");
 
-			//Bomb and explosion collision
-			if (bomb.size() > 0) for (size_t j = 0; j < bomb.size(); j++)
-			{
-				//Trigger explosion if car comes close to the bomb
-				if (bomb[j].state == active && bomb[j].colSphere[0].Collision(&cars[i]))
-				{
-					bomb[j].Trigger();
-				}
-				if (bomb[j].state == exploding && bomb[j].explosionRange[0].Collision(&cars[i])) //Any car in the range of explosion gets damaged
-				{
-					cars[i].Explosion(&bomb[j].bomb);
-					if (i == 0) camera.Shake();
-				}
-				bomb[j].Update(frameTime, camera.camera);
-			}
+		// Draw the scene
+		{
+			PROFILE_SCOPE("Draw scene");
+			myEngine->DrawScene();
+		}
+		frameTime = myEngine->Timer(); //Get number of frames needed to draw scene
+
+		/**** Update your scene each frame here ****/
 
+		//Input
+		input.Read(myEngine);
+
+		//Replay seeking
+		int seekTicks = (int)(kReplaySeekStep * simRate);
+		if (playback && myEngine->KeyHit(kKeySeekBack)) sim.Push({ -seekTicks, 0 });
+		if (playback && myEngine->KeyHit(kKeySeekForward)) sim.Push({ seekTicks, 0 });
+
+		//Simulate as many ticks as the frame took
+		simTime += frameTime;
+		int steps = 0;
+		while (simTime >= simStep && steps < kMaxSimSteps)
+		{
+			sim.Push({ 0, input.Pack() }); //The keys this tick uses
+			input.ClearHits();
+			simTime -= simStep;
+			steps++;
 		}
+		if (simTime >= simStep) simTime = fmod(simTime, simStep); //Drop time that couldn't be caught up with
 
-		//Update UI with current HP, end game if it went below 0
-		if (cars[0].hp > 0)
+		//Show the latest snapshot, kept from being overwritten until the models have been moved to it
+		const WorldSnapshot* snapshot = sim.snapshots.Acquire();
 		{
-			ui.UpdateHP(cars[0].hp);
+			PROFILE_SCOPE("Present");
+			float alpha = snapshot->commands < sim.pushed.load() ? 1.0f : simTime / simStep; //Between its last tick and the next one, or at its last tick if the simulation is behind
+			myRace.Present(*snapshot, alpha);
+		}
+		{
+			PROFILE_SCOPE("UI");
+			ui.Update(frameTime, snapshot->boostTimer, snapshot->hud); //Show updated UI text
 		}
-		else
 		{
-			ui.UpdateHP(0);
-			gameState = over;
-			ui.GameOver();
+			PROFILE_SCOPE("Camera");
+			camera.Update(myEngine, frameTime, &cars[0], snapshot->shakes); //Move camera
+			myRace.particles.Draw(camera.camera, snapshot->particles); //Turn every particle to face the moved camera
 		}
+		sim.snapshots.Release();
+#ifdef PROFILING
+		profileSummary.Update(frameTime); //Show where the last second went
+#endif
 
 		//Quit
 		if (myEngine->KeyHit(kKeyQuit))
@@ -1339,1341 +2099,5351 @@ void main()
 			myEngine->Stop();
 		}
 	}
+	sim.Stop(); //The race is only read from here on
+
+#ifdef HEADLESS
+	//Report how fast the simulation ran and where the player ended up
+	double runTime = Milliseconds(runStart);
+	replay.Flush();
+	cout << myEngine->frame << " frames (" << myRace.tick << " ticks) in " << runTime << " ms (" << myEngine->frame / (runTime / 1000.0) << " frames per second)" << endl;
+	cout << "Player: lap " << cars[0].lap << ", checkpoint " << cars[0].nextCheck << ", position " << cars[0].racePos << ", " << cars[0].hp << "HP, at "
+		<< cars[0].pos.x << ", " << cars[0].pos.z << endl;
+	if (!playback) cout << "Recording took " << replay.recordTime << " ms of the simulation thread (" << replay.recordTime * 100.0 / runTime << "% of the run), encoding keyframes "
+		<< replay.encodeTime << " ms on their own thread (" << replay.encodeTime * 100.0 / runTime << "%)" << endl;
+#ifdef PROFILING
+	for (size_t i = 0; i < profileSummary.lines.size(); i++) cout << profileSummary.lines[i] << endl;
+#endif
+#endif
+#ifdef PROFILING
+	if (WriteChromeTrace(traceFile)) cout << "Profile written to " << traceFile << endl;
+	else cout << "Could not write " << traceFile << endl;
+#endif
+
+	//Keep the recording
+	if (!playback)
+	{
+		if (replay.Save(recordFile)) cout << "Race recorded to " << recordFile << endl;
+		else cout << "Could not write " << recordFile << endl;
+	}
+
+	// Delete the 3D engine now we are finished with it
+	myEngine->Delete();
+	return 0;
+}
+
+#ifdef HEADLESS
+//Allocation counting, only in the headless build where the checks run
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" //GCC doesn't see that these replace the default pair and warns about malloc and free once they're inlined
+#endif
+void* operator new(size_t size)
+{
+	allocations++;
+	void* p = malloc(size > 0 ? size : 1);
+	if (!p) throw bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+//Race
+void Race::Build(I3DEngine* engine, shared_ptr <const TrackData> trackData, int carCount, bool player, unsigned int seed) //Create the checkpoints, bombs, tank fires and cars, car 0 is the player's unless every car is computer controlled, with every random stream made from the seed
+{
+	//Meshes
+	IMesh* checkpointMesh = engine->LoadMesh(kMeshCheckpoint);
+	IMesh* crossMesh = engine->LoadMesh(kMeshCross);
+	IMesh* bombMesh = engine->LoadMesh(kMeshBomb);
+	IMesh* carMesh = engine->LoadMesh(kMeshCar);
+	dummyMesh = engine->LoadMesh(kMeshDummy);
+	particles.mesh = engine->LoadMesh("quad.x");
+
+	track = trackData;
+	particles.seed = seed; //Before any emitter is made
+	random = RandomStream(seed, streamStartGrid, 0);
+
+	//Objects that take part in the race, the scenery is left to the caller
+	for (size_t i = 0; i < track->checkpoint.size(); i++) checkpoint.push_back(Checkpoint(checkpointMesh, crossMesh, track->checkpoint[i].x, 0, track->checkpoint[i].z, track->checkpoint[i].r));
+	for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].Aim(checkpoint[(i + checkpoint.size() - 1) % checkpoint.size()].pos, checkpoint[(i + 1) % checkpoint.size()].pos);
+	for (size_t i = 0; i < track->objects.size(); i++)
+	{
+		float x = track->objects[i].x;
+		float z = track->objects[i].z;
+		float r = track->objects[i].r;
+
+		if (track->objects[i].type == objTank2) fire.push_back(FireEmitter(&particles, { x, kTankFireHeight, z }));
+		else if (track->objects[i].type == objBomb) bombs.Add(Bomb(bombMesh, &particles, x, z, r));
+	}
+
+	//Start grid, extended and shuffled for this race
+	startPos = track->startPos;
+	numOfCars = carCount;
+	AddStartRows();
+
+	shuffle(startPos.begin(), (startPos.begin() + startPos.size() - 1), random); //Shuffle the vector of starting positions to make the cars start at random spots
+
+	//Cars
+	cars.reserve(numOfCars);
+	for (int i = 0; i < numOfCars; i++) //Create cars at random positions
+	{
+		Vector2D sPos = startPos[i];
+		stringstream n;
+		n << "CAR" << (i + 1);
+		if (i == 0 && player) cars.push_back(HoverCar(dummyMesh, carMesh, &particles, track, sPos.x, sPos.z, "YOU", i, seed, 0));
+		else cars.push_back(HoverCar(dummyMesh, carMesh, &particles, track, sPos.x, sPos.z, n.str(), i, seed, 1));
+	}
+}
+
+void Race::Restart() //Put the cars back on the start grid and reset the checkpoints and UI
+{
+	//Change game state
+	gameState = start;
+	raceState = start;
+	countdown = -1.0f;
+
+	//Reset cars
+	shuffle(startPos.begin(), (startPos.begin() + startPos.size() - 1), random); //Shuffle the vector of starting positions to make the cars start at random spots
+	for (int i = 0; i < numOfCars; i++)
+	{
+		Vector2D sPos = startPos[i];
+		cars[i].Reset(sPos.x, sPos.z);
+	}
+
+	//Reset checkpoints
+	for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].HideCross();
+
+	//Reset HUD
+	hud.Reset();
+}
+
+void Race::Tick(float tickTime, PlayerInput input) //Step the whole simulation forward by one tick
+{
+	step = tickTime;
+	keys = input;
+	if (graph.tasks.empty() || graphCarsPerTask != carsPerTask) BuildTickGraph();
+	graph.Run(pool);
+}
+
+void Race::BuildTickGraph() //Split the tick into tasks, each waiting for the tasks that change what it reads
+{
+	graph.Clear();
+	graphCarsPerTask = carsPerTask;
+
+	//Everything waits for the cars to remember where they were
+	int begin = graph.Add("Begin", [this]
+	{
+		tick++;
+		phase = gameState;
+		for (int i = 0; i < numOfCars; i++) cars[i].BeginTick(step);
+	});
+
+	//Tank fires only touch their own particles and random numbers, so blocks of them burn alongside each other and the rest of the tick
+	for (int first = 0; first < int(fire.size()); first += kFiresPerTask) graph.Add("Fire particles", [this, first]
+	{
+		for (int i = first; i < min(int(fire.size()), first + kFiresPerTask); i++) fire[i].Update(step, 1); //Update each fire emitter's particles
+	}, { begin });
+
+	//Start
+	int countdownTask = graph.Add("Start", [this]
+	{
+		if (phase != start) return;
+		if (keys.startHit && countdown == -1) countdown = kMaxCount; //Start the countdown
+		if (countdown >= 0)
+		{
+			countdown -= step;
+			hud.UpdateCountdown(countdown);
+			if (countdown <= 0)
+			{
+				//After countdown passes start race
+				gameState = race;
+				raceState = race;
+			}
+		}
+	}, { begin });
+
+	//Race
+	int controls = graph.Add("Controls", [this]
+	{
+		if (phase == race && !cars[0].isAI) cars[0].Controls(keys); //Take input to move the player car, unless every car is computer controlled
+	}, { countdownTask });
+	int timers = graph.Add("Car timers", [this]
+	{
+		if (phase == race) for (int i = 0; i < numOfCars; i++) cars[i].UpdateTime();
+	}, { begin });
+	int ai = graph.Add("AI", [this]
+	{
+		if (phase != start) carBatch.Steer(cars, numOfCars, phase == over, step); //Once the game is over all cars that are not dead are controlled by computer
+	}, { controls });
+	int checkpoints = graph.Add("Checkpoints", [this]
+	{
+		if (phase == race) Checkpoints();
+	}, { timers, ai });
+
+	//Over
+	int restart = graph.Add("Restart", [this]
+	{
+		if (phase == over && keys.restartHit) Restart(); //Reset level
+	}, { checkpoints });
+
+	//Race positions and the HUD text made from them
+	int rank = graph.Add("Rank", [this] { Rank(); }, { restart });
+	int hudText = graph.Add("UI text", [this]
+	{
+		updateSpeed += step; //Timer used to limit speed updates
+		if (updateSpeed > kUpPerSec)
+		{
+			hud.UpdateGeneral(sqrt(cars[0].momentum.Length()) * kScale * kMpsToKmph, GetTime(cars[0].raceTime), cars[0].racePos, numOfCars); //Show current speed
+			updateSpeed = 0.0f;
+		}
+	}, { rank });
+
+	int carMove = graph.Add("Car move", [this]
+	{
+		for (int i = 0; i < numOfCars; i++) cars[i].ResetCollision(); //While the momentum is still the one the last collision left
+		carBatch.Move(cars, numOfCars, step); //Move cars according to their momentums
+	}, { hudText });
+
+	//A car's update only changes the car and its own particles and draws from its own random numbers, so blocks of cars are updated side by side
+	vector <int> carUpdate;
+	for (int first = 0; first < numOfCars; first += carsPerTask) carUpdate.push_back(graph.Add("Car update", [this, first]
+	{
+		for (int i = first; i < min(numOfCars, first + carsPerTask); i++) cars[i].Update(step);
+	}, { carMove }));
+	graph.Add("Crosses", [this]
+	{
+		for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].Update(step); //Update checkpoint (make cross disappear)
+	}, { restart });
+
+	//Collision detection only reads the race and writes each car's own contacts, so every block of cars is a task of its own. The response changes two cars at once, so it's one task after all of them
+	int pairs = graph.Add("Car pairs", [this]
+	{
+		carPairs.Update(cars, numOfCars, cars[0].r * sqrt(cars[0].kCarColRadiusMult)); //Cars that came close enough to touch
+		contacts.resize(numOfCars);
+	}, carUpdate);
+	vector <int> detection;
+	for (int first = 0; first < numOfCars; first += carsPerTask) detection.push_back(graph.Add("Detection", [this, first] { DetectCollisions(first, min(numOfCars, first + carsPerTask)); }, { pairs }));
+	int response = graph.Add("Response", [this] { ResolveCollisions(); }, detection);
+
+	//Bombs, timers and explosions after every car had a chance to set them off
+	graph.Add("Bombs", [this] { bombs.Update(step); }, { response });
+
+	//Update HUD with current HP, end game if it went below 0
+	graph.Add("HUD", [this]
+	{
+		if (cars[0].hp > 0)
+		{
+			hud.UpdateHP(cars[0].hp);
+		}
+		else
+		{
+			hud.UpdateHP(0);
+			if (!cars[0].isAI) //Races without a player go on until every car is done
+			{
+				gameState = over;
+				hud.GameOver();
+			}
+		}
+	}, { response });
+}
+
+void Race::Checkpoints() //Move cars that went through their next checkpoint on to the one after it, and finish their laps and race
+{
+	for (int i = 0; i < numOfCars; i++)
+	{
+		//The whole move since the last tick is tested, so a fast car or a long tick can't jump over the gate. If it's AI then the gate is wider
+		if (checkpoint[cars[i].nextCheck].Crossed(cars[i].prevPos, cars[i].pos, cars[i].isAI))
+		{
+			if (i == 0) checkpoint[cars[0].nextCheck].ShowCross();
+
+			cars[i].nextCheck++;
+
+			if (cars[i].nextCheck >= checkpoint.size())
+			{
+				cars[i].nextCheck = 0;
+				cars[i].lap++;
+				if (cars[i].lapTimes.size() < kLaps) cars[i].lapTimes.push_back(cars[i].raceTime);
+
+				if (cars[i].lap > kLaps) //If finished race
+				{
+					if (raceState == race)
+					{
+						hud.UpdateWinner(cars[i].name, GetTime(cars[i].raceTime)); //Set end message
+						raceState = over; //The winner can't be overridden
+					}
+
+					if (i == 0 && !cars[0].isAI) //End game if player
+					{
+						hud.ShowEndStatus(); //Start showing end message
+						gameState = over;
+					}
+				}
+			}
+			if (i == 0) hud.UpdateStatus(cars[0].nextCheck, cars[0].lap, checkpoint.size()); //Update status to reflect position changes
+		}
+	}
+}
+
+void Race::AddStartRows() //Add rows behind the start grid until there is a position for every car
+{
+	Vector2D front = { 0.0f, 0.0f }; //Middle of the first row
+	for (int i = 0; i < kMaxCars; i++) front = front + startPos[i] * (1.0f / kMaxCars);
+	Vector2D back = (front - checkpoint[0].pos).Normal(); //Rows go away from the first checkpoint
+
+	for (int i = int(startPos.size()); i < numOfCars; i++) startPos.push_back(startPos[i % kMaxCars] + back * (kStartRowGap * (i / kMaxCars)));
+}
+
+void Race::Rank() //Sort the cars by track progress to get their race positions
+{
+	int checkpoints = int(checkpoint.size());
+	for (int i = 0; i < numOfCars; i++)
+	{
+		int next = int(cars[i].nextCheck);
+		int last = (next + checkpoints - 1) % checkpoints; //The first checkpoint's previous one is the last on the lap
+		cars[i].UpdateProgress(checkpoint[last].pos, checkpoint[next].pos, checkpoints);
+	}
+
+	//Ties go to the car with the lower index so the order doesn't depend on the sort
+	order.resize(numOfCars);
+	for (int i = 0; i < numOfCars; i++) order[i] = i;
+	sort(order.begin(), order.end(), [this](int a, int b) { return cars[a].progress > cars[b].progress || (cars[a].progress == cars[b].progress && a < b); });
+
+	for (int i = 0; i < numOfCars; i++) cars[order[i]].racePos = i + 1;
+}
+
+void Race::DetectCollisions(int first, int last) //Find the obstacle, trigger volumes and cars each car from first to last - 1 touches, only reading the race so cars can be split between threads
+{
+	for (int i = first; i < last; i++)
+	{
+		HoverCar &car = cars[i]; //Only read, other threads are reading it too
+		CarContacts &c = contacts[i];
+		c.square = track->grid.Coord(car.pos.x, car.pos.z);
+
+		//Sweep the car along its move so it can't pass through an obstacle between two ticks, only the earliest obstacle is used to avoid getting stuck between two objects
+		c.obstacle = track->Sweep(car.prevPos, car.pos, car.r);
+		Vector2D settled = car.pos; //Where the car ends up once the obstacle has stopped it, an obstacle it's still bouncing off doesn't move it
+		if (c.obstacle.index >= 0)
+		{
+			c.contact = car.Contact(c.obstacle.time);
+			if (c.obstacle.index != (c.obstacle.box ? car.colIndexBox : car.colIndexSphere)) settled = c.contact;
+		}
+
+		//Fire zones, speed points and bombs, all found with one query of the square's near list
+		c.triggerCount = track->Triggers(c.square, settled, car.r, c.trigger, kMaxTriggers);
+
+		//Cars that came close, tested where every car moved to this tick
+		c.touching.clear();
+		for (int p = carPairs.first[i]; p < carPairs.first[i + 1]; p++) if (car.Touching(cars[carPairs.partner[p]])) c.touching.push_back(carPairs.partner[p]);
+	}
+}
+
+void Race::ResolveCollisions() //Apply every car's contacts in car order, so the race comes out the same however detection was split
+{
+	for (int i = 0; i < numOfCars; i++)
+	{
+		const CarContacts &c = contacts[i];
+		cars[i].currentSquare = c.square;
+
+		bool hit = c.obstacle.index >= 0; //True if there's a collision
+		if (hit)
+		{
+			if (c.obstacle.box) cars[i].BoxCollision(c.obstacle.index, c.obstacle.axis, c.contact); //Change momentum and apply damage
+			else cars[i].SphereCollision(c.obstacle.index, c.contact);
+		}
+
+		CarTriggers(i, c.trigger, c.triggerCount);
+
+		//Car collision
+		if (!hit) for (size_t p = 0; p < c.touching.size(); p++) //If no collision was detected before bounce off the first car touched
+		{
+			int m = c.touching[p];
+			if (cars[m].colIndexCar != i) //Unless that car already bounced off this one
+			{
+				cars[i].CarCollision(&cars[m], m);
+				break; //Only one car at a time (in case two cars are close)
+			}
+		}
+	}
+}
+
+void Race::CarTriggers(int i, const int* inside, int count) //Send car i an event for each trigger volume it went into, stayed in or left, from the volumes it's in now
+{
+	HoverCar &car = cars[i];
+
+	//Volumes the car is in now, in near list order so events come out the same way every run
+	for (int j = 0; j < count; j++)
+	{
+		int id = inside[j];
+		bool was = find(car.trigger, car.trigger + car.triggerCount, id) != car.trigger + car.triggerCount;
+		OnTrigger(i, { id, track->triggerType[id], track->triggerPayload[id], was ? triggerStay : triggerEnter });
+	}
+
+	//Volumes it was in last tick and has left
+	for (int j = 0; j < car.triggerCount; j++)
+	{
+		int id = car.trigger[j];
+		if (find(inside, inside + count, id) == inside + count) OnTrigger(i, { id, track->triggerType[id], track->triggerPayload[id], triggerExit });
+	}
+
+	copy(inside, inside + count, car.trigger);
+	car.triggerCount = count;
+}
+
+void Race::OnTrigger(int i, TriggerEvent e) //What happens to a car going into, staying in or leaving a volume, by the volume's type bits
+{
+	HoverCar &car = cars[i];
+	if (e.phase == triggerExit) return; //Every volume so far works for as long as the car is inside it, nothing happens on the way out
+
+	if (e.type & triggerFire) car.burnTimer = car.kBurnTime; //Update burn time
+
+	//AI speed change
+	if ((car.isAI || gameState == over) && (e.type & triggerSlow)) car.AINewSpeed(slow); //Randomly change the thrust multiplier to something within the range of low speeds
+	if ((car.isAI || gameState == over) && (e.type & triggerFast)) car.AINewSpeed(fast); //Randomly change the thrust multiplier to something within the range of high speeds
+
+	//Bombs, the track checks every payload is a real bomb when it's loaded
+	if (e.type & (triggerBomb | triggerBlast))
+	{
+		Bomb &b = bombs.bomb[e.payload];
+		if ((e.type & triggerBomb) && b.state == active) b.Trigger(); //Trigger explosion if car comes close to the bomb
+
+		if ((e.type & triggerBlast) && b.state == exploding) //Any car in the range of explosion gets damaged
+		{
+			car.Explosion(b.pos);
+			if (i == 0) shakes++;
+		}
+	}
+}
+
+void Race::Capture(WorldSnapshot &snapshot) const //Copy everything the render thread draws
+{
+	snapshot.tick = tick;
+	snapshot.cars.resize(numOfCars);
+	for (int i = 0; i < numOfCars; i++) snapshot.cars[i] = cars[i].Pose();
+	particles.Capture(snapshot.particles);
+
+	snapshot.bombs.resize(bombs.bomb.size());
+	for (size_t i = 0; i < bombs.bomb.size(); i++) snapshot.bombs[i] = bombs.bomb[i].state;
+	snapshot.crosses.resize(checkpoint.size());
+	for (size_t i = 0; i < checkpoint.size(); i++) snapshot.crosses[i] = checkpoint[i].crossUp;
+
+	snapshot.hud = hud;
+	snapshot.boostTimer = cars[0].boostTimer;
+	snapshot.shakes = shakes;
+}
+
+void Race::Present(const WorldSnapshot &snapshot, float alpha) //Move the models to a snapshot, with the cars between its last tick and the next one
+{
+	for (int i = 0; i < numOfCars; i++) cars[i].Present(snapshot.cars[i], alpha);
+	for (size_t i = 0; i < bombs.bomb.size(); i++) bombs.bomb[i].Present(snapshot.bombs[i]);
+	for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].Present(snapshot.crosses[i] != 0);
+}
+
+bool Race::Finished() //True once every car has finished the race or died
+{
+	for (int i = 0; i < numOfCars; i++) if (cars[i].lapTimes.size() < kLaps && cars[i].hp > 0) return false;
+	return true;
+}
+
+void Race::Serialize(SimState &s) //Write the whole simulation to a snapshot or read it back
+{
+	//States
+	s.Field(gameState);
+	s.Field(raceState);
+	s.Field(countdown);
+	s.Field(updateSpeed);
+	s.Field(tick);
+	s.Array(order);
+	s.Array(carPairs.sorted);
+
+	//Start grid's random numbers, the cars and emitters keep theirs with the rest of their state
+	s.Field(random);
+
+	//Track
+	for (size_t i = 0; i < checkpoint.size(); i++) checkpoint[i].Serialize(s);
+	bombs.Serialize(s);
+	for (size_t i = 0; i < fire.size(); i++) fire[i].Serialize(s);
+	particles.Serialize(s);
+
+	//Cars
+	for (int i = 0; i < numOfCars; i++) cars[i].Serialize(s);
+}
+
+void Race::WriteResults(ostream &out, int raceNo, unsigned int seed) //Write a CSV row for each car with its place, lap times, collisions and whether it died
+{
+	//Cars that finished are placed by their time, the rest by how far they got
+	vector <int> place = order;
+	stable_sort(place.begin(), place.end(), [this](int a, int b)
+	{
+		bool aDone = cars[a].lapTimes.size() == kLaps;
+		bool bDone = cars[b].lapTimes.size() == kLaps;
+		if (aDone != bDone) return aDone;
+		return aDone && cars[a].lapTimes.back() < cars[b].lapTimes.back();
+	});
+
+	for (int i = 0; i < numOfCars; i++)
+	{
+		const HoverCar &car = cars[place[i]];
+		bool done = car.lapTimes.size() == kLaps;
+
+		out << raceNo << "," << seed << "," << car.name << "," << i + 1 << "," << done << ",";
+		if (done) out << car.lapTimes.back();
+		for (int j = 0; j < kLaps; j++)
+		{
+			out << ",";
+			if (j < int(car.lapTimes.size())) out << car.lapTimes[j] - (j > 0 ? car.lapTimes[j - 1] : 0.0f);
+		}
+		out << "," << car.collisions << "," << (car.hp <= 0) << "," << car.hp << "\n";
+	}
+}
+
+//Car broadphase
+void CarPairs::Update(vector <HoverCar> &cars, int numOfCars, float reach) //Find every pair of cars that came within reach of each other on both axes
+{
+	float half = reach * 0.5f; //Two cars can touch if their ranges grown by half the reach overlap
+
+	//Sweep along the axis the cars are most spread out on so that few of them overlap on it (the start grid is lined up on one axis)
+	float meanX = 0.0f;
+	float meanZ = 0.0f;
+	for (int i = 0; i < numOfCars; i++)
+	{
+		meanX += cars[i].pos.x / numOfCars;
+		meanZ += cars[i].pos.z / numOfCars;
+	}
+	float spreadX = 0.0f;
+	float spreadZ = 0.0f;
+	for (int i = 0; i < numOfCars; i++)
+	{
+		spreadX += (cars[i].pos.x - meanX) * (cars[i].pos.x - meanX);
+		spreadZ += (cars[i].pos.z - meanZ) * (cars[i].pos.z - meanZ);
+	}
+	bool sweepX = spreadX >= spreadZ;
+
+	sweepMin.resize(numOfCars);
+	sweepMax.resize(numOfCars);
+	crossMin.resize(numOfCars);
+	crossMax.resize(numOfCars);
+	for (int i = 0; i < numOfCars; i++) //Ranges cover the previous position too, since collisions move cars back there
+	{
+		Vector2D a = cars[i].pos;
+		Vector2D b = cars[i].prevPos;
+		if (!sweepX)
+		{
+			a = { a.z, a.x };
+			b = { b.z, b.x };
+		}
+		sweepMin[i] = min(a.x, b.x) - half;
+		sweepMax[i] = max(a.x, b.x) + half;
+		crossMin[i] = min(a.z, b.z) - half;
+		crossMax[i] = max(a.z, b.z) + half;
+	}
+
+	//Insertion sort by the start of the range, close to linear because cars only move a little each tick
+	if (int(sorted.size()) != numOfCars)
+	{
+		sorted.resize(numOfCars);
+		for (int i = 0; i < numOfCars; i++) sorted[i] = i;
+	}
+	for (int i = 1; i < numOfCars; i++)
+	{
+		int car = sorted[i];
+		int j = i - 1;
+		while (j >= 0 && sweepMin[sorted[j]] > sweepMin[car])
+		{
+			sorted[j + 1] = sorted[j];
+			j--;
+		}
+		sorted[j + 1] = car;
+	}
+
+	//Sweep, each car is only compared with the ones starting before it ends
+	pairA.clear();
+	pairB.clear();
+	for (int i = 0; i < numOfCars; i++)
+	{
+		int a = sorted[i];
+		for (int j = i + 1; j < numOfCars && sweepMin[sorted[j]] < sweepMax[a]; j++)
+		{
+			int b = sorted[j];
+			if (crossMin[b] < crossMax[a] && crossMin[a] < crossMax[b]) //Overlap on the other axis too
+			{
+				pairA.push_back(a);
+				pairB.push_back(b);
+			}
+		}
+	}
+
+	//Group the pairs by car, both ways round
+	first.assign(numOfCars + 1, 0);
+	for (size_t p = 0; p < pairA.size(); p++)
+	{
+		first[pairA[p] + 1]++;
+		first[pairB[p] + 1]++;
+	}
+	for (int i = 0; i < numOfCars; i++) first[i + 1] += first[i];
+
+	partner.resize(first[numOfCars]);
+	fill.assign(first.begin(), first.end() - 1);
+	for (size_t p = 0; p < pairA.size(); p++)
+	{
+		partner[fill[pairA[p]]++] = pairB[p];
+		partner[fill[pairB[p]]++] = pairA[p];
+	}
+
+	//Cars are checked in order of index, the same order the old grid loop used
+	for (int i = 0; i < numOfCars; i++) sort(partner.begin() + first[i], partner.begin() + first[i + 1]);
+}
+
+//Car batch
+int CarBatch::Resize(int numOfCars) //Make room for every car, rounded up to a multiple of four, returns the rounded count
+{
+	int count = (numOfCars + 3) / 4 * 4; //The cars past the end are stepped but never copied back
+	vector <float>* floats[] = { &goalX, &goalZ, &faceX, &faceZ, &yaw, &tilt, &thMult, &boostMult, &newThrust, &speedChangeCD, &goalStep, &posX, &posZ, &momX, &momZ, &thrustX, &thrustZ, &dragX, &dragZ, &drMult };
+	for (size_t i = 0; i < sizeof(floats) / sizeof(floats[0]); i++) floats[i]->resize(count);
+	vector <int>* ints[] = { &hp, &racePos, &ai };
+	for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) ints[i]->resize(count);
+	steer.resize(count);
+	return count;
+}
+
+#ifdef CAR_BATCH_SSE
+__m128 Blend(__m128 mask, __m128 a, __m128 b) //a where the mask is set and b everywhere else, SSE2 has no blend instruction
+{
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+void CarBatch::Steer(vector <HoverCar> &cars, int numOfCars, bool everyone, float fTime) //Steer the computer-controlled cars, or every car that's alive, towards their goals and set their thrust
+{
+	int count = Resize(numOfCars);
+	const HoverCar &tuning = cars[0]; //Every car has the same constants
+	const TrackData &track = *tuning.track;
+
+	//Goals are looked up on each car's own lane one car at a time
+	for (int i = 0; i < numOfCars; i++)
+	{
+		HoverCar &c = cars[i];
+		steer[i] = (everyone || c.isAI) && c.hp > 0;
+		if (!steer[i]) continue;
+
+		Vector2D goal = track.lane[c.lane].At(c.goalDist, c.goalSample);
+		goalX[i] = goal.x - c.pos.x;
+		goalZ[i] = goal.z - c.pos.z;
+		faceX[i] = c.fVector.x;
+		faceZ[i] = c.fVector.z;
+		tilt[i] = c.tilt;
+		thMult[i] = c.thMult;
+		boostMult[i] = c.boostMult;
+		newThrust[i] = c.newThrust;
+		speedChangeCD[i] = c.speedChangeCD;
+		hp[i] = c.hp;
+		racePos[i] = c.racePos;
+		ai[i] = c.isAI;
+	}
+
+	//Facing, tilt, speed ramp, thrust with the HP penalties and bonus, and how far each goal moves, -bench-ai checks these against HoverCar::AIFollowPath
+	float tiltChange = tuning.kCarTiltFactor * 1.0f * fTime;
+	float maxTilt = tuning.kCarMaxTilt;
+	float minTilt = -tuning.kCarMaxTilt / 2;
+	float rampChange = tuning.kThrustChange * fTime;
+	float lowHP = kLowHP * kMaxHP;
+	__m128 time = _mm_set1_ps(fTime);
+	__m128 one = _mm_set1_ps(1.0f);
+	for (int i = 0; i < count; i += 4)
+	{
+		_mm_storeu_ps(&yaw[i], FacingYaw(_mm_loadu_ps(&goalX[i]), _mm_loadu_ps(&goalZ[i]))); //Face the goal
+
+		//Tilt forward, kept within the limits the way HoverCar::Tilt does
+		__m128 oldTilt = _mm_loadu_ps(&tilt[i]);
+		__m128 t = _mm_add_ps(oldTilt, _mm_set1_ps(tiltChange));
+		__m128 inside = _mm_and_ps(_mm_cmplt_ps(t, _mm_set1_ps(maxTilt)), _mm_cmpgt_ps(t, _mm_set1_ps(minTilt)));
+		__m128 clamped = Blend(_mm_cmpgt_ps(t, _mm_set1_ps(maxTilt)), _mm_set1_ps(maxTilt), Blend(_mm_cmplt_ps(t, _mm_set1_ps(minTilt)), _mm_set1_ps(minTilt), oldTilt));
+		_mm_storeu_ps(&tilt[i], Blend(inside, t, clamped));
+
+		_mm_storeu_ps(&speedChangeCD[i], _mm_sub_ps(_mm_loadu_ps(&speedChangeCD[i]), time));
+
+		//Adjust thrust multiplier to match new thrust
+		__m128 b = _mm_loadu_ps(&boostMult[i]);
+		__m128 target = _mm_loadu_ps(&newThrust[i]);
+		b = Blend(_mm_cmpgt_ps(target, b), _mm_add_ps(b, _mm_set1_ps(rampChange)), Blend(_mm_cmplt_ps(target, b), _mm_sub_ps(b, _mm_set1_ps(rampChange)), b));
+		_mm_storeu_ps(&boostMult[i], b);
+
+		__m128 tx = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(&faceX[i]), _mm_set1_ps(tuning.kThrustFactor)), _mm_loadu_ps(&thMult[i])), b), time);
+		__m128 tz = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(&faceZ[i]), _mm_set1_ps(tuning.kThrustFactor)), _mm_loadu_ps(&thMult[i])), b), time);
+
+		//Slow down on low HP, computer-controlled cars more
+		__m128 health = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&hp[i]));
+		__m128 isAI = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)&ai[i]), _mm_setzero_si128()));
+		__m128 penalty = Blend(_mm_cmplt_ps(health, _mm_set1_ps(lowHP * 2)), _mm_set1_ps(tuning.kMedHPPenalty), one);
+		penalty = Blend(_mm_and_ps(isAI, _mm_cmplt_ps(health, _mm_set1_ps(lowHP))), _mm_set1_ps(tuning.kLowHPPenalty), penalty);
+		penalty = Blend(_mm_cmplt_ps(health, one), _mm_setzero_ps(), penalty);
+		tx = _mm_mul_ps(tx, penalty);
+		tz = _mm_mul_ps(tz, penalty);
+
+		//Increase thrust if not first
+		__m128 bonus = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&racePos[i]));
+		_mm_storeu_ps(&thrustX[i], _mm_add_ps(tx, _mm_mul_ps(_mm_mul_ps(tx, _mm_set1_ps(tuning.kThrustBonus)), bonus)));
+		_mm_storeu_ps(&thrustZ[i], _mm_add_ps(tz, _mm_mul_ps(_mm_mul_ps(tz, _mm_set1_ps(tuning.kThrustBonus)), bonus)));
+
+		//If car is close enough keep moving the goal forward
+		__m128 gx = _mm_loadu_ps(&goalX[i]);
+		__m128 gz = _mm_loadu_ps(&goalZ[i]);
+		__m128 dist = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(gx, gx), _mm_mul_ps(gz, gz)));
+		dist = Blend(_mm_cmplt_ps(dist, one), one, dist);
+		__m128 step = _mm_mul_ps(_mm_div_ps(_mm_set1_ps(tuning.kGoalSpeed), dist), time);
+		_mm_storeu_ps(&goalStep[i], _mm_and_ps(_mm_cmplt_ps(dist, _mm_set1_ps(tuning.kMaxGoalDist)), step));
+	}
+
+	//Move the goals along their lanes and copy everything back
+	for (int i = 0; i < numOfCars; i++) if (steer[i])
+	{
+		HoverCar &c = cars[i];
+		c.yaw = yaw[i];
+		c.tilt = tilt[i];
+		c.speedChangeCD = speedChangeCD[i];
+		c.boostMult = boostMult[i];
+		c.thrust = { thrustX[i], thrustZ[i] };
+
+		if (goalStep[i] > 0.0f) c.AIMoveGoal(goalStep[i]);
+	}
+}
+
+void CarBatch::Move(vector <HoverCar> &cars, int numOfCars, float fTime) //Move every car according to its momentum
+{
+	int count = Resize(numOfCars);
+	const HoverCar &tuning = cars[0];
+
+	for (int i = 0; i < numOfCars; i++)
+	{
+		const HoverCar &c = cars[i];
+		posX[i] = c.pos.x;
+		posZ[i] = c.pos.z;
+		momX[i] = c.momentum.x;
+		momZ[i] = c.momentum.z;
+		thrustX[i] = c.thrust.x;
+		thrustZ[i] = c.thrust.z;
+		drMult[i] = c.drMult;
+		hp[i] = c.hp;
+	}
+
+	//Drag, then momentum, then position, -bench-ai checks these against HoverCar::Move
+	__m128 time = _mm_set1_ps(fTime);
+	for (int i = 0; i < count; i += 4)
+	{
+		__m128 alive = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)&hp[i]), _mm_setzero_si128())); //Disable acceleration if dead
+		__m128 tx = _mm_and_ps(alive, _mm_loadu_ps(&thrustX[i]));
+		__m128 tz = _mm_and_ps(alive, _mm_loadu_ps(&thrustZ[i]));
+		__m128 mx = _mm_loadu_ps(&momX[i]);
+		__m128 mz = _mm_loadu_ps(&momZ[i]);
+		__m128 drag = _mm_set1_ps(tuning.kDragCoefficient);
+		__m128 dx = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(mx, drag), _mm_loadu_ps(&drMult[i])), time);
+		__m128 dz = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(mz, drag), _mm_loadu_ps(&drMult[i])), time);
+		mx = _mm_add_ps(_mm_add_ps(mx, tx), dx);
+		mz = _mm_add_ps(_mm_add_ps(mz, tz), dz);
+
+		_mm_storeu_ps(&thrustX[i], tx);
+		_mm_storeu_ps(&thrustZ[i], tz);
+		_mm_storeu_ps(&dragX[i], dx);
+		_mm_storeu_ps(&dragZ[i], dz);
+		_mm_storeu_ps(&momX[i], mx);
+		_mm_storeu_ps(&momZ[i], mz);
+		_mm_storeu_ps(&posX[i], _mm_add_ps(_mm_loadu_ps(&posX[i]), _mm_mul_ps(mx, time)));
+		_mm_storeu_ps(&posZ[i], _mm_add_ps(_mm_loadu_ps(&posZ[i]), _mm_mul_ps(mz, time)));
+	}
+
+	for (int i = 0; i < numOfCars; i++)
+	{
+		HoverCar &c = cars[i];
+		c.thrust = { thrustX[i], thrustZ[i] };
+		c.drag = { dragX[i], dragZ[i] };
+		c.momentum = { momX[i], momZ[i] };
+		c.prevPos = c.pos; //Save previous postion
+		c.pos = { posX[i], posZ[i] };
+	}
+}
+#else
+void CarBatch::Steer(vector <HoverCar> &cars, int numOfCars, bool everyone, float fTime) //Steer the computer-controlled cars, or every car that's alive, towards their goals and set their thrust
+{
+	for (int i = 0; i < numOfCars; i++) if (everyone || cars[i].isAI) cars[i].AIFollowPath();
+}
+
+void CarBatch::Move(vector <HoverCar> &cars, int numOfCars, float fTime) //Move every car according to its momentum
+{
+	for (int i = 0; i < numOfCars; i++) cars[i].Move();
+}
+#endif
+
+//Player input
+void PlayerInput::Read(I3DEngine* e) //Update held keys and collect hits
+{
+	forward = e->KeyHeld(kKeyCarForward);
+	backward = e->KeyHeld(kKeyCarBackward);
+	left = e->KeyHeld(kKeyCarLeft);
+	right = e->KeyHeld(kKeyCarRight);
+	boost = e->KeyHeld(kKeyBoost);
+
+	if (e->KeyHit(kKeyStart)) startHit = true;
+	if (e->KeyHit(kKeyRestart)) restartHit = true;
+}
+
+void PlayerInput::ClearHits() //Forget hits after a tick has used them
+{
+	startHit = false;
+	restartHit = false;
+}
+
+unsigned char PlayerInput::Pack() //Keys as a byte with a bit each, for replays
+{
+	return forward | backward << 1 | left << 2 | right << 3 | boost << 4 | startHit << 5 | restartHit << 6;
+}
+
+void PlayerInput::Unpack(unsigned char keys) //Keys from a packed byte
+{
+	forward = keys & 1;
+	backward = (keys >> 1) & 1;
+	left = (keys >> 2) & 1;
+	right = (keys >> 3) & 1;
+	boost = (keys >> 4) & 1;
+	startHit = (keys >> 5) & 1;
+	restartHit = (keys >> 6) & 1;
+}
+
+//Vector2D
+float Vector2D::Length() //Returns length of a vector, but sqrt has to be applied separately as it's not needed in most cases
+{
+	return x * x + z * z;
+}
+
+Vector2D Vector2D::Normal() //Normalise vector
+{
+	return { x / sqrt(Length()), z / sqrt(Length()) };
+}
+
+Vector2D FacingVector(float yaw) //Calculate the facing vector from a rotation around the Y axis
+{
+	float angle = yaw * kPi / 180.0f; //Rotations are kept in degrees like the engine's
+	return { sin(angle), cos(angle) }; //Same as the X and Z values of a model's Z vector
+}
+
+float FacingYaw(float x, float z) //Rotation around the Y axis that faces along a vector, the other way round from FacingVector
+{
+	//atan2 from a polynomial rather than the C library, so that every compiler and the four car version agree on the angle
+	float ax = fabs(x);
+	float az = fabs(z);
+	float big = max(ax, az);
+	float a = big > 0.0f ? min(ax, az) / big : 0.0f;
+	float s = a * a;
+	float p = kAtan[7];
+	for (int k = 6; k >= 0; k--) p = p * s + kAtan[k];
+	float angle = a + a * s * p;
+
+	if (ax > az) angle = kPi / 2 - angle; //Past 45 degrees from the Z axis
+	if (z < 0.0f) angle = kPi - angle; //Facing backwards
+	if (x < 0.0f) angle = -angle; //Facing left
+	return angle * 180.0f / kPi;
+}
+
+#ifdef CAR_BATCH_SSE
+__m128 FacingYaw(__m128 x, __m128 z) //Same for four vectors at once, giving exactly the same angles
+{
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 zero = _mm_setzero_ps();
+	__m128 ax = _mm_andnot_ps(sign, x);
+	__m128 az = _mm_andnot_ps(sign, z);
+	__m128 big = _mm_max_ps(ax, az);
+	__m128 a = _mm_and_ps(_mm_cmpgt_ps(big, zero), _mm_div_ps(_mm_min_ps(ax, az), big));
+	__m128 s = _mm_mul_ps(a, a);
+	__m128 p = _mm_set1_ps(kAtan[7]);
+	for (int k = 6; k >= 0; k--) p = _mm_add_ps(_mm_mul_ps(p, s), _mm_set1_ps(kAtan[k]));
+	__m128 angle = _mm_add_ps(a, _mm_mul_ps(_mm_mul_ps(a, s), p));
+
+	angle = Blend(_mm_cmpgt_ps(ax, az), _mm_sub_ps(_mm_set1_ps(kPi / 2), angle), angle);
+	angle = Blend(_mm_cmplt_ps(z, zero), _mm_sub_ps(_mm_set1_ps(kPi), angle), angle);
+	angle = Blend(_mm_cmplt_ps(x, zero), _mm_xor_ps(angle, sign), angle);
+	return _mm_div_ps(_mm_mul_ps(angle, _mm_set1_ps(180.0f)), _mm_set1_ps(kPi));
+}
+#endif
+
+Vector2D Vector2D::operator + (Vector2D v2) //Add two vectors together
+{
+	return { x + v2.x, z + v2.z };
+}
+
+Vector2D Vector2D::operator - (Vector2D v2) //Substract one vector from another
+{
+	return { x - v2.x, z - v2.z };
+}
+
+Vector2D Vector2D::operator - () //Reverse vector
+{
+	return { -x, -z };
+}
+
+Vector2D Vector2D::operator * (float scale) //Scalar multiplication
+{
+	return { x * scale, z * scale };
+}
+
+Vector2D Vector2D::operator * (Vector2D v2) //Multiply one vector by another
+{
+	return { x * v2.x, z * v2.z };
+}
+
+bool Vector2D::operator < (Vector2D v2) //Compare length of two vectors
+{
+	return Length() < v2.Length();
+}
+
+bool Vector2D::operator < (float f) //Compare length of a vector with a floating number
+{
+	return Length() < f;
+}
+
+bool Vector2D::operator > (Vector2D v2) //Compare length of two vectors
+{
+	return Length() > v2.Length();
+}
+
+bool Vector2D::operator > (float f) //Compare length of a vector with a floating number
+{
+	return Length() > f;
+}
+
+bool Vector2D::operator == (Vector2D v2) //Check if two vectors are equal
+{
+	return x == v2.x && z == v2.z;
+}
+
+//Hover Cars
+HoverCar::HoverCar(IMesh* dummyMesh, IMesh* carMesh, ParticlePool* particles, shared_ptr <const TrackData> trackData, float startX, float startZ, string carName, int carNo, unsigned int seed, bool ai) //Constructor
+{
+	//Setup
+	dummy = dummyMesh->CreateModel();
+
+	car = carMesh->CreateModel();
+	car->Scale(kCarScale);
+	car->AttachToParent(dummy);
+
+	random = RandomStream(seed, streamCars, unsigned(carNo));
+	float y = kCarHoverHeight - kCarHoverRange + (random.Int() % 100) * 0.01f; //Get a random y position so that the cars move differently
+	if (random.Int() % 2 == 1) bobbleDir = down; //50% chance for the car to start off by bobbling down instead of up
+
+	pos = { startX, startZ };
+	lastPos = pos;
+	height = y;
+	dummy->SetPosition(startX, y, startZ);
+
+	//Particle
+	fire.push_back(FireEmitter(particles, { startX, kCarHoverHeight + kBurnHeight, startZ }, kBurnRadius, kBurnVelRatio));
+	smoke.push_back(SmokeEmitter(particles, { startX, kCarHoverHeight + kSmokeHeight, startZ }, kSmokeRadius));
+	exhaust.push_back(ExhaustEmitter(particles, { startX, kCarHoverHeight + kExhaustHeight, startZ }, kExhaustRadius));
+
+	//Skin
+	if (ai) car->SetSkin(kSkinAI);
+	else car->SetSkin(kSkinPlayer);
+
+	//AI
+	isAI = ai;
+	track = trackData;
+	AIStartLane();
+
+	//Other
+	racePos = carNo + 1; //Starting race position, replaced by the ranking on the first tick
+	name = carName; //Set a name
+}
+
+void HoverCar::Reset(float startX, float startZ) //Reset the car's variables and move it to a given starting position
+{
+	//Race
+	raceTime = 0;
+	nextCheck = 0;
+	lap = 1;
+	lapTimes.clear();
+	collisions = 0;
+
+	//Position and rotation
+	float y = kCarHoverHeight - kCarHoverRange + (random.Int() % 100) * 0.01f; //Get a random y position so that the cars move differently
+	if (random.Int() % 2 == 1) bobbleDir = down; //50% chance for the car to start off by bobbling down instead of up
+	pos = { startX, startZ };
+	lastPos = pos;
+	height = y;
+	yaw = 0.0f;
+	lastYaw = 0.0f;
+	bobbleY = 0.0f;
+
+	tilt = 0;
+	lean = 0;
+
+	//Speed
+	momentum = kZeroVector;
+	thrust = kZeroVector;
+	drag = kZeroVector;
+	thMult = 1.0f;
+	boostMult = 1.0f;
+	drMult = 1.0f;
+
+	//Collision
+	prevPos = kZeroVector;
+	colIndexSphere = -1;
+	colIndexBox = -1;
+	colIndexCar = -1;
+	triggerCount = 0;
+
+	//Boost
+	boostTimer = kBoostTime;
+	boostLock = 0;
+
+	//Health and status
+	hp = kMaxHP;
+	burnTimer = 0.0f;
+	burnDamageTimer = 0.0f;
+	explosionTimer = 0.0f;
+
+	//AI
+	AIStartLane();
+}
+
+void HoverCar::AIFollowPath() //Update AI orientation and speed and move the goal along the lane
+{
+	if (hp > 0)
+	{
+		//Rotation
+		Vector2D goal = track->lane[lane].At(goalDist, goalSample);
+		yaw = FacingYaw(goal.x - pos.x, goal.z - pos.z); //Face the goal
+
+		Tilt(1);
+
+		//Speed
+		speedChangeCD -= fTime;
+		if (newThrust > boostMult) boostMult += kThrustChange * fTime; //Adjust thrust multiplier to match new thrust
+		else if (newThrust < boostMult) boostMult -= kThrustChange * fTime;
+
+		thrust = fVector * kThrustFactor * thMult * boostMult * fTime; //Set thrust
+
+		if (hp < 1) thrust = kZeroVector; //If dead don't move
+		else if (isAI && hp < kLowHP * kMaxHP) thrust = thrust * kLowHPPenalty; //If below 30% hp slow down considerably (only applies to non-player cars)
+		else if (hp < kLowHP * kMaxHP * 2) thrust = thrust * kMedHPPenalty; //If below 60% hp slow down a little
+
+		thrust = thrust + thrust * kThrustBonus * (float)racePos; //Increase thrust if not first
+
+		//Follow goal
+		float dist = sqrt((goal - pos).Length()); //Distance between car and goal
+		if (dist < 1.0f) dist = 1.0f;
+
+		if (dist < kMaxGoalDist) AIMoveGoal((kGoalSpeed / dist) * fTime); //If car is close enough keep moving the goal forward
+	}
+}
+
+void HoverCar::AIMoveGoal(float step) //Move the goal a distance along the lane, wrapping round at its end
+{
+	const LaneSpline &l = track->lane[lane];
+	goalDist = fmod(goalDist + step, l.Length());
+	goalSample = l.Sample(goalDist, goalSample);
+}
+
+void HoverCar::AINewSpeed(Speed speed) //Switch to a random speed in a slow or fast range
+{
+	if (speedChangeCD <= 0.0f) //If car hasn't changed passed a speed point recently
+	{
+		speedChangeCD = kSpeedChangeCD; //Reset cooldown
+
+		bool change = random.Int() % 2; //50% chance of changing speed
+		if (change)
+		{
+			if (speed = slow) newThrust = kMidThrust - float(random.Int() % (int(100 * (kMidThrust - kMinThrust))) / 100.0f); //New speed between min and mid
+			else if (speed = fast) newThrust = kMidThrust + float(random.Int() % (int(100 * (kMinThrust - kMidThrust))) / 100.0f); //New speed between mid and max
+		}
+	}
+}
+
+void HoverCar::AIStartLane() //Follow the lane closest to the car, from its first waypoint
+{
+	//Lanes start at the start line, so cars in the rows behind it line up behind each other instead of cutting in
+	lane = track->NearestLane(pos).lane;
+	goalDist = 0.0f;
+	goalSample = 0;
+}
+
+void HoverCar::AISwitchLane() //Switch to the closest lane that runs alongside the current one
+{
+	if (isAI)
+	{
+		//Lanes level with the goal, from the precomputed tables
+		int best = -1;
+		float bestDist = 0.0f;
+		for (size_t i = 0; i < track->lane.size(); i++) if (i != lane)
+		{
+			int sample = track->laneMap[lane][i][goalSample];
+			if (sample < 0) continue;
+			float d = (pos - track->lane[i].point[sample]).Length();
+			if (best < 0 || d < bestDist)
+			{
+				best = int(i);
+				bestDist = d;
+			}
+		}
+
+		//Change lane, keeping the goal level with where it was on the old one
+		if (best >= 0)
+		{
+			goalSample = track->laneMap[lane][best][goalSample];
+			lane = best;
+			goalDist = track->lane[lane].distance[goalSample];
+		}
+	}
+}
+
+void HoverCar::UpdateProgress(Vector2D from, Vector2D to, int checkpoints) //Work out track progress from the checkpoints on either side of the car
+{
+	//Project the car onto the line between the last checkpoint and the next one
+	Vector2D line = to - from;
+	Vector2D toCar = pos - from;
+	float t = 0.0f; //Fraction of the way to the next checkpoint
+	if (line.Length() > 0.0f) t = (toCar.x * line.x + toCar.z * line.z) / line.Length(); //Length is already squared
+	if (t < 0.0f) t = 0.0f;
+	else if (t > 1.0f) t = 1.0f;
+
+	progress = float((lap - 1) * checkpoints + int(nextCheck)) + t;
+}
+
+void HoverCar::UpdateTime() //Update race time
+{
+	raceTime += fTime;
+}
+
+void HoverCar::UpdateDamage() //Damage related updates
+{
+	colDamage = int(floor(pow(sqrt(momentum.Length()) * kDamageFactor, 2))); //The faster the car is going the more damage it takes from collisions
+	if (explosionTimer > 0) explosionTimer -= fTime;
+}
+
+void HoverCar::UpdateParticles() //Update fire, smoke and exhaust fire particles coming from the car
+{
+	//Fire
+	if (burnTimer > 0.0f) Burn(); //If car is burning show fire and take damage
+	else fire[0].Update(fTime, 0); //If it's not burning then just update the particles already spawned
+
+	//Smoke
+	if (hp < kLowHP * kMaxHP)
+	{
+		smoke[0].UpdateOrigin(Vector3D{ pos.x + fVector.x * kSmokeZPos, height + bobbleY + kSmokeHeight, pos.z + fVector.z * kSmokeZPos });
+		smoke[0].Update(fTime, 1, -momentum); //Emit smoke if hp is low
+	}
+	else smoke[0].Update(fTime, 0, momentum * kSmokeMomentumMult); //Let smoke die off
+
+	//Exhaust
+	if (momentum.Length() > kExhaustMinSpeed && boostMult > kExhaustMinBoost)
+	{
+		exhaust[0].UpdateOrigin(Vector3D{ pos.x + fVector.x * kExhaustZPos, height + bobbleY + kExhaustHeight, pos.z + fVector.z * kExhaustZPos });
+		exhaust[0].Update(fTime, 1, -momentum);
+	}
+	else exhaust[0].Update(fTime, 0, -momentum);
+}
+
+void HoverCar::Controls(PlayerInput input) //Take keyboard input and react accordingly
+{
+	//Movement
+	if (input.forward)
+	{
+		thrust = fVector * kThrustFactor * thMult * boostMult * fTime; //Update thrust
+		Tilt(1); //Tilt the car forward
+	}
+	else if (input.backward)
+	{
+		thrust = fVector * (-kThrustFactor / 2) * thMult * boostMult * fTime; //Update thrust
+		Tilt(-1); //Tilt the car back
+	}
+	else
+	{
+		thrust = kZeroVector; //Reset thrust
+	}
+
+	//Steering
+	if (input.left)
+	{
+		yaw -= kCarRotation * fTime;
+		Lean(1);
+	}
+	else if (input.right)
+	{
+		yaw += kCarRotation * fTime;
+		Lean(-1);
+	}
+
+	//Boost
+	Boost(input);
+}
+
+void HoverCar::TakeDamage(int damage) //Subtract damage and disable thrust if hp goes too low
+{
+	hp -= damage;
+	if (hp <= 0) thMult = 0.0f;
+}
+
+void HoverCar::ResetCollision() //Return to normal speed and enable collisions when the car slows down enough
+{
+	if (thMult == 0.01f && momentum < kSlow)
+	{
+		thMult = 1.0f; //If momentum becomes low after thrust got locked enable it again
+		colIndexSphere = -1; //Reset collision index so the recent sphere can be collided with again
+		colIndexBox = -1; //Reset collision index so the recent box can be collided with again
+		colIndexCar = -1; //Reset collision index so the recent car can be collided with again
+	}
+}
+
+Vector2D HoverCar::Contact(float time) //Point the car reached along this tick's move when it touched an obstacle, stopped just short of it
+{
+	Vector2D move = pos - prevPos;
+	float length = sqrt(move.Length());
+	if (length <= kContactGap) return prevPos; //Too short a move to back off from
+	return prevPos + move * max(0.0f, time - kContactGap / length);
+}
+
+void HoverCar::SphereCollision(int index, Vector2D contact) //Collision with a sphere shaped obstacle
+{
+	if (index != colIndexSphere) //If it's not the object that already got collided with (prevents getting stuck in objects)
+	{
+		//Move back to where the car touched the obstacle
+		pos = contact;
+
+		//Temporarily lower thrust and ignore object just collided with
+		momentum = momentum * -1.0f; //Reverse momentum for a bounce back effect
+		thMult = 0.01f; //Lower thrust
+		colIndexSphere = index; //Record index of the object collided with
+		colIndexBox = -1; //Reset box index in case of a bounceback
+		collisions++;
+
+		//Damage car
+		TakeDamage(colDamage);
+	}
+}
+
+void HoverCar::BoxCollision(int index, ColAxis a, Vector2D contact) //Collision with a box shaped obstacle
+{
+	if (index != colIndexBox) //If it's not the object that already got collided with (prevents getting stuck in objects)
+	{
+		//Move back to where the car touched the obstacle
+		pos = contact;
+
+		//Momentum change
+		if (a == colX) momentum.x = momentum.x * -1; //If collided on Z axis reverse momentum on the Z axis
+		else if (a == colZ) momentum.z = momentum.z * -1; //If collided on X reverse on X
+		else momentum = momentum * -1; //If collided on both reverse completely
+
+		//Temporarily lower thrust and ignore object just collided with
+		thMult = 0.01f; //Lower thrust
+		colIndexBox = index; //Record index of the object collided with
+		colIndexSphere = -1; //Reset sphere index in case of a bounceback
+		collisions++;
+
+		//Damage car
+		TakeDamage(colDamage);
+	}
+	else if (isAI)
+	{
+		momentum = momentum * 2.0f; //Prevents AI cars from getting stuck
+	}
+}
+
+bool HoverCar::Touching(const HoverCar &car2) const //True if the two cars overlap
+{
+	Vector2D dist = { (pos.x - car2.pos.x), (pos.z - car2.pos.z) };
+	return pow(dist.x, 2) + pow(dist.z, 2) - pow(r, 2) * kCarColRadiusMult < 0;
+}
+
+void HoverCar::CarCollision(HoverCar *car2, int index) //Bounce two touching cars off each other
+{
+	Vector2D dist = { (pos.x - (*car2).pos.x), (pos.z - (*car2).pos.z) };
+
+	//Reset position to before collision occured
+	pos = prevPos;
+	(*car2).pos = (*car2).prevPos;
+
+	//Change momentums of the collided cars to make them bounce off a little
+	dist = dist.Normal() * kCarColImpact; //Increased for a stronger bounce
+	float change = (pos.x * dist.x + pos.z * dist.z) - ((*car2).pos.x * dist.x + (*car2).pos.z * dist.z);
+
+	momentum = { change * dist.x, change * dist.z };
+	(*car2).momentum = -momentum;
+
+	//Temporarily lower thrust and ignore the car collided with
+	thMult = 0.01f;
+	colIndexCar = index;
+	colIndexSphere = -1;
+	colIndexBox = -1;
+	collisions++;
+	(*car2).collisions++;
+
+	//Damage cars (Damage is lowered because cars are lighter than immobile objects)
+	int damage = (colDamage + (*car2).colDamage) / 3;
+	TakeDamage(damage);
+	(*car2).TakeDamage(damage);
+
+	//If either or both cars are burning, combine their burn times and share the result between the cars
+	float newBurnTime = burnTimer + (*car2).burnTimer;
+	burnTimer = newBurnTime;
+	(*car2).burnTimer = newBurnTime;
+
+	//Change lane of the car behind to stop bumping into the other one's back
+	if (lane == (*car2).lane)
+	{
+		if (racePos > (*car2).racePos) AISwitchLane();
+		else (*car2).AISwitchLane();
+	}
+}
+
+void HoverCar::Burn() //Emit fire particles and take damage
+{
+	//Fire particles
+	fire[0].UpdateOrigin(Vector3D{ pos.x, height + bobbleY + kBurnHeight, pos.z });
+	fire[0].Update(fTime, 1, -momentum);
+
+	//Timers
+	if (momentum.Length() > kBurnExtinguishSpeed) burnTimer -= fTime;
+	else burnTimer -= fTime * kBurnExtinguisMult;
+
+	burnDamageTimer += fTime;
+
+	//Damage
+	if (burnDamageTimer > kBurnDamageInterval)
+	{
+		TakeDamage(kBurnDamage);
+		burnDamageTimer = 0.0f;
+	}
+
+	//Burning stops
+	if (burnTimer < 0.0f)
+	{
+		burnDamageTimer = 0.0f; //Next time the car starts burning the interval will start over
+	}
+}
+
+void HoverCar::Explosion(Vector2D bomb) //Push the car away from a bomb and take damage
+{
+	if (explosionTimer <= 0.0f)
+	{
+		Vector2D dist = { (pos.x - bomb.x), (pos.z - bomb.z) };
+
+		//Make sure the pushback isn't too strong or too weak
+		float len = dist.Length();
+		if (len < kBombMinDist) len = kBombMinDist;
+		else if (len > kBombMaxDist) len = kBombMaxDist;
+
+		dist = dist.Normal() * (kBombImpact / len); //Being closer to the bomb makes pushback stronger
+		momentum = momentum - dist;
+
+		TakeDamage(int(kBombDamage / len)); //Take more damage when close to bomb
+
+		explosionTimer = kExplosionCooldown;
+	}
+}
+
+void HoverCar::Move() //Move the car according to its momentum
+{
+	if (hp <= 0) thrust = kZeroVector; //Disable acceleration if dead
+	drag = momentum * kDragCoefficient * drMult * fTime; //Calculate drag
+	momentum = momentum + thrust + drag; //New momentum
+	prevPos = pos; //Save previous postion
+	pos = pos + momentum * fTime; //Move according to new momentum
+}
+
+void HoverCar::Rotate() //Update lean and tilt values
+{
+	lean -= lean * kTiltDrag * fTime;
+	tilt -= tilt * kTiltDrag * fTime;
+}
+
+void HoverCar::Bobble() //Move the car up and down
+{
+	if (height + bobbleY > kCarHoverHeight + kCarHoverRange) bobbleDir = down; //If highest height reached change direction to down
+	else if (height + bobbleY < kCarHoverHeight - kCarHoverRange) bobbleDir = up; //If lowest change to up
+	bobbleY += kCarHoverSpeed * bobbleDir * fTime; //Move up or down depending on direction
+}
+
+void HoverCar::Tilt(float dir) //Update the tilt value, takes a direction multiplier of 1 or -1
+{
+	float change = kCarTiltFactor * dir * fTime; //Change in car's local X angle
+
+	if (tilt + change < kCarMaxTilt && tilt + change > -kCarMaxTilt / 2) tilt += change; //Apply change if it doesn't make tilt go out of bounds
+	else if (tilt + change > kCarMaxTilt) tilt = kCarMaxTilt;
+	else if (tilt + change < -kCarMaxTilt / 2) tilt = -kCarMaxTilt / 2;
+
+}
+
+void HoverCar::Lean(float dir) //Update the lean value, takes a direction multiplier of 1 or -1
+{
+	float change = kCarLeanFactor * dir * fTime; //Change in car's local Z angle
+
+	if (lean + change < kCarMaxLean && lean + change > -kCarMaxLean) lean += change; //Apply change if it doesn't make lean go out of bounds
+	else if (lean + change > kCarMaxLean) lean = kCarMaxLean;
+	else if (lean + change < -kCarMaxLean) lean = -kCarMaxLean;
+}
+
+void HoverCar::Boost(PlayerInput input) //Checks performed when player attempts to use boost, along with consecutive actions
+{
+	if (hp >= kLowHP * kMaxHP) //If hp is above 30%
+	{
+		if (input.boost && !boostLock && thrust.Length() > kBoostMinThrust) //When boost key is pressed, boost isn't locked and car isn't still
+		{
+			if (boostTimer > 0)
+			{
+				boostMult = kBoostMult;
+				boostTimer -= fTime;
+			}
+			if (boostTimer <= 0) //If boost key is pressed too long overheat and lock the boost for 5 seconds
+			{
+				boostMult = 1.0f;
+				boostTimer = kOverheatPenalty;
+				boostLock = 1;
+				drMult = 2.0f; //Double drag
+			}
+		}
+		else
+		{
+			if (boostTimer < kBoostTime) //When key isn't pressed and boost timer isn't max increase it
+			{
+				boostTimer += fTime;
+				if (boostLock) if (boostTimer >= 0)
+				{
+					boostLock = 0; //Remove lock after 5 seconds pass
+					drMult = 1.0f; //Drag goes back to normal
+				}
+			}
+			else boostTimer = kBoostTime; //If went over max set to max
+			if (boostTimer >= 0) boostMult = 1.0f; //If not boosting and not overheat boost goes back to normal
+		}
+	}
+	else //Boost permanently disabled if HP is below 30%
+	{
+		if (boostTimer < 0 && boostTimer > kOverheatPenalty) //If player was in overheat make sure the drag goes back to normal first
+		{
+			boostTimer += fTime;
+		}
+		else
+		{
+			drMult = 1.0f;
+			boostTimer = -10.0f;
+		}
+		boostMult = 1.0f; //In case it was increased
+		boostLock = 1; //Keep locked
+	}
+}
+
+void HoverCar::BeginTick(float tickTime) //Remember the transform from before the tick and set the time step
+{
+	fTime = tickTime;
+	lastPos = pos;
+	lastYaw = yaw;
+}
+
+void HoverCar::Update(float frameTime) //Actions performed every tick, after the race has moved the car
+{
+	fTime = frameTime; //Get time to be used in movement
+
+	//Movement
+	fVector = FacingVector(yaw);
+	Rotate(); //Apply changes in rotation
+	Bobble(); //Up and down movement
+
+	//Damage
+	UpdateDamage();
+
+	//Particles
+	UpdateParticles();
+}
+
+CarPose HoverCar::Pose() const //Transform over the latest tick, for a snapshot
+{
+	return { lastPos, pos, lastYaw, yaw, height, bobbleY, tilt, lean };
+}
+
+void HoverCar::Present(const CarPose &pose, float alpha) //Move the models to the transform of a snapshot interpolated between its last two ticks
+{
+	float turn = fmod(pose.yaw - pose.lastYaw + 540.0f, 360.0f) - 180.0f; //Shortest way round from the last rotation
+
+	dummy->SetPosition(pose.lastPos.x + (pose.pos.x - pose.lastPos.x) * alpha, pose.height, pose.lastPos.z + (pose.pos.z - pose.lastPos.z) * alpha);
+	dummy->ResetOrientation();
+	dummy->RotateY(pose.lastYaw + turn * alpha);
+
+	car->SetLocalPosition(0.0f, pose.bobbleY, 0.0f);
+	car->ResetOrientation();
+	car->RotateLocalX(pose.tilt);
+	car->RotateLocalZ(pose.lean);
+}
+
+void HoverCar::Serialize(SimState &s) //Write everything a tick can change to a snapshot or read it back
+{
+	//Transform
+	s.Field(pos);
+	s.Field(height);
+	s.Field(yaw);
+	s.Field(bobbleY);
+	s.Field(lastPos);
+	s.Field(lastYaw);
+
+	//Time
+	s.Field(fTime);
+	s.Field(raceTime);
+
+	//Movement
+	s.Field(momentum);
+	s.Field(thrust);
+	s.Field(drag);
+	s.Field(fVector);
+	s.Field(thMult);
+	s.Field(boostMult);
+	s.Field(drMult);
+	s.Field(bobbleDir);
+	s.Field(tilt);
+	s.Field(lean);
+
+	//Collision detection
+	s.Field(currentSquare);
+	s.Field(prevPos);
+	s.Field(colIndexSphere);
+	s.Field(colIndexBox);
+	s.Field(colIndexCar);
+	s.Field(trigger);
+	s.Field(triggerCount);
+
+	//Race
+	s.Field(nextCheck);
+	s.Field(lap);
+	s.Field(racePos);
+	s.Field(progress);
+	s.Array(lapTimes);
+	s.Field(collisions);
+	s.Field(random);
+
+	//Health
+	s.Field(hp);
+	s.Field(colDamage);
+	s.Field(explosionTimer);
+
+	//Boost
+	s.Field(boostTimer);
+	s.Field(boostLock);
+
+	//Particles
+	fire[0].Serialize(s);
+	smoke[0].Serialize(s);
+	exhaust[0].Serialize(s);
+	s.Field(burnTimer);
+	s.Field(burnDamageTimer);
+
+	//AI
+	s.Field(lane);
+	s.Field(goalDist);
+	s.Field(goalSample);
+	s.Field(newThrust);
+	s.Field(speedChangeCD);
+}
+
+//UI
+HudText& HudText::operator << (const char* s) //Append text
+{
+	Append(s, strlen(s));
+	return *this;
+}
+
+HudText& HudText::operator << (const string &s)
+{
+	Append(s.data(), s.size());
+	return *this;
+}
+
+HudText& HudText::operator << (int n) //Append a whole number
+{
+	char digits[12]; //Written backwards from the end
+	int i = sizeof(digits);
+	unsigned int u = n < 0 ? 0u - unsigned(n) : unsigned(n);
+	do
+	{
+		digits[--i] = char('0' + u % 10);
+		u /= 10;
+	} while (u > 0);
+	if (n < 0) digits[--i] = '-';
+	Append(digits + i, sizeof(digits) - i);
+	return *this;
+}
+
+HudText& HudText::operator << (Time t) //Append a time as mm:ss:cc
+{
+	int parts[3] = { t.m, t.s, t.ms };
+	for (int i = 0; i < 3; i++)
+	{
+		if (i > 0) Append(":", 1);
+		if (parts[i] >= 0 && parts[i] < 10) Append("0", 1); //Leading zero
+		*this << parts[i];
+	}
+	return *this;
+}
+
+void HudText::Append(const char* s, size_t length)
+{
+	text.append(s, min(length, kCapacity - text.size()));
+}
+
+UI::UI(I3DEngine* e) //Constructor
+{
+	//Sprites
+	uiBack = e->CreateSprite(kSpriteUIback, kUIBackX, kWindowSize.z - kBackdropHeight, 0.2f);
+	uiFront = e->CreateSprite(kSpriteUIfront, 0.0f, kWindowSize.z - kBackdropHeight);
+	for (int i = 0; i < 5; i++) uiBoost[i] = e->CreateSprite(kSpriteUIboost[i], kUIBackX, kWindowSize.z - kBackdropHeight, 0.1f);
+	uiEnd = e->CreateSprite(kSpriteUIend, 0.0f, -kEndSpriteY); //Make sure it's not visible
+
+	//Fonts
+	uiStatusFont = e->LoadFont(kUIFont, kUIStatusFontSize);
+	uiFont = e->LoadFont(kUIFont, kUIFontSize);
+	uiEndFont = e->LoadFont(kUIFont, kUIEndFontSize);
+}
+
+Hud::Hud() //Constructor
+{
+	//Text
+	status << "Hit Space to Start";
+	lap << "Lap 1/" << kLaps;
+
+	health << kMaxHP << "/" << kMaxHP << "HP";
+	hpColour = kCyan;
+	shownHP = kMaxHP;
+
+	endStatus2 << "Press F1 to play again.";
+}
+
+void Hud::Reset() //Reset the HUD to its state from before the race started
+{
+	//Text reset
+	status.Clear() << "Hit Space to Start";
+	lap.Clear() << "Lap 1/" << kLaps;
+
+	health.Clear() << kMaxHP << "/" << kMaxHP << "HP";
+	hpColour = kCyan;
+	shownHP = kMaxHP;
+	shownCountdown = -1;
+
+	//Other
+	end = 0;
+	resets++;
+}
+
+void Hud::ShowEndStatus() //Make the end backdrop and text visible, triggered on death and race completion
+{
+	end = 1; //The UI puts the backdrop up when it sees this
+}
+
+void Hud::UpdateWinner(string name, Time t) //When the first car completes a race the end text is updated with its name and time
+{
+	endStatus.Clear() << "RACE COMPLETE! " << name << " WON WITH A TIME OF " << t;
+}
+
+
+void Hud::UpdateStatus(int nCheck, int cLap, int lastCheck) //Updates to the status message, triggered when crossing checpoints
+{
+	status.Clear();
+	if (cLap > kLaps) status << "Race complete!";
+	else
+	{
+		if (nCheck == 0) nCheck = lastCheck; //If next lap is first in array then the one just passed was last in it
+		status << "Stage " << nCheck << " complete";
+
+		lap.Clear() << "Lap " << cLap << "/" << kLaps;
+	}
+
+}
+
+void Hud::UpdateHP(int hp) //After a damage check the hp status is updated to show player's current hp
+{
+	if (hp < 0) hp = 0;
+	if (hp == shownHP) return; //Called every tick, but hp rarely changes
+	shownHP = hp;
+
+	health.Clear() << hp << "/" << kMaxHP << "HP";
+	if (hp < kMaxHP * kLowHP) hpColour = kMagenta; //If hp is low change colour of the text
+}
+
+void Hud::UpdateGeneral(float kmphSpeed, Time raceTime, int playerPos, int carNumber) //Update to speed, time elapsed and race position text
+{
+	//Speed
+	int kmph = int(round(kmphSpeed));
+	if (kmph != shownSpeed)
+	{
+		shownSpeed = kmph;
+		speed.Clear() << kmph << "km/h";
+	}
+
+	//Time elapsed
+	int hundredths = (raceTime.m * 60 + raceTime.s) * 100 + raceTime.ms;
+	if (hundredths != shownTime)
+	{
+		shownTime = hundredths;
+		time.Clear() << raceTime;
+	}
+
+	//Position in race
+	if (playerPos != shownPos || carNumber != shownCars)
+	{
+		shownPos = playerPos;
+		shownCars = carNumber;
+		pos.Clear() << "Pos " << playerPos << "/" << carNumber;
+	}
+}
+
+void UI::UpdateBoost(float bTime) //Boost bar update, takes player's boost time
+{
+	if (bTime < 0) boostTimer -= fTime; //The timer makes the overhead/boost down text flash, updated when it should be shown and flashing
+
+	int message = 0; //Boost message to show, if any
+	if (bTime < 0 && boostTimer < 0) //Show text if timer is below 0
+	{
+		if (bTime == -10) message = 1;
+		else message = 2;
+
+		if (boostTimer <= -kBoostTextTime) boostTimer = kBoostTextFlashTime; //Reset timer
+	}
+	if (message != shownBoost)
+	{
+		shownBoost = message;
+		boost.Clear();
+		if (message == 1) boost << "BOOST DOWN";
+		else if (message == 2) boost << "OVERHEAT";
+	}
+
+	float boostPerSec = kBoostLen / kBoostTime; //Length of the boost bar that's depleted each second of use
+	int colourIndex; //Used to change colour based on boost time left
+
+	//Depending on boost timer change colour of the boost bar
+	if (bTime >= kBoostLevel[0]) colourIndex = 0;
+	else if (bTime < kBoostLevel[3]) colourIndex = 4;
+	else if (bTime < kBoostLevel[2]) colourIndex = 3;
+	else if (bTime < kBoostLevel[1]) colourIndex = 2;
+	else if (bTime < kBoostLevel[0]) colourIndex = 1;
+
+	for (int i = 0; i < 5; i++)
+	{
+		if (i == colourIndex) uiBoost[i]->SetX(kUIBackX - kBoostTime * boostPerSec + bTime * boostPerSec); //If boost is being used (not at max time) the bar will gradually hide
+		else uiBoost[i]->SetX(0.0f); //Hide if not current colour
+	}
+}
+
+void Hud::UpdateCountdown(float countdown) //Countdown text at the start of race
+{
+	int seconds = countdown > 0 ? int(ceil(countdown)) : 0;
+	if (seconds == shownCountdown) return; //Only changes once a second
+	shownCountdown = seconds;
+
+	status.Clear();
+	if (seconds > 0) status << seconds << "...";
+	else status << "Go!";
+}
+
+void Hud::GameOver() //Updates text and shows end status when the player dies
+{
+	status.Clear() << "Game Over";
+	endStatus.Clear() << "GAME OVER";
+	ShowEndStatus();
+}
+
+void UI::Update(float frameTime, float boostTime, const Hud &hud) //Display the HUD of a snapshot and update boost bar
+{
+	fTime = frameTime;
+
+	//Catch up with resets and the end of the race
+	if (hud.resets != resets)
+	{
+		boostTimer = -1.0f;
+		resets = hud.resets;
+	}
+	if (hud.end != endShown)
+	{
+		uiEnd->SetY(hud.end ? kEndSpriteY : -kEndSpriteY); //Make sprite visible, or hide it again
+		endShown = hud.end;
+	}
+
+	UpdateBoost(boostTime);
+
+	//Print status
+	uiStatusFont->Draw(hud.status.str(), kStatusX, kUITextHeight, kCyan, kLeft, kVCentre);
+
+	//Print current lap
+	uiFont->Draw(hud.lap.str(), kLapX, kUITextHeight - kUITextSpace, kCyan, kLeft, kVCentre);
+
+	//Print current position in race
+	uiFont->Draw(hud.pos.str(), kLapX, kUITextHeight + kUITextSpace, kCyan, kLeft, kVCentre);
+
+	//Print hp amount 
+	uiFont->Draw(hud.health.str(), kHealthX, kUITextHeight, hud.hpColour, kLeft, kVCentre);
+
+	//Print current speed
+	uiFont->Draw(hud.speed.str(), kSpeedX, kUITextHeight - kUITextSpace, kCyan, kLeft, kVCentre);
+
+	//Print current time
+	uiFont->Draw(hud.time.str(), kSpeedX, kUITextHeight + kUITextSpace, kCyan, kLeft, kVCentre);
+
+	//Print boost status
+	uiStatusFont->Draw(boost.str(), kBoostX, kUITextHeight, kMagenta, kCentre, kVCentre);
+
+	//At the end of the race, display winner and their time
+	if (hud.end)
+	{
+		uiEndFont->Draw(hud.endStatus.str(), int(kWindowSize.x / 2), kEndTextY, kMagenta, kCentre, kVCentre);
+		uiStatusFont->Draw(hud.endStatus2.str(), int(kWindowSize.x / 2), kEndText2Y, kCyan, kCentre, kVCentre);
+	}
+}
+
+#ifdef HEADLESS
+int HudCheckTool() //Drive the HUD through changing race values and check it doesn't allocate once it's set up, copying it as snapshots do
+{
+	const int kFrames = 100000;
+	const float kFrameTime = 1.0f / 60.0f;
+
+	I3DEngine* engine = New3DEngine(kTLX);
+	Hud hud; //Updated as the simulation does it
+	Hud shown; //Copy the UI draws, as the render thread gets it
+	UI ui(engine);
+
+	long long before = allocations;
+	for (int f = 0; f < kFrames; f++)
+	{
+		float t = f * kFrameTime;
+		if (t < kMaxCount + 1.0f) hud.UpdateCountdown(kMaxCount - t); //Counting down, then "Go!"
+		if (f % 12 == 0) hud.UpdateGeneral(float(f % 700), GetTime(t), 1 + f / 90 % 4, kMaxCars); //As often as the race updates the speed
+		hud.UpdateHP(kMaxHP - f / 40 % (kMaxHP + 1));
+		if (f % 900 == 0) hud.UpdateStatus(f / 900 % 12, 1 + f / 10800, 12);
+		if (f == kFrames / 2) hud.UpdateWinner("CAR3", GetTime(t));
+		if (f == kFrames * 3 / 4) hud.GameOver();
+
+		//Boost going down and up again, with the boost down and overheat messages flashing in between
+		int phase = f % 600;
+		float boost = phase < 100 ? -10.0f : phase < 200 ? -1.0f : kBoostTime * (phase - 200) / 400.0f;
+		shown = hud;
+		ui.Update(kFrameTime, boost, shown);
+	}
+	long long made = allocations - before;
+
+	cout << kFrames << " HUD frames made " << made << " heap allocations (" << double(made) / kFrames << " per frame)" << endl;
+	engine->Delete();
+	return made == 0 ? 0 : 1;
+}
+#endif
+
+//Camera
+Camera::Camera(I3DEngine* e, IMesh* dummyMesh, const HoverCar &player) //Constructor
+{
+	camera = e->CreateCamera(kManual, 0.0f, 0.0f, 0.0f);
+	dummy = dummyMesh->CreateModel();
+	camera->AttachToParent(dummy);
+	dummy->AttachToParent(player.dummy);
+	SetMode(0);
+}
+
+void Camera::Controls(I3DEngine* e, HoverCar *player) //Take key input to move the camera and change its modes
+{
+	//Movement
+	if (e->KeyHeld(kKeyCameraUp)) dummy->MoveLocalZ(kCameraSpeed * fTime);
+	if (e->KeyHeld(kKeyCameraDown)) dummy->MoveLocalZ(-kCameraSpeed * fTime);
+	if (e->KeyHeld(kKeyCameraLeft)) dummy->MoveLocalX(-kCameraSpeed * fTime);
+	if (e->KeyHeld(kKeyCameraRight)) dummy->MoveLocalX(kCameraSpeed * fTime);
+
+	if (dummy->GetY() < kYLimit) camera->SetY(kYLimit);
+
+	//Rotation
+	dummy->ResetOrientation();
+	mouseMoveX += e->GetMouseMovementX();
+	mouseMoveY += e->GetMouseMovementY();
+	dummy->RotateLocalY(mouseMoveX * kCameraRotation);
+	dummy->RotateLocalX(mouseMoveY * kCameraRotation);
+
+	if (mouseMoveY < -kCameraLimit) mouseMoveY = -kCameraLimit;
+	else if (mouseMoveY > kCameraLimit) mouseMoveY = kCameraLimit;
+
+	//Mouse capture
+	if (e->KeyHit(kKeyCameraCapture)) mouseCaptureOn = !mouseCaptureOn;
+	if (mouseCaptureOn) e->StartMouseCapture();
+	else e->StopMouseCapture();
+
+	//Chase mode
+	if (e->KeyHit(kKeyCameraChase))
+	{
+		SetMode(0);
+		dummy->DetachFromParent();
+		dummy->AttachToParent((*player).dummy);
+	}
+	//First person mode
+	else if (e->KeyHit(kKeyCameraFP))
+	{
+		SetMode(1);
+		dummy->DetachFromParent();
+		dummy->AttachToParent((*player).car);
+	}
+	//Free mode
+	else if (e->KeyHit(kKeyCameraFree))
+	{
+		SetMode(2);
+		dummy->DetachFromParent();
+	}
+}
+
+void Camera::SetMode(int i) //Use the passed index to select one of the modes and set the camera position and rotation accordingly
+{
+	dummy->SetLocalPosition(kCameraModes[i].pos.x, kCameraModes[i].pos.y, kCameraModes[i].pos.z);
+	mouseMoveX = kCameraModes[i].mouseX;
+	mouseMoveY = kCameraModes[i].mouseY;
+	modeIndex = i;
+}
+
+void Camera::Shake() //Trigger camera shaking
+{
+	shakeTimer = kShakeDuration;
+
+	if (modeIndex == 1) yGoal = -kShakeFPHeight;
+	else yGoal = -kShakeHeight;
+}
+
+void Camera::Update(I3DEngine* e, float frameTime, HoverCar *player, int raceShakes) //Update frame time and take input, and shake if the race counted a new explosion
+{
+	fTime = frameTime;
+	Controls(e, player);
+
+	if (raceShakes != shakes)
+	{
+		Shake();
+		shakes = raceShakes;
+	}
+
+	//Shake the camera
+	shakeTimer -= fTime;
+	if (shakeTimer > 0.0f)
+	{
+		if (modeIndex == 1) //If in first person mode shake less
+		{
+			if (camera->GetLocalY() > kShakeFPHeight) yGoal = -kShakeFPHeight;
+			else if (camera->GetLocalY() < -kShakeFPHeight) yGoal = kShakeFPHeight;
+		}
+		else
+		{
+			if (camera->GetLocalY() > kShakeHeight) yGoal = -kShakeHeight;
+			else if (camera->GetLocalY() < -kShakeHeight) yGoal = kShakeHeight;
+		}
+	}
+	else yGoal = 0.0f;
+
+	if (modeIndex == 1)
+	{
+		if (camera->GetLocalY() > yGoal) camera->MoveLocalY(-kShakeFPSpeed * fTime);
+		else if (camera->GetLocalY() < yGoal) camera->MoveLocalY(kShakeFPSpeed * fTime);
+	}
+	else
+	{
+		if (camera->GetLocalY() > yGoal) camera->MoveLocalY(-kShakeSpeed * fTime);
+		else if (camera->GetLocalY() < yGoal) camera->MoveLocalY(kShakeSpeed * fTime);
+	}
+
+	if (yGoal == 0.0f && pow(camera->GetLocalY() - yGoal, 2) < pow(kShakeSpeed * fTime, 2)) camera->SetLocalY(0);
+}
+
+//Collision detection
+BoundingBox::BoundingBox(float xPos, float zPos, float halfWidth, float halfLength) //Constructor
+{
+	Initialise(xPos, zPos, halfWidth, halfLength);
+}
+
+void BoundingBox::Initialise(float xPos, float zPos, float halfWidth, float halfLength) //Separated to make an early definition possible (needed for checkpoints)
+{
+	xStart = xPos - halfWidth;
+	xEnd = xPos + halfWidth;
+	zStart = zPos - halfLength;
+	zEnd = zPos + halfLength;
+}
+
+ColAxis BoundingBox::Collision(HoverCar *car) const //Collision detection with a hover car, returns collision direction
+{
+	return Collision((*car).pos, (*car).prevPos, (*car).r);
+}
+
+ColAxis BoundingBox::Collision(Vector2D pos, Vector2D prevPos, float radius) const //Same test for a circle that moved from prevPos to pos
+{
+	PROFILE_SCOPE("Box collision");
+	if ((pos.x + radius) > xStart && (pos.x - radius) < xEnd && (pos.z + radius) > zStart && (pos.z - radius) < zEnd)
+	{
+		if (prevPos.x + radius > xStart && prevPos.x - radius < xEnd &&
+			!(prevPos.z + radius > zStart && prevPos.z - radius < zEnd)) return colZ; //If X overlaps col was on Z axis 
+		else if (prevPos.z + radius > zStart && prevPos.z - radius < zEnd &&
+			!(prevPos.x + radius > xStart && prevPos.x - radius < xEnd)) return colX; //If Z then X axis
+		else return both; //If collided at an angle then collision was on both axes
+	}
+	else return none;
+}
+
+BoundingSphere::BoundingSphere(float xPos, float zPos, float radius) //Constructor
+{
+	x = xPos;
+	z = zPos;
+	r = pow(radius, 2);
+}
+
+bool BoundingSphere::Collision(HoverCar *car) const //Collision detection with a hover car
+{
+	return Collision((*car).pos, (*car).r);
+}
+
+bool BoundingSphere::Collision(Vector2D pos, float radius) const //Same test for a circle
+{
+	float dx = x - pos.x;
+	float dz = z - pos.z;
+	return (dx * dx + dz * dz - r - radius * radius) < 0; //Returns true if distance is smaller than 0
+}
+
+//Obstacle lists
+int FirstBit(int mask) //Index of the lowest set bit of a non-zero SIMD comparison mask
+{
+	int i = 0;
+	while (!(mask & 1))
+	{
+		mask >>= 1;
+		i++;
+	}
+	return i;
+}
+
+BoundingBox BoxList::operator [] (size_t i) const
+{
+	BoundingBox box;
+	box.xStart = xStart[i];
+	box.xEnd = xEnd[i];
+	box.zStart = zStart[i];
+	box.zEnd = zEnd[i];
+	return box;
+}
+
+int BoxList::FirstHit(Vector2D pos, float radius) const //Index of the first box a circle overlaps, -1 if there isn't one
+{
+#if defined(OBSTACLE_AVX)
+	__m256 left = _mm256_set1_ps(pos.x - radius);
+	__m256 right = _mm256_set1_ps(pos.x + radius);
+	__m256 back = _mm256_set1_ps(pos.z - radius);
+	__m256 front = _mm256_set1_ps(pos.z + radius);
+
+	for (size_t i = 0; i < count; i += 8) //Padding makes every block of 8 safe to load
+	{
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(right, _mm256_loadu_ps(xStart + i), _CMP_GT_OQ), _mm256_cmp_ps(left, _mm256_loadu_ps(xEnd + i), _CMP_LT_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(front, _mm256_loadu_ps(zStart + i), _CMP_GT_OQ));
+		hit = _mm256_and_ps(hit, _mm256_cmp_ps(back, _mm256_loadu_ps(zEnd + i), _CMP_LT_OQ));
+
+		int mask = _mm256_movemask_ps(hit);
+		if (mask) return int(i) + FirstBit(mask); //Padding can't be hit, so this is always a real box
+	}
+	return -1;
+#elif defined(OBSTACLE_SSE)
+	__m128 left = _mm_set1_ps(pos.x - radius);
+	__m128 right = _mm_set1_ps(pos.x + radius);
+	__m128 back = _mm_set1_ps(pos.z - radius);
+	__m128 front = _mm_set1_ps(pos.z + radius);
+
+	for (size_t i = 0; i < count; i += 4) //Padding makes every block of 4 safe to load
+	{
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(right, _mm_loadu_ps(xStart + i)), _mm_cmplt_ps(left, _mm_loadu_ps(xEnd + i)));
+		hit = _mm_and_ps(hit, _mm_cmpgt_ps(front, _mm_loadu_ps(zStart + i)));
+		hit = _mm_and_ps(hit, _mm_cmplt_ps(back, _mm_loadu_ps(zEnd + i)));
+
+		int mask = _mm_movemask_ps(hit);
+		if (mask) return int(i) + FirstBit(mask); //Padding can't be hit, so this is always a real box
+	}
+	return -1;
+#else
+	return FirstHitScalar(pos, radius);
+#endif
+}
+
+int BoxList::FirstHitScalar(Vector2D pos, float radius) const //Same test one box at a time
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if ((pos.x + radius) > xStart[i] && (pos.x - radius) < xEnd[i] && (pos.z + radius) > zStart[i] && (pos.z - radius) < zEnd[i]) return int(i);
+	}
+	return -1;
+}
+
+void BoxList::Sweep(Vector2D from, Vector2D to, float radius, SweepHit &hit) const //Keep the box a circle moving from one point to another touches first, if it's earlier than the hit so far
+{
+	Vector2D move = to - from;
+	for (size_t i = 0; i < count; i++)
+	{
+		//Grow the box by the radius so the circle can be swept as a point, the same square corners as the overlap test
+		float x0 = xStart[i] - radius, x1 = xEnd[i] + radius;
+		float z0 = zStart[i] - radius, z1 = zEnd[i] + radius;
+		if (max(from.x, to.x) <= x0 || min(from.x, to.x) >= x1 || max(from.z, to.z) <= z0 || min(from.z, to.z) >= z1) continue; //The move doesn't come near
+
+		if (from.x > x0 && from.x < x1 && from.z > z0 && from.z < z1) //Already overlapping before moving
+		{
+			if (hit.time > 0.0f || hit.index < 0)
+			{
+				hit.time = 0.0f;
+				hit.normal = (from - Vector2D{ (xStart[i] + xEnd[i]) / 2, (zStart[i] + zEnd[i]) / 2 }).Normal();
+				hit.axis = both; //Same as the overlap test gives when the last position overlapped on both axes
+				hit.index = id[i];
+				hit.box = true;
+			}
+			continue;
+		}
+
+		//Times the point enters and leaves each slab, a move along a slab never enters or leaves it
+		float enterX = -1.0f, leaveX = 2.0f, enterZ = -1.0f, leaveZ = 2.0f;
+		if (move.x != 0.0f)
+		{
+			enterX = ((move.x > 0.0f ? x0 : x1) - from.x) / move.x;
+			leaveX = ((move.x > 0.0f ? x1 : x0) - from.x) / move.x;
+		}
+		if (move.z != 0.0f)
+		{
+			enterZ = ((move.z > 0.0f ? z0 : z1) - from.z) / move.z;
+			leaveZ = ((move.z > 0.0f ? z1 : z0) - from.z) / move.z;
+		}
+
+		float enter = max(enterX, enterZ);
+		if (enter < 0.0f || enter >= min(leaveX, leaveZ) || enter >= hit.time) continue; //Misses, or hits later than what was already found
+
+		hit.time = enter;
+		if (enterX > enterZ) { hit.axis = colX; hit.normal = { move.x > 0.0f ? -1.0f : 1.0f, 0.0f }; } //Came in through a side facing X
+		else if (enterZ > enterX) { hit.axis = colZ; hit.normal = { 0.0f, move.z > 0.0f ? -1.0f : 1.0f }; } //Through a side facing Z
+		else { hit.axis = both; hit.normal = (move * -1.0f).Normal(); } //Straight into a corner
+		hit.index = id[i];
+		hit.box = true;
+	}
+}
+
+BoundingSphere SphereList::operator [] (size_t i) const
+{
+	BoundingSphere sphere(x[i], z[i], 0.0f);
+	sphere.r = r[i]; //Already squared
+	return sphere;
+}
+
+int SphereList::FirstHit(Vector2D pos, float radius) const //Index of the first sphere a circle overlaps, -1 if there isn't one
+{
+#if defined(OBSTACLE_AVX)
+	__m256 px = _mm256_set1_ps(pos.x);
+	__m256 pz = _mm256_set1_ps(pos.z);
+	__m256 pr = _mm256_set1_ps(radius * radius);
+
+	for (size_t i = 0; i < count; i += 8) //Padding makes every block of 8 safe to load
+	{
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), px);
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), pz);
+		__m256 dist = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dz, dz));
+		dist = _mm256_sub_ps(_mm256_sub_ps(dist, _mm256_loadu_ps(r + i)), pr);
+
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(dist, _mm256_setzero_ps(), _CMP_LT_OQ));
+		if (mask) return int(i) + FirstBit(mask); //Padding can't be hit, so this is always a real sphere
+	}
+	return -1;
+#elif defined(OBSTACLE_SSE)
+	__m128 px = _mm_set1_ps(pos.x);
+	__m128 pz = _mm_set1_ps(pos.z);
+	__m128 pr = _mm_set1_ps(radius * radius);
+
+	for (size_t i = 0; i < count; i += 4) //Padding makes every block of 4 safe to load
+	{
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), px);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(z + i), pz);
+		__m128 dist = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dz, dz));
+		dist = _mm_sub_ps(_mm_sub_ps(dist, _mm_loadu_ps(r + i)), pr);
+
+		int mask = _mm_movemask_ps(_mm_cmplt_ps(dist, _mm_setzero_ps()));
+		if (mask) return int(i) + FirstBit(mask); //Padding can't be hit, so this is always a real sphere
+	}
+	return -1;
+#else
+	return FirstHitScalar(pos, radius);
+#endif
+}
+
+int SphereList::FirstHitScalar(Vector2D pos, float radius) const //Same test one sphere at a time
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		float dx = x[i] - pos.x;
+		float dz = z[i] - pos.z;
+		if (dx * dx + dz * dz - r[i] - radius * radius < 0) return int(i);
+	}
+	return -1;
+}
+
+int SphereList::Hits(Vector2D pos, float radius, int* hits, int maxHits) const //Write the index of every sphere a circle overlaps, up to maxHits, and return how many there were
+{
+#if defined(OBSTACLE_AVX)
+	__m256 px = _mm256_set1_ps(pos.x);
+	__m256 pz = _mm256_set1_ps(pos.z);
+	__m256 pr = _mm256_set1_ps(radius * radius);
+
+	int found = 0;
+	for (size_t i = 0; i < count; i += 8) //Padding makes every block of 8 safe to load
+	{
+		__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), px);
+		__m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + i), pz);
+		__m256 dist = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dz, dz));
+		dist = _mm256_sub_ps(_mm256_sub_ps(dist, _mm256_loadu_ps(r + i)), pr);
+
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(dist, _mm256_setzero_ps(), _CMP_LT_OQ));
+		for (; mask && found < maxHits; mask &= mask - 1) hits[found++] = int(i) + FirstBit(mask); //Lowest bit first, so the hits stay in list order
+	}
+	return found;
+#elif defined(OBSTACLE_SSE)
+	__m128 px = _mm_set1_ps(pos.x);
+	__m128 pz = _mm_set1_ps(pos.z);
+	__m128 pr = _mm_set1_ps(radius * radius);
+
+	int found = 0;
+	for (size_t i = 0; i < count; i += 4) //Padding makes every block of 4 safe to load
+	{
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), px);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(z + i), pz);
+		__m128 dist = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dz, dz));
+		dist = _mm_sub_ps(_mm_sub_ps(dist, _mm_loadu_ps(r + i)), pr);
+
+		int mask = _mm_movemask_ps(_mm_cmplt_ps(dist, _mm_setzero_ps()));
+		for (; mask && found < maxHits; mask &= mask - 1) hits[found++] = int(i) + FirstBit(mask); //Lowest bit first, so the hits stay in list order
+	}
+	return found;
+#else
+	return HitsScalar(pos, radius, hits, maxHits);
+#endif
+}
+
+int SphereList::HitsScalar(Vector2D pos, float radius, int* hits, int maxHits) const //Same test one sphere at a time
+{
+	int found = 0;
+	for (size_t i = 0; i < count && found < maxHits; i++)
+	{
+		float dx = x[i] - pos.x;
+		float dz = z[i] - pos.z;
+		if (dx * dx + dz * dz - r[i] - radius * radius < 0) hits[found++] = int(i);
+	}
+	return found;
+}
+
+void SphereList::Sweep(Vector2D from, Vector2D to, float radius, SweepHit &hit) const //Keep the sphere a circle moving from one point to another touches first, if it's earlier than the hit so far
+{
+	Vector2D move = to - from;
+	float a = move.x * move.x + move.z * move.z;
+	for (size_t i = 0; i < count; i++)
+	{
+		//The overlap test adds the squared radii, so the circle is swept as a point against a sphere of that squared radius
+		float range = r[i] + radius * radius;
+		float dx = from.x - x[i];
+		float dz = from.z - z[i];
+		float c = dx * dx + dz * dz - range;
+
+		if (c < 0.0f) //Already overlapping before moving
+		{
+			if (hit.time > 0.0f || hit.index < 0)
+			{
+				hit.time = 0.0f;
+				hit.normal = Vector2D{ dx, dz }.Normal();
+				hit.axis = both;
+				hit.index = id[i];
+				hit.box = false;
+			}
+			continue;
+		}
+		if (a == 0.0f) continue; //Not moving, so it can't run into anything
+
+		float b = dx * move.x + dz * move.z;
+		if (b >= 0.0f) continue; //Moving away from the sphere
+		float disc = b * b - a * c;
+		if (disc < 0.0f) continue; //Passes it by
+
+		float t = (-b - sqrt(disc)) / a;
+		if (t >= hit.time) continue; //Hits later than what was already found
+
+		hit.time = t;
+		hit.normal = Vector2D{ dx + move.x * t, dz + move.z * t }.Normal();
+		hit.axis = both; //Spheres bounce the car straight back
+		hit.index = id[i];
+		hit.box = false;
+	}
+}
+
+//Objects
+Object::Object(IMesh* mesh, float x, float y, float z, float r) //Constructor
+{
+	m = mesh->CreateModel(x, y, z);
+	m->RotateLocalY(r);
+}
+
+Checkpoint::Checkpoint(IMesh* checkpointMesh, IMesh* crossMesh, float x, float y, float z, float r) //Constructor
+{
+	m = checkpointMesh->CreateModel(x, y, z);
+	m->RotateLocalY(r);
+	pos = { x, z };
+
+	cross = crossMesh->CreateModel(x, -kCrossHeight, z); //Cross spawned underground so that it's invisible
+	cross->RotateLocalY(r);
+	cross->Scale(kCrossScale);
+
+	across = FacingVector(r + 90.0f); //The struts are on the model's X axis
+	forward = { across.z, -across.x };
+}
+
+void Checkpoint::Aim(Vector2D previous, Vector2D next) //Work out which way the gate is crossed from the checkpoints before and after it
+{
+	Vector2D way = (pos - previous).Normal() + (next - pos).Normal(); //Halfway between the way the cars come in and the way they leave
+	if (way.x * forward.x + way.z * forward.z < 0.0f) forward = -forward;
+}
+
+bool Checkpoint::Crossed(Vector2D from, Vector2D to, bool wide) const //True if a car that moved between two points went through the gate forwards, anywhere along the move
+{
+	//How far each point is in front of the gate, the car has to go from behind it to on or past it
+	float before = (from.x - pos.x) * forward.x + (from.z - pos.z) * forward.z;
+	float after = (to.x - pos.x) * forward.x + (to.z - pos.z) * forward.z;
+	if (before >= 0.0f || after < 0.0f) return false;
+
+	//Where the move meets the line through the gate, which has to be between the ends of the gate
+	Vector2D hit = from + (to - from) * (before / (before - after));
+	float side = (hit.x - pos.x) * across.x + (hit.z - pos.z) * across.z;
+	return fabs(side) <= (wide ? kWideGateReach : kGateReach);
+}
+
+void Checkpoint::ShowCross() //Show a cross to signify that the checkpoint has been crossed
+{
+	crossUp = true;
+	timer = kCrossTime;
+}
+
+void Checkpoint::HideCross() //Hide the cross underground
+{
+	crossUp = false;
+}
+
+void Checkpoint::Update(float fTime) //Update cross timer and hide it when time runs out
+{
+	if (timer > 0.0f)
+	{
+		timer -= fTime;
+		if (timer <= 0.0f) HideCross();
+	}
+}
+
+void Checkpoint::Present(bool up) //Raise or lower the cross model to match a snapshot
+{
+	if (up == crossShown) return;
+	cross->SetLocalY(up ? kCrossHeight : -kCrossHeight);
+	crossShown = up;
+}
+
+void Checkpoint::Serialize(SimState &s) //Write the cross timer to a snapshot or read it back
+{
+	s.Field(timer);
+	if (s.loading) crossUp = timer > 0.0f; //Show the cross if it was showing
+}
+
+Bomb::Bomb(IMesh* bombMesh, ParticlePool* particles, float x, float z, float r) //Constructor
+{
+	bomb = bombMesh->CreateModel(x, kBombYPos, z);
+	bomb->Scale(kBombScale);
+	bomb->RotateX(kBombXRot);
+	pos = { x, z };
+
+	explosionParticles.push_back(ExplosionEmitter(particles, { x, kBombYPos, z }));
+}
+
+void Bomb::Trigger() //Trigger the explosion
+{
+	state = exploding;
+	eTime = kExplosionTime;
+}
+
+void Bomb::Explosion() //Change state to inactive if explosion ended
+{
+	if (eTime < 0.0f)
+	{
+		state = inactive;
+		Deactivate();
+	}
+}
+
+void Bomb::Deactivate() //Hide the bomb and set a cooldown
+{
+	cd = kCooldown;
+}
+
+void Bomb::Reset() //Activate the bomb and put it in sight
+{
+	state = active;
+}
+
+void Bomb::Update(float fTime) //Update timers and explosion particles
+{
+	if (state == exploding)
+	{
+		explosionParticles[0].Update(fTime, 1);
+		eTime -= fTime;
+		Explosion();
+	}
+	else explosionParticles[0].Update(fTime, 0);
+
+	if (state == inactive)
+	{
+		cd -= fTime;
+		if (cd < 0.0f) Reset();
+	}
+}
+
+void Bomb::Present(BombState s) //Hide the model or change its skin to match a snapshot
+{
+	if (s == shown) return;
+	bomb->SetY(s == inactive ? -20.0f : kBombYPos);
+	bomb->SetSkin(s == active ? kDefSkin : kExplosionSkin);
+	shown = s;
+}
+
+void Bomb::Serialize(SimState &s) //Write the bomb's state to a snapshot or read it back
+{
+	s.Field(state);
+	s.Field(cd);
+	s.Field(eTime);
+	explosionParticles[0].Serialize(s);
+}
+
+//Bomb manager
+void BombManager::Update(float fTime) //Update every bomb's timers and explosion particles once
+{
+	for (size_t i = 0; i < bomb.size(); i++) bomb[i].Update(fTime);
+}
+
+void BombManager::Serialize(SimState &s) //Write every bomb's state to a snapshot or read it back
+{
+	for (size_t i = 0; i < bomb.size(); i++) bomb[i].Serialize(s);
+}
+
+//Particles
+int ParticlePool::Reserve(int count) //Make room for an emitter's particles, returns the index of the first one
+{
+	int first = int(x.size());
+	size_t size = x.size() + count;
+
+	skin.resize(size, -1);
+	x.resize(size, 0.0f);
+	y.resize(size, -100.0f); //Out of sight until emitted, in case a model is made for it when a replay seeks
+	z.resize(size, 0.0f);
+	vx.resize(size, 0.0f);
+	vy.resize(size, 0.0f);
+	vz.resize(size, 0.0f);
+	svx.resize(size, 0.0f);
+	svy.resize(size, 0.0f);
+	svz.resize(size, 0.0f);
+	life.resize(size, 0.0f);
+	totalLife.resize(size, 0.0f);
+	dead.resize(size, 0);
+	model.resize(size, nullptr);
+	shownSkin.resize(size, -1);
+
+	return first;
+}
+
+int ParticlePool::AddSkins(const vector <string> &names) //Add an emitter's skins to the table unless they're already in it, returns the index of the first one
+{
+	for (size_t i = 0; i + names.size() <= skins.size(); i++) if (equal(names.begin(), names.end(), skins.begin() + i)) return int(i);
+
+	skins.insert(skins.end(), names.begin(), names.end());
+	return int(skins.size() - names.size());
+}
+
+void ParticlePool::Emit(int i, int skinIndex, RandomStream &random, Vector3D origin, float radius, Vector3D startVelocity, float lifeRange, bool fireShape, float angle) //Give a particle its skin and spawn it
+{
+	skin[i] = skinIndex;
+
+	svx[i] = startVelocity.x;
+	svy[i] = startVelocity.y;
+	svz[i] = startVelocity.z;
+
+	float r[kSpawnRandoms];
+	random.Fill(r, kSpawnRandoms);
+	Spawn(i, r, origin, radius, lifeRange, fireShape, angle);
+}
+
+void ParticlePool::Spawn(int i, const float* r, Vector3D origin, float radius, float lifeRange, bool fireShape, float angle, Vector2D momentum) //Reset a particle's position, velocity and life from kSpawnRandoms random numbers
+{
+	float distFromOrigin = r[0] * radius; //Random distance from origin
+
+	x[i] = origin.x + distFromOrigin * float(cos(r[1] * 2.0f * kPi));
+	y[i] = origin.y;
+	z[i] = origin.z + distFromOrigin * float(cos(r[2] * 2.0f * kPi));
+
+	totalLife[i] = r[3] * lifeRange;
+	if (fireShape) totalLife[i] *= radius / distFromOrigin; //Gives fire a triangle shape
+	life[i] = 0.0f;
+
+	vx[i] = svx[i] + svx[i] * momentum.x;
+	vy[i] = svy[i];
+	vz[i] = svz[i] + svz[i] * momentum.z;
+
+	if (angle != 0)
+	{
+		vx[i] += RandomAngle(r[4], angle);
+		vz[i] += RandomAngle(r[5], angle);
+	}
+}
+
+int ParticlePool::Update(int first, int count, float fTime, Vector3D acceleration, float drag, float minVel) //Move and age a range of particles, returns how many died
+{
+	PROFILE_SCOPE("Particle update");
+	if (count <= 0) return 0;
+
+	//Plain pointers and no calls keep the loop easy for the compiler to vectorise
+	float* px = &x[first];
+	float* py = &y[first];
+	float* pz = &z[first];
+	float* pvx = &vx[first];
+	float* pvy = &vy[first];
+	float* pvz = &vz[first];
+	float* pLife = &life[first];
+	float* pTotal = &totalLife[first];
+	char* pDead = &dead[first];
+
+	int deaths = 0;
+	for (int i = 0; i < count; i++)
+	{
+		//Update velocity, drag is a fraction of the velocity taken off per second
+		pvx[i] += (acceleration.x + pvx[i] * drag) * fTime;
+		pvy[i] += (acceleration.y + pvy[i] * drag) * fTime;
+		pvz[i] += (acceleration.z + pvz[i] * drag) * fTime;
+
+		//Move the particle according to velocity, unless it's hidden (dead)
+		float moveTime = py[i] > 0.0f ? fTime : 0.0f;
+		px[i] += pvx[i] * moveTime;
+		py[i] += pvy[i] * moveTime;
+		pz[i] += pvz[i] * moveTime;
+
+		//Update life and mark the particle as dead
+		pLife[i] += fTime;
+		char d = pLife[i] > pTotal[i] || pvx[i] * pvx[i] + pvy[i] * pvy[i] + pvz[i] * pvz[i] <= minVel * minVel;
+		pDead[i] = d;
+		deaths += d;
+	}
+	return deaths;
+}
+
+void ParticlePool::Respawn(int first, int count, bool isActive, RandomStream &random, Vector3D origin, float radius, float lifeRange, bool fireShape, float angle, Vector2D momentum) //Respawn dead particles, or hide them if the emitter is off
+{
+	if (!isActive)
+	{
+		for (int i = first; i < first + count; i++) if (dead[i]) y[i] -= 100.0f; //If particles aren't actively spawned, hide from sight
+		return;
+	}
+
+	//The numbers for a batch of dead particles are filled in one go
+	int batch[kSpawnBatch];
+	float r[kSpawnBatch * kSpawnRandoms];
+	int waiting = 0;
+	for (int i = first; i <= first + count; i++)
+	{
+		if (i < first + count && dead[i]) batch[waiting++] = i;
+		if (waiting == kSpawnBatch || (i == first + count && waiting > 0))
+		{
+			random.Fill(r, waiting * kSpawnRandoms);
+			for (int j = 0; j < waiting; j++) Spawn(batch[j], r + j * kSpawnRandoms, origin, radius, lifeRange, fireShape, angle, momentum);
+			waiting = 0;
+		}
+	}
+}
+
+void ParticlePool::Capture(ParticleSnapshot &snapshot) const //Copy what the render thread draws
+{
+	//Same sizes every time, so after the first copy these don't allocate
+	snapshot.x = x;
+	snapshot.y = y;
+	snapshot.z = z;
+	snapshot.skin = skin;
+}
+
+void ParticlePool::Draw(ICamera* camera, const ParticleSnapshot &snapshot) //Move the models to the particles of a snapshot, all facing the camera
+{
+	PROFILE_SCOPE("Particle draw");
+	//The camera's orientation turned around to face it, worked out once for every particle
+	float c[4][4];
+	camera->GetMatrix(&c[0][0]);
+	Vector3D right = Vector3D{ c[0][0], c[0][1], c[0][2] }.Normal(); //Axes are normalised in case the camera is attached to a scaled model
+	Vector3D up = Vector3D{ c[1][0], c[1][1], c[1][2] }.Normal();
+	Vector3D forward = Vector3D{ c[2][0], c[2][1], c[2][2] }.Normal();
+
+	float m[4][4] = {
+		{ -right.x, -right.y, -right.z, 0.0f },
+		{ up.x, up.y, up.z, 0.0f },
+		{ -forward.x, -forward.y, -forward.z, 0.0f },
+		{ 0.0f, 0.0f, 0.0f, 1.0f } };
+
+	//One pass over every particle that has been emitted, replays can rewind to before a particle was emitted so its model is kept and reused
+	for (size_t i = 0; i < snapshot.skin.size(); i++) if (snapshot.skin[i] >= 0)
+	{
+		if (!model[i]) model[i] = mesh->CreateModel();
+		if (shownSkin[i] != snapshot.skin[i])
+		{
+			model[i]->SetSkin(skins[snapshot.skin[i]]);
+			shownSkin[i] = snapshot.skin[i];
+		}
+
+		m[3][0] = snapshot.x[i];
+		m[3][1] = snapshot.y[i];
+		m[3][2] = snapshot.z[i];
+		model[i]->SetMatrix(&m[0][0]);
+	}
+}
+
+void ParticlePool::Serialize(SimState &s) //Write the particles to a snapshot or read them back
+{
+	s.Array(x);
+	s.Array(y);
+	s.Array(z);
+	s.Array(vx);
+	s.Array(vy);
+	s.Array(vz);
+	s.Array(svx);
+	s.Array(svy);
+	s.Array(svz);
+	s.Array(life);
+	s.Array(totalLife);
+	s.Array(dead);
+}
+
+void ParticlePool::Restore(int first, int count, int firstSkin, int skinCount) //Give a skin to restored particles that haven't been emitted in this run
+{
+	for (int i = first; i < first + count; i++) if (skin[i] < 0) skin[i] = firstSkin + i % skinCount; //The random skin isn't kept, and drawing a new one would change the race
+}
+
+float RandomAngle(float r, float angle) //Turn a random number from 0 to 1 into an angle within a specified range
+{
+	return (r * 2.0f - 1.0f) * angle;
+}
+
+//Emitters
+ExplosionEmitter::ExplosionEmitter(ParticlePool* particles, Vector3D emitterOrigin, float explosionRadius, float velocityRatio) //Constructor
+{
+	radius = explosionRadius;
+	velRatio = velocityRatio;
+
+	pool = particles;
+	first = pool->Reserve(kMaxParticles);
+	random = RandomStream(pool->seed, streamParticles, unsigned(first));
+	firstSkin = pool->AddSkins(explosionSkin);
+	origin = emitterOrigin;
+}
+
+void ExplosionEmitter::NewParticle() //Add a new particle to to the array of particles
+{
+	int skinIndex = random.Int() % explosionSkin.size();
+
+	sVelocity = NewSV();
+
+	pool->Emit(first + particleIndex, firstSkin + skinIndex, random, { origin.x, kParticleHeight, origin.z }, radius, sVelocity, kMaxLife - kMinLife, 0);
+	particleIndex++;
+}
+
+Vector3D ExplosionEmitter::NewSV() //Generate a random starting vector so that the explosion particles can shoot in any direction
+{
+	//Create a randomised vector
+	int range = 100;
+	Vector3D v = { float(random.Int() % range) - float(range / 2), float(random.Int() % range), float(random.Int() % range) - float(range / 2) };
+
+	//Normalise, multiply by speed and return
+	return v.Normal() * kStartSpeed;
+}
+
+void ExplosionEmitter::Update(float fTime, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
+{
+	//Time
+	timer += fTime;
+
+	//Add new particles if limit hasn't been reached
+	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	{
+		NewParticle();
+		timer = 0.0f;
+	}
+
+	//Update existing particles, they slow down in proportion to their velocity
+	if (pool->Update(first, particleIndex, fTime, { 0.0f, 0.0f, 0.0f }, kAcceleration, kMinVel) > 0)
+	{
+		pool->Respawn(first, particleIndex, isActive, random, { origin.x, kParticleHeight, origin.z }, radius, kMaxLife - kMinLife, 0, 0.0f, momentum);
+
+		if (isActive) for (int i = first; i < first + particleIndex; i++) if (pool->dead[i]) //Respawned particles shoot off in a new direction next time
+		{
+			Vector3D sv = NewSV();
+			pool->svx[i] = sv.x;
+			pool->svy[i] = sv.y;
+			pool->svz[i] = sv.z;
+		}
+	}
+}
+
+void ExplosionEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
+{
+	//Set origin to a new one
+	origin = particleOrigin;
+}
+
+void ExplosionEmitter::Serialize(SimState &s) //Write the emitter's state to a snapshot or read it back
+{
+	s.Field(sVelocity);
+	s.Field(origin);
+	s.Field(particleIndex);
+	s.Field(timer);
+	s.Field(random);
+	if (s.loading) pool->Restore(first, particleIndex, firstSkin, int(explosionSkin.size()));
+}
+
+SmokeEmitter::SmokeEmitter(ParticlePool* particles, Vector3D emitterOrigin, float smokeRadius, float velocityRatio) //Constructor
+{
+	radius = smokeRadius;
+	velRatio = velocityRatio;
+
+	pool = particles;
+	first = pool->Reserve(kMaxParticles);
+	random = RandomStream(pool->seed, streamParticles, unsigned(first));
+	firstSkin = pool->AddSkins(smokeSkin);
+	origin = emitterOrigin;
+}
+
+void SmokeEmitter::NewParticle() //Add a new particle to to the array of particles
+{
+	int skinIndex = random.Int() % smokeSkin.size();
+
+	pool->Emit(first + particleIndex, firstSkin + skinIndex, random, origin, radius, { sVelocity.x, sVelocity.y * velRatio, sVelocity.z }, kMaxLife - kMinLife, 0, kAngle);
+	particleIndex++;
+}
+
+void SmokeEmitter::Update(float fTime, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
+{
+	//Time
+	timer += fTime;
+
+	//Add new particles if limit hasn't been reached
+	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	{
+		NewParticle();
+		timer = 0.0f;
+	}
+
+	//Update existing particles
+	if (pool->Update(first, particleIndex, fTime, kAcceleration, 0.0f, kMinVel) > 0)
+	{
+		pool->Respawn(first, particleIndex, isActive, random, origin, radius, kMaxLife - kMinLife, 0, kAngle, momentum);
+	}
+}
+
+void SmokeEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
+{
+	//Set origin to a new one
+	origin = particleOrigin;
+}
+
+void SmokeEmitter::Serialize(SimState &s) //Write the emitter's state to a snapshot or read it back
+{
+	s.Field(origin);
+	s.Field(particleIndex);
+	s.Field(timer);
+	s.Field(random);
+	if (s.loading) pool->Restore(first, particleIndex, firstSkin, int(smokeSkin.size()));
+}
+
+FireEmitter::FireEmitter(ParticlePool* particles, Vector3D emitterOrigin, float fireRadius, float velocityRatio) //Constructor
+{
+	radius = fireRadius;
+	velRatio = velocityRatio;
 
-	// Delete the 3D engine now we are finished with it
-	myEngine->Delete();
+	pool = particles;
+	first = pool->Reserve(kMaxParticles);
+	first2 = pool->Reserve(kMaxParticles2);
+	random = RandomStream(pool->seed, streamParticles, unsigned(first));
+	firstSkin = pool->AddSkins(fireSkin);
+	firstSkin2 = pool->AddSkins(fire2Skin);
+	origin = emitterOrigin;
 }
 
-//Vector2D
-float Vector2D::Length() //Returns length of a vector, but sqrt has to be applied separately as it's not needed in most cases
+void FireEmitter::NewParticle() //Add a new particle to to the array of particles
 {
-	return x * x + z * z;
+	int skinIndex = random.Int() % fireSkin.size();
+
+	pool->Emit(first + particleIndex, firstSkin + skinIndex, random, origin, radius, { sVelocity.x, sVelocity.y * velRatio, sVelocity.z }, kMaxLife - kMinLife, 1);
+	particleIndex++;
 }
 
-Vector2D Vector2D::Normal() //Normalise vector
+void FireEmitter::NewParticle2() //Add a new particle to to the second array of particles
 {
-	return { x / sqrt(Length()), z / sqrt(Length()) };
+	int skinIndex = random.Int() % fire2Skin.size();
+
+	pool->Emit(first2 + particleIndex2, firstSkin2 + skinIndex, random, origin, radius, { sVelocity2.x, sVelocity2.y * velRatio, sVelocity2.z }, kMaxLife2 - kMinLife2, 1);
+	particleIndex2++;
 }
 
-Vector2D FacingVector(IModel* m) //Calculate the facing vector or a model
+void FireEmitter::Update(float fTime, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
 {
-	float matrix[4][4];
-	m->GetMatrix(&matrix[0][0]); //Store matrix in array
-	return { matrix[2][0], matrix[2][2] }; //Z vector's X and Z values define the facing vector
+	//Time
+	timer += fTime;
+	timer2 += fTime;
+
+	//Add new particles if limit hasn't been reached
+	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	{
+		NewParticle();
+		timer = 0.0f;
+	}
+	if (isActive && particleIndex2 < kMaxParticles2 - 1 && timer2 > kFrequency)
+	{
+		NewParticle2();
+		timer2 = 0.0f;
+	}
+
+	//Update existing particles
+	if (pool->Update(first, particleIndex, fTime, kGravity, 0.0f, kMinVel) > 0)
+	{
+		pool->Respawn(first, particleIndex, isActive, random, origin, radius, kMaxLife - kMinLife, 1, 0.0f, momentum);
+	}
+	if (pool->Update(first2, particleIndex2, fTime, kGravity, 0.0f, kMinVel2) > 0)
+	{
+		pool->Respawn(first2, particleIndex2, isActive, random, origin, radius, kMaxLife2 - kMinLife2, 1, 0.0f, momentum);
+	}
 }
 
-Vector2D Vector2D::operator + (Vector2D v2) //Add two vectors together
+void FireEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
 {
-	return { x + v2.x, z + v2.z };
+	//Set origin to a new one
+	origin = particleOrigin;
 }
 
-Vector2D Vector2D::operator - (Vector2D v2) //Substract one vector from another
+void FireEmitter::Serialize(SimState &s) //Write the emitter's state to a snapshot or read it back
 {
-	return { x - v2.x, z - v2.z };
+	s.Field(origin);
+	s.Field(particleIndex);
+	s.Field(particleIndex2);
+	s.Field(timer);
+	s.Field(timer2);
+	s.Field(random);
+	if (s.loading)
+	{
+		pool->Restore(first, particleIndex, firstSkin, int(fireSkin.size()));
+		pool->Restore(first2, particleIndex2, firstSkin2, int(fire2Skin.size()));
+	}
 }
 
-Vector2D Vector2D::operator - () //Reverse vector
+ExhaustEmitter::ExhaustEmitter(ParticlePool* particles, Vector3D emitterOrigin, float exhaustRadius, float velocityRatio) //Constructor
 {
-	return { -x, -z };
+	radius = exhaustRadius;
+	velRatio = velocityRatio;
+
+	pool = particles;
+	first = pool->Reserve(kMaxParticles);
+	random = RandomStream(pool->seed, streamParticles, unsigned(first));
+	firstSkin = pool->AddSkins(exhaustSkin);
+	origin = emitterOrigin;
 }
 
-Vector2D Vector2D::operator * (float scale) //Scalar multiplication
+void ExhaustEmitter::NewParticle() //Add a new particle to to the array of particles
 {
-	return { x * scale, z * scale };
+	int skinIndex = random.Int() % exhaustSkin.size();
+
+	pool->Emit(first + particleIndex, firstSkin + skinIndex, random, origin, radius, { sVelocity.x, sVelocity.y * velRatio, sVelocity.z }, kMaxLife - kMinLife, 0, kAngle);
+	particleIndex++;
 }
 
-Vector2D Vector2D::operator * (Vector2D v2) //Multiply one vector by another
+void ExhaustEmitter::Update(float fTime, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
 {
-	return { x * v2.x, z * v2.z };
+	//Time
+	timer += fTime;
+	timer2 += fTime;
+
+	//Add new particles if limit hasn't been reached
+	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	{
+		NewParticle();
+		timer = 0.0f;
+	}
+
+	//Update existing particles
+	if (pool->Update(first, particleIndex, fTime, kGravity, 0.0f, kMinVel) > 0)
+	{
+		pool->Respawn(first, particleIndex, isActive, random, origin, radius, kMaxLife - kMinLife, 0, kAngle, momentum);
+	}
 }
 
-bool Vector2D::operator < (Vector2D v2) //Compare length of two vectors
+void ExhaustEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
 {
-	return Length() < v2.Length();
+	//Set origin to a new one
+	origin = particleOrigin;
 }
 
-bool Vector2D::operator < (float f) //Compare length of a vector with a floating number
+void ExhaustEmitter::Serialize(SimState &s) //Write the emitter's state to a snapshot or read it back
 {
-	return Length() < f;
+	s.Field(origin);
+	s.Field(particleIndex);
+	s.Field(timer);
+	s.Field(timer2);
+	s.Field(random);
+	if (s.loading) pool->Restore(first, particleIndex, firstSkin, int(exhaustSkin.size()));
 }
 
-bool Vector2D::operator > (Vector2D v2) //Compare length of two vectors
+//Conversion
+Time GetTime(float seconds)//Given a number of seconds return time in hours, minutes and seconds
 {
-	return Length() > v2.Length();
+	int s = int(floor(seconds));
+	int ms = int((seconds - s) * 100);
+	if (s > 0)
+	{
+		int m = s / 60;
+		return { m, s % 60, ms };
+	}
+	else return { 0, 0, ms };
 }
 
-bool Vector2D::operator > (float f) //Compare length of a vector with a floating number
+//Sparse grid
+int GridIndex(float f) //Grid coordinate along one axis of a position already divided by the square size
 {
-	return Length() > f;
+	f = floor(f);
+	if (!(f > -kMaxGridCoord)) return -kMaxGridCoord; //Also catches NaN
+	if (f > kMaxGridCoord) return kMaxGridCoord;
+	return int(f);
 }
 
-bool Vector2D::operator == (Vector2D v2) //Check if two vectors are equal
+unsigned int GridHash(GridCoord c) //Mix both coordinates of a square into a hash table index
 {
-	return x == v2.x && z == v2.z;
+	unsigned int h = unsigned(c.x) * 0x9E3779B1u ^ unsigned(c.z) * 0x85EBCA77u;
+	return h ^ (h >> 16);
 }
 
-//Hover Cars
-HoverCar::HoverCar(IMesh* dummyMesh, IMesh* carMesh, IMesh* particleMesh, vector<vector<Vector2D>> &paths, float startX, float startZ, string carName, int carNo, bool ai) //Constructor
+template <class T>
+GridCoord SparseGrid <T>::Coord(float x, float z) const //Grid square a position is in
 {
-	//Setup
-	dummy = dummyMesh->CreateModel();
-
-	car = carMesh->CreateModel();
-	car->Scale(kCarScale);
-	car->AttachToParent(dummy);
-
-	float y = kCarHoverHeight - kCarHoverRange + (rand() % 100) * 0.01f; //Get a random y position so that the cars move differently
-	if (rand() % 2 == 1) bobbleDir = down; //50% chance for the car to start off by bobbling down instead of up
-
-	dummy->SetPosition(startX, y, startZ);
-
-	//Particle
-	fire.push_back(FireEmitter(particleMesh, { startX, kCarHoverHeight + kBurnHeight, startZ }, kBurnRadius, kBurnVelRatio));
-	smoke.push_back(SmokeEmitter(particleMesh, { startX, kCarHoverHeight + kSmokeHeight, startZ }, kSmokeRadius));
-	exhaust.push_back(ExhaustEmitter(particleMesh, { startX, kCarHoverHeight + kExhaustHeight, startZ }, kExhaustRadius));
-
-	//Skin
-	if (ai) car->SetSkin(kSkinAI);
-	else car->SetSkin(kSkinPlayer);
-
-	//AI
-	isAI = ai;
-	goal = dummyMesh->CreateModel(startX, kCarHoverHeight, startZ);
-	path = paths;
-	if (pow(dummy->GetX() - path[0][0].x, 2) + pow(dummy->GetZ() - path[0][0].z, 2) < (pow(dummy->GetX() - path[1][0].x, 2) + pow(dummy->GetZ() - path[1][0].z, 2))) lane = 0;
-	else lane = 1;
-	nextWaypoint = dummyMesh->CreateModel(path[lane][0].x, kCarHoverHeight + kCarHoverHeight, path[lane][0].z);
+	return { GridIndex(x / squareSize), GridIndex(z / squareSize) };
+}
 
-	//Other
-	racePos = carNo + 1; //Set a race position that's different to the other cars' so that the comparison can work
-	name = carName; //Set a name
+template <class T>
+const T* SparseGrid <T>::Find(GridCoord c) const //Square at a coordinate, null if nothing was stored there
+{
+	if (slot.empty()) return nullptr;
+	size_t mask = slot.size() - 1;
+	for (size_t i = GridHash(c) & mask; ; i = (i + 1) & mask) //The table always has empty slots, so this ends
+	{
+		const GridSlot &s = slot[i];
+		if (s.index < 0) return nullptr;
+		if (s.coord.x == c.x && s.coord.z == c.z) return &square[s.index];
+	}
 }
 
-void HoverCar::Reset(float startX, float startZ) //Reset the car's variables and move it to a given starting position
+template <class T>
+T& SparseGrid <T>::Add(GridCoord c) //Square at a coordinate, stored empty first if it's new
 {
-	//Race
-	raceTime = 0;
-	nextCheck = 0;
-	lap = 1;
+	if ((square.size() + 1) * 2 > slot.size()) Rehash(max(size_t(16), slot.size() * 2));
 
-	//Position and rotation
-	float y = kCarHoverHeight - kCarHoverRange + (rand() % 100) * 0.01f; //Get a random y position so that the cars move differently
-	if (rand() % 2 == 1) bobbleDir = down; //50% chance for the car to start off by bobbling down instead of up
-	dummy->SetPosition(startX, y, startZ);
-	dummy->ResetOrientation();
-	car->ResetOrientation();
+	size_t mask = slot.size() - 1;
+	size_t i = GridHash(c) & mask;
+	for (; slot[i].index >= 0; i = (i + 1) & mask) if (slot[i].coord.x == c.x && slot[i].coord.z == c.z) return square[slot[i].index];
 
-	tilt = 0;
-	lean = 0;
+	slot[i] = { c, int(square.size()) };
+	coord.push_back(c);
+	square.push_back(T());
+	return square.back();
+}
 
-	//Speed
-	momentum = kZeroVector;
-	thrust = kZeroVector;
-	drag = kZeroVector;
-	thMult = 1.0f;
-	boostMult = 1.0f;
-	drMult = 1.0f;
+template <class T>
+void SparseGrid <T>::Rehash(size_t slots) //Rebuild the table with a new number of slots
+{
+	slot.assign(slots, { { 0, 0 }, -1 });
+	for (size_t j = 0; j < coord.size(); j++)
+	{
+		size_t i = GridHash(coord[j]) & (slots - 1);
+		while (slot[i].index >= 0) i = (i + 1) & (slots - 1);
+		slot[i] = { coord[j], int(j) };
+	}
+}
 
-	//Collision
-	prevPos = kZeroVector;
-	colIndexSphere = -1;
-	colIndexBox = -1;
-	colIndexCar = -1;
+//Random numbers
+RandomStream::RandomStream(unsigned int seed, RandomStreamKind kind, unsigned int index) //Stream number index of a kind, made from the race seed
+{
+	unsigned long long k = SplitMix(SplitMix(seed) ^ ((unsigned long long)kind << 32 | index));
+	key[0] = unsigned(k);
+	key[1] = unsigned(k >> 32);
+}
 
-	//Boost
-	boostTimer = kBoostTime;
-	boostLock = 0;
+unsigned int RandomStream::operator () () //Next 32 random bits
+{
+	unsigned int n = counter++;
+	return RandomMix(RandomMix(n * 0x9E3779B9u + key[0]) ^ key[1]); //Two streams that land on the same first hash are told apart again by the second half of the key
+}
 
-	//Health and status
-	hp = kMaxHP;
-	burnTimer = 0.0f;
-	burnDamageTimer = 0.0f;
-	explosionTimer = 0.0f;
+int RandomStream::Int() //Next number from 0 to 2^31 - 1, used in place of rand()
+{
+	return int((*this)() >> 1);
+}
 
-	//AI
-	currentGoal = 0;
-	goal->SetPosition(startX, kCarHoverHeight, startZ);
-	if (pow(dummy->GetX() - path[0][0].x, 2) + pow(dummy->GetZ() - path[0][0].z, 2) < (pow(dummy->GetX() - path[1][0].x, 2) + pow(dummy->GetZ() - path[1][0].z, 2))) lane = 0;
-	else lane = 1;
-	nextWaypoint->SetPosition(path[lane][0].x, kCarHoverHeight, path[lane][0].z);
+float RandomStream::Float() //Next number from 0 up to but not including 1
+{
+	return float((*this)() >> 8) * (1.0f / 16777216.0f); //24 bits, as many as a float holds exactly
 }
 
-void HoverCar::AIFollowPath() //Update AI orientation and speed, move the goal dummy and change waypoints when needed
+void RandomStream::Fill(float* out, int count) //Next count numbers exactly as Float would give them, four at a time with SSE
 {
-	if (hp > 0)
+	int i = 0;
+#ifdef RANDOM_SSE
+	//Each lane hashes its own counter, so the numbers come out the same as one at a time
+	__m128i n = _mm_add_epi32(_mm_set1_epi32(int(counter)), _mm_set_epi32(3, 2, 1, 0));
+	const __m128i four = _mm_set1_epi32(4);
+	const __m128i key0 = _mm_set1_epi32(int(key[0]));
+	const __m128i key1 = _mm_set1_epi32(int(key[1]));
+	const __m128 scale = _mm_set1_ps(1.0f / 16777216.0f);
+	for (; i + 4 <= count; i += 4)
 	{
-		//Rotation
-		dummy->LookAt(goal);
-		goal->LookAt(nextWaypoint);
+		__m128i x = _mm_add_epi32(MultiplyLow(n, 0x9E3779B9u), key0);
+		x = RandomMix(_mm_xor_si128(RandomMix(x), key1));
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), scale));
+		n = _mm_add_epi32(n, four);
+	}
+	counter += unsigned(i);
+#endif
+	for (; i < count; i++) out[i] = Float();
+}
 
-		Tilt(1);
+unsigned long long SplitMix(unsigned long long x) //Scramble 64 bits, turns a seed and a stream number into a key
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
 
-		//Speed
-		speedChangeCD -= fTime;
-		if (newThrust > boostMult) boostMult += kThrustChange * fTime; //Adjust thrust multiplier to match new thrust
-		else if (newThrust < boostMult) boostMult -= kThrustChange * fTime;
+unsigned int RandomMix(unsigned int x) //Scramble 32 bits so that every bit in changes about half of the bits out
+{
+	x ^= x >> 16;
+	x *= 0x21F0AAADu;
+	x ^= x >> 15;
+	x *= 0x735A2D97u;
+	return x ^ (x >> 15);
+}
 
-		thrust = fVector * kThrustFactor * thMult * boostMult * fTime; //Set thrust
+#ifdef RANDOM_SSE
+__m128i MultiplyLow(__m128i a, unsigned int b) //Low 32 bits of each lane times b, SSE2 only multiplies every other lane so it's done in two halves
+{
+	__m128i m = _mm_set1_epi32(int(b));
+	__m128i even = _mm_mul_epu32(a, m); //Lanes 0 and 2
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m); //Lanes 1 and 3
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
 
-		if (hp < 1) thrust = kZeroVector; //If dead don't move
-		else if (isAI && hp < kLowHP * kMaxHP) thrust = thrust * kLowHPPenalty; //If below 30% hp slow down considerably (only applies to non-player cars)
-		else if (hp < kLowHP * kMaxHP * 2) thrust = thrust * kMedHPPenalty; //If below 60% hp slow down a little
+__m128i RandomMix(__m128i x) //Same for four numbers at once
+{
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+	x = MultiplyLow(x, 0x21F0AAADu);
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+	x = MultiplyLow(x, 0x735A2D97u);
+	return _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+}
+#endif
 
-		thrust = thrust + thrust * kThrustBonus * (float)racePos; //Increase thrust if not first
+//Track
+BuilderSquare& TrackBuilder::Square(float x, float z) //Lists of the grid square a position is in
+{
+	return grid.Add(grid.Coord(x, z));
+}
 
-		//Follow goal
-		Vector2D v = path[lane][currentGoal];
-		float dist = sqrt(pow(dummy->GetX() - goal->GetX(), 2) + pow(dummy->GetZ() - goal->GetZ(), 2)); //Distance between car and goal
-		if (dist < 1.0f) dist = 1.0f;
+void TrackBuilder::AddObject(ObjectType type, float x, float z, float r) //Add an object to the instance table and its collision areas to the grid
+{
+	objects.push_back({ type, x, z, r });
 
-		if (dist < kMaxGoalDist) goal->MoveLocalZ((kGoalSpeed / dist) * fTime); //If car is close enough keep moving the goal dummy forward
-		if (pow(goal->GetX() - v.x, 2) + pow(goal->GetZ() - v.z, 2) <= kMaxGoalDist) AINextWaypoint(); //If goal dummy gets close to current waypoint switch to the next one
+	if (type == objCheckpoint && ++checkpoints == 1) for (int i = 0; i < kMaxCars; i++) //If it's the first checkpoint add start positions
+	{
+		if (r == 0) startPos.push_back({ x + kStartPositions[i], z + kStartPosDistance });
+		else if (r == 180) startPos.push_back({ x + kStartPositions[i], z - kStartPosDistance });
+		else if (r == 90) startPos.push_back({ x + kStartPosDistance, z + kStartPositions[i] });
+		else startPos.push_back({ x - kStartPosDistance, z + kStartPositions[i] });
 	}
-}
 
-void HoverCar::AINewSpeed(Speed speed) //Switch to a random speed in a slow or fast range
-{
-	if (speedChangeCD <= 0.0f) //If car hasn't changed passed a speed point recently
+	BuilderSquare &c = Square(x, z); //Grid square for the current object, scenery leaves it empty and it doesn't get baked
+
+	switch (type)
 	{
-		speedChangeCD = kSpeedChangeCD; //Reset cooldown
+	case objIsle:
+	case objIsle2:
+		if (r == 0 || r == 180) c.boxObstacle.push_back(BoundingBox(x, z, kIsleWid, kIsleLen));
+		else c.boxObstacle.push_back(BoundingBox(x, z, kIsleLen, kIsleWid));
+		break;
+	case objWall:
+		if (r == 0 || r == 180) c.boxObstacle.push_back(BoundingBox(x, z, kWallWid, kWallLen));
+		else c.boxObstacle.push_back(BoundingBox(x, z, kWallLen, kWallWid));
+		break;
+	case objCheckpoint:
+		if (r == 0 || r == 180)
+		{
+			c.sphereObstacle.push_back(BoundingSphere(x - kCheckpointLen + kCheckpointRad, z, kCheckpointRad));
+			c.sphereObstacle.push_back(BoundingSphere(x + kCheckpointLen - kCheckpointRad, z, kCheckpointRad));
+		}
+		else
+		{
+			c.sphereObstacle.push_back(BoundingSphere(x, z - kCheckpointLen + kCheckpointRad, kCheckpointRad));
+			c.sphereObstacle.push_back(BoundingSphere(x, z + kCheckpointLen - kCheckpointRad, kCheckpointRad));
+		}
+		break;
+	case objTank1:
+		c.sphereObstacle.push_back(BoundingSphere(x, z, kTankRad));
+		break;
+	case objTank2:
+		c.sphereObstacle.push_back(BoundingSphere(x, z, kTankRad));
+		AddTrigger(triggerFire, x, z, kTankFireRad + 0.1f);
+		break;
+	case objSkyscraper:
+	{
+		float adjustment; //Model has to be moved a little because its center is not in the mesh's origin
+		if (r == 0 || r == 90) adjustment = kSkyscraperAdjustment;
+		else adjustment = -kSkyscraperAdjustment;
 
-		bool change = rand() % 2; //50% chance of changing speed
-		if (change)
+		if (r == 0 || r == 180)
+		{
+			c.boxObstacle.push_back(BoundingBox(x, z + adjustment, kSkyscraperLength1, kSkyscraperWidth1));
+			c.boxObstacle.push_back(BoundingBox(x, z + adjustment, kSkyscraperLength2, kSkyscraperWidth2));
+		}
+		else
+		{
+			c.boxObstacle.push_back(BoundingBox(x + adjustment, z, kSkyscraperWidth1, kSkyscraperLength1));
+			c.boxObstacle.push_back(BoundingBox(x + adjustment, z, kSkyscraperWidth2, kSkyscraperLength2));
+		}
+		break;
+	}
+	case objSkyscraper2:
+		if (r == 0)
+		{
+			c.boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Length, kSkyscraper2Width));
+			c.sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Length - kSkyscraper2Radius, z + kSkyscraper2Radius, kSkyscraper2Radius));
+			c.sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Length - kSkyscraper2Radius, z - kSkyscraper2Radius, kSkyscraper2Radius));
+		}
+		else if (r == 180)
+		{
+			c.boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Length, kSkyscraper2Width));
+			c.sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Length + kSkyscraper2Radius, z + kSkyscraper2Radius, kSkyscraper2Radius));
+			c.sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Length + kSkyscraper2Radius, z - kSkyscraper2Radius, kSkyscraper2Radius));
+		}
+		else if (r == 90)
+		{
+			c.boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Width, kSkyscraper2Length));
+			c.sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Radius, z - kSkyscraper2Length + kSkyscraper2Radius, kSkyscraper2Radius));
+			c.sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Radius, z - kSkyscraper2Length + kSkyscraper2Radius, kSkyscraper2Radius));
+		}
+		else if (r == 270)
 		{
-			if (speed = slow) newThrust = kMidThrust - float(rand() % (int(100 * (kMidThrust - kMinThrust))) / 100.0f); //New speed between min and mid
-			else if (speed = fast) newThrust = kMidThrust + float(rand() % (int(100 * (kMinThrust - kMidThrust))) / 100.0f); //New speed between mid and max
+			c.boxObstacle.push_back(BoundingBox(x, z, kSkyscraper2Width, kSkyscraper2Length));
+			c.sphereObstacle.push_back(BoundingSphere(x + kSkyscraper2Radius, z + kSkyscraper2Length - kSkyscraper2Radius, kSkyscraper2Radius));
+			c.sphereObstacle.push_back(BoundingSphere(x - kSkyscraper2Radius, z + kSkyscraper2Length - kSkyscraper2Radius, kSkyscraper2Radius));
 		}
+		break;
+	case objBuilding:
+		c.boxObstacle.push_back(BoundingBox(x, z, kBuildingWidth, kBuildingWidth)); //Big box
+		for (int i = -1; i < 2; i += 2) for (int j = -1; j < 2; j += 2)
+			c.boxObstacle.push_back(BoundingBox(x + i * kBuildingWidth - i, z + j * kBuildingWidth - j, kBuildingWidh2, kBuildingWidh2)); //Small edge boxes
+		break;
+	case objTribune:
+		c.sphereObstacle.push_back(BoundingSphere(x, z, kTribuneRad));
+		break;
+	case objBomb: //Touching the small volume sets the bomb off, the big one is how far its explosion reaches, both carry the bomb's number
+		AddTrigger(triggerBomb, x, z, kBombRadius, bombs);
+		AddTrigger(triggerBlast, x, z, kExplosionRadius, bombs);
+		bombs++;
+		break;
+	default: //Scenery without collision
+		break;
 	}
 }
 
-void HoverCar::AINextWaypoint() //Switch to next waypoint on AI's path
+void TrackBuilder::AddTrigger(unsigned int type, float x, float z, float radius, int payload) //Add a trigger volume to the grid square its centre is in
 {
-	currentGoal++;
-	if (currentGoal >= path[lane].size()) currentGoal = 0;
+	Square(x, z).trigger.push_back({ BoundingSphere(x, z, radius), type, payload });
+}
 
-	Vector2D v = path[lane][currentGoal];
-	nextWaypoint->SetPosition(v.x, kCarHoverHeight, v.z);
+void TrackBuilder::AddWaypoint(int lane, float x, float z) //Add a waypoint to the end of a lane, making the lane if it's new
+{
+	if (lane < 0 || lane >= kMaxLanes) return;
+	if (lane >= int(path.size())) path.resize(lane + 1);
+	path[lane].push_back({ x, z });
 }
 
-void HoverCar::AISwitchLane() //Switch to a different lane
+bool TrackBuilder::ValidLanes() //Check that no lane is left without waypoints and that links point at real waypoints
 {
-	if (isAI)
+	if (path.empty()) return false;
+	for (size_t i = 0; i < path.size(); i++) if (path[i].empty()) return false;
+	for (size_t i = 0; i < links.size(); i++)
 	{
-		//Change lane
-		if (lane == 0) lane = 1;
-		else lane = 0;
-
-		//Make sure the right goal is being followed
-		currentGoal--;
-		AINextWaypoint();
+		const TrackLink &l = links[i];
+		if (l.laneA >= path.size() || l.laneB >= path.size() || l.laneA == l.laneB || l.waypointA >= path[l.laneA].size() || l.waypointB >= path[l.laneB].size()) return false;
 	}
+	return true;
 }
 
-void HoverCar::ComparePosition(HoverCar *car2, IModel* &checkpoint) //Compare position in the race with another racer
+void TrackBuilder::AddWorldEdges() //Add world edges as box obstacles
 {
-	bool updatePos;
-	if (racePos > (*car2).racePos)
+	//The edges are where the terrain ends, or a square past the furthest objects if the level doesn't fit on the terrain
+	Vector2D low = { -kWorldLen, -kWorldLen };
+	Vector2D high = { kWorldLen, kWorldLen };
+	bool fits = true;
+	for (size_t i = 0; i < objects.size(); i++) fits = fits && fabs(objects[i].x) < kWorldLen && fabs(objects[i].z) < kWorldLen;
+	if (!fits)
+	{
+		low = high = { objects[0].x, objects[0].z };
+		for (size_t i = 1; i < objects.size(); i++)
+		{
+			low = { min(low.x, objects[i].x), min(low.z, objects[i].z) };
+			high = { max(high.x, objects[i].x), max(high.z, objects[i].z) };
+		}
+		low = { low.x - grid.squareSize, low.z - grid.squareSize };
+		high = { high.x + grid.squareSize, high.z + grid.squareSize };
+	}
+
+	//Each square along an edge gets the piece of it that crosses the square
+	float half = grid.squareSize / 2;
+	for (int i = grid.Coord(low.x, 0).x; i <= grid.Coord(high.x, 0).x; i++)
+	{
+		float middle = (i + 0.5f) * grid.squareSize;
+		Square(middle, low.z).boxObstacle.push_back(BoundingBox(middle, low.z, half, 0));
+		Square(middle, high.z).boxObstacle.push_back(BoundingBox(middle, high.z, half, 0));
+	}
+	for (int i = grid.Coord(0, low.z).z; i <= grid.Coord(0, high.z).z; i++)
 	{
-		//Compare laps
-		if (lap > (*car2).lap) updatePos = 1;
-		else if (lap < (*car2).lap) updatePos = 0;
+		float middle = (i + 0.5f) * grid.squareSize;
+		Square(low.x, middle).boxObstacle.push_back(BoundingBox(low.x, middle, 0, half));
+		Square(high.x, middle).boxObstacle.push_back(BoundingBox(high.x, middle, 0, half));
+	}
+}
 
-		//Compare checkpoints
-		else if ((nextCheck == 0 && (*car2).nextCheck != 0) || (nextCheck != 0 && nextCheck > (*car2).nextCheck)) updatePos = 1;
-		else if ((nextCheck != 0 && (*car2).nextCheck == 0) || ((*car2).nextCheck != 0 && nextCheck < (*car2).nextCheck)) updatePos = 0;
+bool ParseLevel(string levelFile, TrackBuilder &builder) //Read objects, waypoints and speed points from the level file
+{
+	ifstream lFile;
+	lFile.open(levelFile);
+	if (!lFile.is_open()) return false;
 
-		//Compare distance to next checpoint
-		else
+	string type;
+	float x;
+	float z;
+	float r;
+
+	while (lFile >> type >> x >> z >> r) //Get "words" from file and put them in temporary variables
+	{
+		if (type == "Waypoint") builder.AddWaypoint(0, x, z); //The first two lanes have their own types
+		else if (type == "Waypoint2") builder.AddWaypoint(1, x, z);
+		else if (type == "Lane") //Waypoint of any lane, the last value is the lane
+		{
+			if (!(r >= 0.0f && r < kMaxLanes)) //Checked as a float, turning one too big for an int into an int is undefined
+			{
+				cout << "Lane " << r << " at " << x << " " << z << " is out of range, a level can have lanes 0 to " << kMaxLanes - 1 << endl;
+				return false;
+			}
+			builder.AddWaypoint(int(r), x, z);
+		}
+		else if (type == "Link") //Lanes and waypoints instead of a position, with one more value for the second waypoint
+		{
+			float w;
+			if (!(lFile >> w)) break;
+			if (!(x >= 0.0f && x < kMaxLanes && r >= 0.0f && r < kMaxLanes && z >= 0.0f && z < 4294967296.0f && w >= 0.0f && w < 4294967296.0f))
+			{
+				cout << "Link " << x << " " << z << " " << r << " " << w << " is out of range, lanes go from 0 to " << kMaxLanes - 1 << " and waypoints can't be negative" << endl;
+				return false;
+			}
+			builder.links.push_back({ (unsigned int)x, (unsigned int)z, (unsigned int)r, (unsigned int)w });
+		}
+		else if (type == "GridSize") //Has to come before anything is put in the grid
 		{
-			float dist = pow((checkpoint->GetX() - dummy->GetX()), 2) + pow((checkpoint->GetZ() - dummy->GetZ()), 2);
-			float dist2 = pow((checkpoint->GetX() - (*car2).dummy->GetX()), 2) + pow((checkpoint->GetZ() - (*car2).dummy->GetZ()), 2);
-			if (dist < dist2) updatePos = 1;
-			else updatePos = 0;
+			if (builder.grid.size() == 0 && x >= kMinGridSize) builder.grid.squareSize = x;
+			else cout << "GridSize " << x << " ignored, it has to be at least " << kMinGridSize << " and come before the objects" << endl;
 		}
-
-		//Update position of each car
-		if (updatePos)
+		else if (type == "Trigger") //Volume of several kinds at once, with one more value for the TriggerType bits
+		{
+			unsigned int bits;
+			if (!(lFile >> bits)) break;
+			bits &= triggerFire | triggerSlow | triggerFast; //Bomb volumes need a bomb to point at, so they only come from bomb objects
+			if (bits != 0 && r > 0) builder.AddTrigger(bits, x, z, r);
+			else cout << "Trigger at " << x << " " << z << " ignored, it needs a radius and fire (1), slow (2) or fast (4) bits" << endl;
+		}
+		else
 		{
-			int temp = racePos;
-			racePos = (*car2).racePos;
-			(*car2).racePos = temp;
+			bool trigger = false;
+			for (int i = 0; i < kLevelTriggers; i++) if (type == kTriggerNames[i])
+			{
+				builder.AddTrigger(kTriggerTypes[i], x, z, r > 0 ? r : kTriggerRadius[i]);
+				trigger = true;
+				break;
+			}
+			if (!trigger) for (int i = 0; i < objTypes; i++) if (type == kObjectNames[i])
+			{
+				builder.AddObject(ObjectType(i), x, z, r);
+				break;
+			}
 		}
 	}
-}
+	lFile.close();
 
-void HoverCar::UpdateTime() //Update race time
-{
-	raceTime += fTime;
+	builder.AddWorldEdges();
+	return builder.ValidLanes();
 }
 
-void HoverCar::UpdateDamage() //Damage related updates
+template <class T>
+TrackRange AppendRange(vector <T> &to, vector <T> &from) //Add a grid square's list to the end of a flat array
 {
-	colDamage = int(floor(pow(sqrt(momentum.Length()) * kDamageFactor, 2))); //The faster the car is going the more damage it takes from collisions
-	if (explosionTimer > 0) explosionTimer -= fTime;
+	TrackRange range = { (unsigned int)to.size(), (unsigned int)from.size() };
+	to.insert(to.end(), from.begin(), from.end());
+	return range;
 }
 
-void HoverCar::UpdateParticles(ICamera* *camera) //Update fire, smoke and exhaust fire particles coming from the car
+TrackRange AppendBoxes(vector <float> (&edges)[4], vector <BoundingBox> &from) //Add a grid square's boxes to the edge arrays, padded to a full block
 {
-	//Fire
-	if (burnTimer > 0.0f) Burn(camera); //If car is burning show fire and take damage
-	else fire[0].Update(fTime, camera, 0); //If it's not burning then just update the particles already spawned
-
-	//Smoke
-	if (hp < kLowHP * kMaxHP)
+	TrackRange range = { (unsigned int)edges[0].size(), (unsigned int)from.size() };
+	for (size_t i = 0; i < from.size(); i++)
 	{
-		smoke[0].UpdateOrigin(Vector3D{ car->GetX() + fVector.x * kSmokeZPos, car->GetY() + kSmokeHeight, car->GetZ() + fVector.z * kSmokeZPos });
-		smoke[0].Update(fTime, camera, 1, -momentum); //Emit smoke if hp is low
+		edges[0].push_back(from[i].xStart);
+		edges[1].push_back(from[i].xEnd);
+		edges[2].push_back(from[i].zStart);
+		edges[3].push_back(from[i].zEnd);
 	}
-	else smoke[0].Update(fTime, camera, 0, momentum * kSmokeMomentumMult); //Let smoke die off
-
-	//Exhaust
-	if (momentum.Length() > kExhaustMinSpeed && boostMult > kExhaustMinBoost)
+	while (edges[0].size() % kObstacleBlock != 0) //Boxes that start after they end can't be overlapped
 	{
-		exhaust[0].UpdateOrigin(Vector3D{ car->GetX() + fVector.x * kExhaustZPos, car->GetY() + kExhaustHeight, car->GetZ() + fVector.z * kExhaustZPos });
-		exhaust[0].Update(fTime, camera, 1, -momentum);
+		edges[0].push_back(kNoObstacle);
+		edges[1].push_back(-kNoObstacle);
+		edges[2].push_back(kNoObstacle);
+		edges[3].push_back(-kNoObstacle);
 	}
-	else exhaust[0].Update(fTime, camera, 0, -momentum);
+	return range;
 }
 
-void HoverCar::Controls(I3DEngine* e) //Take keyboard input and react accordingly
+TrackRange AppendSpheres(vector <float> (&coords)[3], vector <unsigned int> &types, vector <int> &payloads, vector <BoundingSphere> &from) //Add a grid square's spheres to the coordinate arrays as obstacles, padded to a full block
 {
-	//Movement
-	if (e->KeyHeld(kKeyCarForward))
-	{
-		thrust = fVector * kThrustFactor * thMult * boostMult * fTime; //Update thrust
-		Tilt(1); //Tilt the car forward
-	}
-	else if (e->KeyHeld(kKeyCarBackward))
+	TrackRange range = { (unsigned int)coords[0].size(), (unsigned int)from.size() };
+	for (size_t i = 0; i < from.size(); i++)
 	{
-		thrust = fVector * (-kThrustFactor / 2) * thMult * boostMult * fTime; //Update thrust
-		Tilt(-1); //Tilt the car back
+		coords[0].push_back(from[i].x);
+		coords[1].push_back(from[i].z);
+		coords[2].push_back(from[i].r);
 	}
-	else
+	while (coords[0].size() % kObstacleBlock != 0) //Spheres too far away to reach
 	{
-		thrust = kZeroVector; //Reset thrust
+		coords[0].push_back(kNoObstacle);
+		coords[1].push_back(kNoObstacle);
+		coords[2].push_back(0.0f);
 	}
+	types.resize(coords[0].size(), 0);
+	payloads.resize(coords[0].size(), 0);
+	return range;
+}
 
-	//Steering
-	if (e->KeyHeld(kKeyCarLeft))
-	{
-		dummy->RotateLocalY(-kCarRotation * fTime);
-		Lean(1);
-	}
-	else if (e->KeyHeld(kKeyCarRight))
+TrackRange AppendTriggers(vector <float> (&coords)[3], vector <unsigned int> &types, vector <int> &payloads, vector <TriggerVolume> &from) //Same for trigger volumes, keeping their type bits and payloads alongside
+{
+	vector <BoundingSphere> spheres;
+	for (size_t i = 0; i < from.size(); i++) spheres.push_back(from[i].sphere);
+
+	TrackRange range = AppendSpheres(coords, types, payloads, spheres);
+	for (size_t i = 0; i < from.size(); i++)
 	{
-		dummy->RotateLocalY(kCarRotation * fTime);
-		Lean(-1);
+		types[range.first + i] = from[i].type;
+		payloads[range.first + i] = from[i].payload;
 	}
+	return range;
+}
 
-	//Boost
-	Boost(e);
+unsigned int PaddedCount(unsigned int count) //Number of obstacles a list takes up in the image including its padding
+{
+	return (count + kObstacleBlock - 1) / kObstacleBlock * kObstacleBlock;
 }
 
-void HoverCar::TakeDamage(int damage) //Subtract damage and disable thrust if hp goes too low
+template <class T>
+TrackSection AppendSection(vector <char> &image, vector <T> &data) //Copy an array to the end of the image
 {
-	hp -= damage;
-	if (hp <= 0) thMult = 0.0f;
+	image.resize((image.size() + kTrackAlignment - 1) / kTrackAlignment * kTrackAlignment, 0);
+	TrackSection section = { (unsigned int)image.size(), (unsigned int)data.size() };
+	if (data.size() > 0) image.insert(image.end(), (const char*)&data[0], (const char*)&data[0] + data.size() * sizeof(T));
+	return section;
 }
 
-void HoverCar::ResetCollision() //Return to normal speed and enable collisions when the car slows down enough
+void BakeTrack(TrackBuilder &builder, vector <char> &image) //Lay out the level data as a track image
 {
-	if (thMult == 0.01f && momentum < kSlow)
+	//Flatten the grid square lists into one array per box edge and sphere coordinate, leaving out the squares that ended up empty
+	vector <TrackCell> cells;
+	vector <float> boxes[4];
+	vector <float> spheres[3];
+	vector <unsigned int> sphereTypes; //Trigger bits and payload of every sphere, 0 for obstacles
+	vector <int> spherePayloads;
+
+	for (size_t i = 0; i < builder.grid.size(); i++)
 	{
-		thMult = 1.0f; //If momentum becomes low after thrust got locked enable it again
-		colIndexSphere = -1; //Reset collision index so the recent sphere can be collided with again
-		colIndexBox = -1; //Reset collision index so the recent box can be collided with again
-		colIndexCar = -1; //Reset collision index so the recent car can be collided with again
+		BuilderSquare &square = builder.grid.square[i];
+		if (square.boxObstacle.empty() && square.sphereObstacle.empty() && square.trigger.empty()) continue;
+
+		TrackCell cell;
+		cell.coord = builder.grid.coord[i];
+		cell.box = AppendBoxes(boxes, square.boxObstacle);
+		cell.sphere = AppendSpheres(spheres, sphereTypes, spherePayloads, square.sphereObstacle);
+		cell.trigger = AppendTriggers(spheres, sphereTypes, spherePayloads, square.trigger);
+		cells.push_back(cell);
 	}
+
+	//Same for the lanes
+	vector <TrackRange> lanes;
+	vector <Vector2D> waypoints;
+	for (size_t i = 0; i < builder.path.size(); i++) lanes.push_back(AppendRange(waypoints, builder.path[i]));
+
+	//Write the sections after the header
+	TrackHeader header = {};
+	image.assign(sizeof(TrackHeader), 0);
+
+	header.objects = AppendSection(image, builder.objects);
+	header.cells = AppendSection(image, cells);
+	header.boxXStart = AppendSection(image, boxes[0]);
+	header.boxXEnd = AppendSection(image, boxes[1]);
+	header.boxZStart = AppendSection(image, boxes[2]);
+	header.boxZEnd = AppendSection(image, boxes[3]);
+	header.sphereX = AppendSection(image, spheres[0]);
+	header.sphereZ = AppendSection(image, spheres[1]);
+	header.sphereR = AppendSection(image, spheres[2]);
+	header.sphereType = AppendSection(image, sphereTypes);
+	header.spherePayload = AppendSection(image, spherePayloads);
+	header.lanes = AppendSection(image, lanes);
+	header.waypoints = AppendSection(image, waypoints);
+	header.startPos = AppendSection(image, builder.startPos);
+	header.links = AppendSection(image, builder.links);
+
+	header.magic = kTrackMagic;
+	header.version = kTrackVersion;
+	header.gridSize = builder.grid.squareSize;
+	header.size = (unsigned int)image.size();
+	memcpy(&image[0], &header, sizeof(TrackHeader));
 }
 
-void HoverCar::SphereCollision(int index) //Collision with a sphere shaped obstacle
+bool SectionFits(TrackSection s, size_t elementSize, size_t size) //Check that a section doesn't go past the end of the image
 {
-	if (index != colIndexSphere) //If it's not the object that already got collided with (prevents getting stuck in objects)
-	{
-		//Reset position to before collision occured
-		dummy->SetX(prevPos.x);
-		dummy->SetZ(prevPos.z);
+	return s.offset <= size && s.count <= (size - s.offset) / elementSize;
+}
 
-		//Temporarily lower thrust and ignore object just collided with
-		momentum = momentum * -1.0f; //Reverse momentum for a bounce back effect
-		thMult = 0.01f; //Lower thrust
-		colIndexSphere = index; //Record index of the object collided with
-		colIndexBox = -1; //Reset box index in case of a bounceback
+bool RangeFits(TrackRange r, TrackSection s) //Check that a range stays within its section
+{
+	return r.first <= s.count && r.count <= s.count - r.first;
+}
 
-		//Damage car
-		TakeDamage(colDamage);
-	}
+bool ObstacleRangeFits(TrackRange r, TrackSection s) //Check that an obstacle list starts on a block and stays within its arrays with its padding
+{
+	return r.first % kObstacleBlock == 0 && RangeFits({ r.first, PaddedCount(r.count) }, s);
 }
 
-void HoverCar::BoxCollision(int index, ColAxis a) //Collision with a box shaped obstacle
+bool ValidTrack(const char* image, size_t size) //Check that an image is complete and was made for this version of the game
 {
-	if (index != colIndexBox) //If it's not the object that already got collided with (prevents getting stuck in objects)
-	{
-		//Reset position to before collision occured
-		dummy->SetX(prevPos.x);
-		dummy->SetZ(prevPos.z);
+	if (size < sizeof(TrackHeader)) return false;
 
-		//Momentum change
-		if (a == colX) momentum.x = momentum.x * -1; //If collided on Z axis reverse momentum on the Z axis
-		else if (a == colZ) momentum.z = momentum.z * -1; //If collided on X reverse on X
-		else momentum = momentum * -1; //If collided on both reverse completely
+	const TrackHeader* h = (const TrackHeader*)image;
+	if (h->magic != kTrackMagic || h->version != kTrackVersion || !(h->gridSize >= kMinGridSize) || h->size != size) return false;
 
-		//Temporarily lower thrust and ignore object just collided with
-		thMult = 0.01f; //Lower thrust
-		colIndexBox = index; //Record index of the object collided with
-		colIndexSphere = -1; //Reset sphere index in case of a bounceback
+	if (!SectionFits(h->objects, sizeof(ObjectInstance), size) || !SectionFits(h->cells, sizeof(TrackCell), size) || !SectionFits(h->lanes, sizeof(TrackRange), size) ||
+		!SectionFits(h->waypoints, sizeof(Vector2D), size) || !SectionFits(h->startPos, sizeof(Vector2D), size) || !SectionFits(h->links, sizeof(TrackLink), size)) return false;
 
-		//Damage car
-		TakeDamage(colDamage);
+	//All arrays of a shape hold the same number of floats
+	if (!SectionFits(h->boxXStart, sizeof(float), size) || !SectionFits(h->boxXEnd, sizeof(float), size) || !SectionFits(h->boxZStart, sizeof(float), size) ||
+		!SectionFits(h->boxZEnd, sizeof(float), size) || !SectionFits(h->sphereX, sizeof(float), size) || !SectionFits(h->sphereZ, sizeof(float), size) ||
+		!SectionFits(h->sphereR, sizeof(float), size) || !SectionFits(h->sphereType, sizeof(unsigned int), size) || !SectionFits(h->spherePayload, sizeof(int), size)) return false;
+	if (h->boxXEnd.count != h->boxXStart.count || h->boxZStart.count != h->boxXStart.count || h->boxZEnd.count != h->boxXStart.count ||
+		h->sphereZ.count != h->sphereX.count || h->sphereR.count != h->sphereX.count || h->sphereType.count != h->sphereX.count || h->spherePayload.count != h->sphereX.count) return false;
+
+	if (h->lanes.count == 0 || h->startPos.count < kMaxCars) return false;
+
+	//Ranges have to point inside their arrays
+	const TrackCell* cells = (const TrackCell*)(image + h->cells.offset);
+	for (unsigned int i = 0; i < h->cells.count; i++)
+	{
+		if (abs(cells[i].coord.x) > kMaxGridCoord || abs(cells[i].coord.z) > kMaxGridCoord) return false;
+		if (!ObstacleRangeFits(cells[i].box, h->boxXStart) || !ObstacleRangeFits(cells[i].sphere, h->sphereX) || !ObstacleRangeFits(cells[i].trigger, h->sphereX)) return false;
 	}
-	else if (isAI)
+
+	//Bomb volumes have to point at a bomb, the race looks their payload up without checking
+	int bombs = 0;
+	const ObjectInstance* objects = (const ObjectInstance*)(image + h->objects.offset);
+	for (unsigned int i = 0; i < h->objects.count; i++) if (objects[i].type == objBomb) bombs++;
+
+	const unsigned int* types = (const unsigned int*)(image + h->sphereType.offset);
+	const int* payloads = (const int*)(image + h->spherePayload.offset);
+	for (unsigned int i = 0; i < h->sphereType.count; i++) if ((types[i] & (triggerBomb | triggerBlast)) && (payloads[i] < 0 || payloads[i] >= bombs)) return false;
+
+	const TrackRange* lanes = (const TrackRange*)(image + h->lanes.offset);
+	for (unsigned int i = 0; i < h->lanes.count; i++) if (!RangeFits(lanes[i], h->waypoints) || lanes[i].count == 0) return false;
+
+	const TrackLink* links = (const TrackLink*)(image + h->links.offset);
+	for (unsigned int i = 0; i < h->links.count; i++)
 	{
-		momentum = momentum * 2.0f; //Prevents AI cars from getting stuck
+		if (links[i].laneA >= h->lanes.count || links[i].laneB >= h->lanes.count || links[i].laneA == links[i].laneB ||
+			links[i].waypointA >= lanes[links[i].laneA].count || links[i].waypointB >= lanes[links[i].laneB].count) return false;
 	}
+
+	return true;
+}
+
+bool SaveTrack(string trackFile, vector <char> &image) //Write an image to a file
+{
+	ofstream tFile(trackFile, ios::binary);
+	if (!tFile.is_open()) return false;
+
+	tFile.write(&image[0], image.size());
+	return tFile.good();
 }
 
-bool HoverCar::CarCollision(HoverCar *car2, int index) //Collision with another car
+bool MapTrack(string trackFile, Track &track) //Map a compiled track file into memory, fails if it's missing or outdated
 {
-	Vector2D dist = { (dummy->GetX() - (*car2).dummy->GetX()), (dummy->GetZ() - (*car2).dummy->GetZ()) };
-	if (pow(dist.x, 2) + pow(dist.z, 2) - pow(r, 2) * kCarColRadiusMult < 0) //If cars overlap
+	const char* view;
+	size_t size;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(trackFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
 	{
-		//Reset position to before collision occured
-		dummy->SetX(prevPos.x);
-		dummy->SetZ(prevPos.z);
-		(*car2).dummy->SetX((*car2).prevPos.x);
-		(*car2).dummy->SetZ((*car2).prevPos.z);
+		CloseHandle(file);
+		return false;
+	}
+	size = size_t(fileSize.QuadPart);
 
-		//Change momentums of the collided cars to make them bounce off a little
-		dist = dist.Normal() * kCarColImpact; //Increased for a stronger bounce
-		float change = (dummy->GetX() * dist.x + dummy->GetZ() * dist.z) - ((*car2).dummy->GetX() * dist.x + (*car2).dummy->GetZ() * dist.z);
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file); //The mapping keeps the file open
+	if (mapping == NULL) return false;
 
-		momentum = { change * dist.x, change * dist.z };
-		(*car2).momentum = -momentum;
+	view = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping); //The view keeps the mapping alive
+	if (view == NULL) return false;
+#else
+	int file = open(trackFile.c_str(), O_RDONLY);
+	if (file < 0) return false;
 
-		//Temporarily lower thrust and ignore the car collided with
-		thMult = 0.01f;
-		colIndexCar = index;
-		colIndexSphere = -1;
-		colIndexBox = -1;
+	struct stat fileInfo;
+	if (fstat(file, &fileInfo) != 0 || fileInfo.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+	size = size_t(fileInfo.st_size);
 
-		//Damage cars (Damage is lowered because cars are lighter than immobile objects)
-		int damage = (colDamage + (*car2).colDamage) / 3;
-		TakeDamage(damage);
-		(*car2).TakeDamage(damage);
+	void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file); //The mapping keeps the file open
+	if (address == MAP_FAILED) return false;
+	view = (const char*)address;
+#endif
 
-		//If either or both cars are burning, combine their burn times and share the result between the cars
-		float newBurnTime = burnTimer + (*car2).burnTimer;
-		burnTimer = newBurnTime;
-		(*car2).burnTimer = newBurnTime;
+	track.image = view;
+	track.size = size;
+	track.mapped = true;
 
-		//Change lane of the car behind to stop bumping into the other one's back
-		if (lane == (*car2).lane)
-		{
-			if (racePos > (*car2).racePos) AISwitchLane();
-			else (*car2).AISwitchLane();
-		}
-		return true;
+	if (!ValidTrack(view, size))
+	{
+		UnloadTrack(track);
+		return false;
 	}
-	else return false;
+	return true;
 }
 
-void HoverCar::Burn(ICamera* *camera) //Emit fire particles and take damage
+bool CompileTrack(string levelFile, Track &track) //Parse and bake the level file in memory
 {
-	//Fire particles
-	fire[0].UpdateOrigin(Vector3D{ car->GetX(), car->GetY() + kBurnHeight, car->GetZ() });
-	fire[0].Update(fTime, camera, 1, -momentum);
+	TrackBuilder builder;
+	if (!ParseLevel(levelFile, builder)) return false;
 
-	//Timers
-	if (momentum.Length() > kBurnExtinguishSpeed) burnTimer -= fTime;
-	else burnTimer -= fTime * kBurnExtinguisMult;
+	BakeTrack(builder, track.buffer);
+	track.image = &track.buffer[0];
+	track.size = track.buffer.size();
+	track.mapped = false;
 
-	burnDamageTimer += fTime;
+	return ValidTrack(track.image, track.size);
+}
 
-	//Damage
-	if (burnDamageTimer > kBurnDamageInterval)
+void UnloadTrack(Track &track) //Unmap or free the image
+{
+	if (track.mapped)
 	{
-		TakeDamage(kBurnDamage);
-		burnDamageTimer = 0.0f;
+#ifdef _WIN32
+		UnmapViewOfFile(track.image);
+#else
+		munmap((void*)track.image, track.size);
+#endif
 	}
+	else track.buffer.clear();
 
-	//Burning stops
-	if (burnTimer < 0.0f)
-	{
-		burnDamageTimer = 0.0f; //Next time the car starts burning the interval will start over
-	}
+	track.image = nullptr;
+	track.size = 0;
+	track.mapped = false;
 }
 
-void HoverCar::Explosion(IModel* *bomb) //Push the car away from bomb and take damage
+BoxList TrackBoxes(Track &track, TrackRange r, const vector <int> &ids) //View of a grid square's boxes in the image
 {
-	if (explosionTimer <= 0.0f)
-	{
-		Vector2D dist = { (dummy->GetX() - (*bomb)->GetX()), (dummy->GetZ() - (*bomb)->GetZ()) };
+	const TrackHeader* h = track.Header();
+	BoxList list;
+	list.xStart = track.Section <float>(h->boxXStart, r).data;
+	list.xEnd = track.Section <float>(h->boxXEnd, r).data;
+	list.zStart = track.Section <float>(h->boxZStart, r).data;
+	list.zEnd = track.Section <float>(h->boxZEnd, r).data;
+	list.id = ids.data() + r.first;
+	list.count = r.count;
+	return list;
+}
 
-		//Make sure the pushback isn't too strong or too weak
-		float len = dist.Length();
-		if (len < kBombMinDist) len = kBombMinDist;
-		else if (len > kBombMaxDist) len = kBombMaxDist;
+SphereList TrackSpheres(Track &track, TrackRange r, const vector <int> &ids) //View of a grid square's spheres in the image
+{
+	const TrackHeader* h = track.Header();
+	SphereList list;
+	list.x = track.Section <float>(h->sphereX, r).data;
+	list.z = track.Section <float>(h->sphereZ, r).data;
+	list.r = track.Section <float>(h->sphereR, r).data;
+	list.id = ids.data() + r.first;
+	list.count = r.count;
+	return list;
+}
 
-		dist = dist.Normal() * (kBombImpact / len); //Being closer to the bomb makes pushback stronger
-		momentum = momentum - dist;
+void SetupGrid(Track &track, SparseGrid <GridSquare> &grid, const vector <int> &ids) //Point each grid square at its obstacles in the image, numbering them by where they are in it
+{
+	const TrackHeader* h = track.Header();
+	TrackList <TrackCell> cells = track.Section <TrackCell>(h->cells);
 
-		TakeDamage(int(kBombDamage / len)); //Take more damage when close to bomb
+	grid = SparseGrid <GridSquare>();
+	grid.squareSize = h->gridSize;
+	size_t slots = 16;
+	while (slots < cells.size() * 2) slots *= 2;
+	grid.Rehash(slots); //Size the table once instead of growing it square by square
 
-		explosionTimer = kExplosionCooldown;
+	for (size_t i = 0; i < cells.size(); i++)
+	{
+		const TrackCell &c = cells[i];
+		GridSquare &square = grid.Add(c.coord);
+		square.boxObstacle = TrackBoxes(track, c.box, ids);
+		square.sphereObstacle = TrackSpheres(track, c.sphere, ids);
+		square.trigger = TrackSpheres(track, c.trigger, ids);
 	}
 }
 
-void HoverCar::Move() //Move the car according to its momentum
+shared_ptr <const TrackData> ShareTrack(Track &track) //Move a loaded track into shared data and unpack its grid, checkpoints, lanes and start grid
 {
-	if (hp <= 0) thrust = kZeroVector; //Disable acceleration if dead
-	drag = momentum * kDragCoefficient * drMult * fTime; //Calculate drag
-	momentum = momentum + thrust + drag; //New momentum
-	prevPos = { dummy->GetX(), dummy->GetZ() }; //Save previous postion
-	dummy->Move(momentum.x * fTime, 0.0f, momentum.z * fTime); //Move dummy according to new momentum
-}
+	shared_ptr <TrackData> data = make_shared <TrackData>();
+
+	//Take over the image, the buffer keeps its memory when it's swapped so the pointer into it stays valid
+	data->image.buffer.swap(track.buffer);
+	data->image.image = track.image;
+	data->image.size = track.size;
+	data->image.mapped = track.mapped;
+	track = Track();
+
+	Track &image = data->image;
+	const TrackHeader* header = image.Header();
+	data->hash = Hash(image.image, image.size);
+	data->obstacleId.resize(max(header->boxXStart.count, header->sphereX.count));
+	for (size_t i = 0; i < data->obstacleId.size(); i++) data->obstacleId[i] = int(i);
+	SetupGrid(image, data->grid, data->obstacleId);
+	BakeNeighbourhoods(*data);
+	data->triggerType = image.Section <unsigned int>(header->sphereType);
+	data->triggerPayload = image.Section <int>(header->spherePayload);
+
+	data->objects = image.Section <ObjectInstance>(header->objects);
+	for (size_t i = 0; i < data->objects.size(); i++) if (data->objects[i].type == objCheckpoint) data->checkpoint.push_back(data->objects[i]);
+
+	for (unsigned int i = 0; i < header->lanes.count; i++)
+	{
+		TrackList <Vector2D> lane = image.Section <Vector2D>(header->waypoints, image.Section <TrackRange>(header->lanes)[i]);
+		data->path.push_back(vector <Vector2D>(lane.data, lane.data + lane.size()));
+		data->lane.push_back(LaneSpline());
+		data->lane.back().Build(data->path.back());
+	}
+	MapLanes(*data, image.Section <TrackLink>(header->links));
 
-void HoverCar::Rotate() //Update car's orientation based on lean and tilt values
-{
-	lean -= lean * kTiltDrag * fTime;
-	tilt -= tilt * kTiltDrag * fTime;
+	TrackList <Vector2D> startList = image.Section <Vector2D>(header->startPos);
+	data->startPos.assign(startList.data, startList.data + startList.size());
 
-	car->ResetOrientation();
-	car->RotateLocalX(tilt);
-	car->RotateLocalZ(lean);
+	return data;
 }
 
-void HoverCar::Bobble() //Move the car up and down
+shared_ptr <const TrackData> LoadTrackData(string levelFile, string trackFile, bool &mapped) //Map the compiled track if it's up to date, otherwise compile the level file, null if neither can be read
 {
-	if (car->GetY() > kCarHoverHeight + kCarHoverRange) bobbleDir = down; //If highest height reached change direction to down
-	else if (car->GetY() < kCarHoverHeight - kCarHoverRange) bobbleDir = up; //If lowest change to up
-	car->MoveY(kCarHoverSpeed * bobbleDir * fTime); //Move up or down depending on direction
+	Track track;
+	mapped = !FileNewer(levelFile, trackFile) && MapTrack(trackFile, track);
+	if (!mapped && !CompileTrack(levelFile, track)) return nullptr;
+	return ShareTrack(track);
 }
 
-void HoverCar::Tilt(float dir) //Update the tilt value, takes a direction multiplier of 1 or -1
+void LaneSpline::Build(const vector <Vector2D> &waypoints) //Sample the curve and measure it
 {
-	float change = kCarTiltFactor * dir * fTime; //Change in car's local X angle
+	int n = int(waypoints.size());
+	point.clear();
+	distance.clear();
+	for (int i = 0; i < n; i++)
+	{
+		//Each segment goes from p1 to p2, shaped by the waypoints on either side of it
+		Vector2D p0 = waypoints[(i + n - 1) % n];
+		Vector2D p1 = waypoints[i];
+		Vector2D p2 = waypoints[(i + 1) % n];
+		Vector2D p3 = waypoints[(i + 2) % n];
+		for (int j = 0; j < kSteps; j++)
+		{
+			float t = float(j) / kSteps;
+			float t2 = t * t;
+			float t3 = t2 * t;
+			point.push_back((p1 * 2.0f + (p2 - p0) * t + (p0 * 2.0f - p1 * 5.0f + p2 * 4.0f - p3) * t2 + (p1 * 3.0f - p0 - p2 * 3.0f + p3) * t3) * 0.5f);
+		}
+	}
 
-	if (tilt + change < kCarMaxTilt && tilt + change > -kCarMaxTilt / 2) tilt += change; //Apply change if it doesn't make tilt go out of bounds
-	else if (tilt + change > kCarMaxTilt) tilt = kCarMaxTilt;
-	else if (tilt + change < -kCarMaxTilt / 2) tilt = -kCarMaxTilt / 2;
+	float length = 0.0f;
+	for (size_t i = 0; i < point.size(); i++)
+	{
+		distance.push_back(length);
+		Vector2D segment = point[(i + 1) % point.size()] - point[i];
+		length += sqrt(segment.Length());
+	}
+	distance.push_back(length);
+}
 
+int LaneSpline::Sample(float s, int hint) const //Sample at the start of the segment a distance falls on, walking on from a sample at or before it if there is one, otherwise by binary search
+{
+	int i;
+	if (hint >= 0 && hint < int(point.size()) && distance[hint] <= s) i = hint;
+	else i = int(upper_bound(distance.begin(), distance.end(), s) - distance.begin()) - 1;
+	if (i < 0) i = 0;
+	while (i + 1 < int(point.size()) && distance[i + 1] <= s) i++;
+	return i;
 }
 
-void HoverCar::Lean(float dir) //Update the lean value, takes a direction multiplier of 1 or -1
+Vector2D LaneSpline::At(float s, int hint) const //Point a distance along the lane, wrapping around past the end
 {
-	float change = kCarLeanFactor * dir * fTime; //Change in car's local Z angle
+	if (s < 0.0f || s >= Length()) //Goals are kept on the lane, so this is rarely needed
+	{
+		s = fmod(s, Length());
+		if (s < 0.0f) s += Length();
+	}
 
-	if (lean + change < kCarMaxLean && lean + change > -kCarMaxLean) lean += change; //Apply change if it doesn't make lean go out of bounds
-	else if (lean + change > kCarMaxLean) lean = kCarMaxLean;
-	else if (lean + change < -kCarMaxLean) lean = -kCarMaxLean;
+	int i = Sample(s, hint);
+	Vector2D a = point[i];
+	Vector2D b = point[i + 1 < int(point.size()) ? i + 1 : 0];
+	float segment = distance[i + 1] - distance[i];
+	return a + (b - a) * (segment > 0.0f ? (s - distance[i]) / segment : 0.0f);
 }
 
-void HoverCar::Boost(I3DEngine* e) //Checks performed when player attempts to use boost, along with consecutive actions
+void BakeNeighbourhoods(TrackData &data) //Gather the obstacles and trigger volumes around every square into its near list
 {
-	if (hp >= kLowHP * kMaxHP) //If hp is above 30%
+	//Every square next to one with something in it gets a list, in the order the grid squares were stored
+	data.near = SparseGrid <GridSquare>();
+	data.near.squareSize = data.grid.squareSize;
+	for (size_t i = 0; i < data.grid.size(); i++) for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) data.near.Add({ data.grid.coord[i].x + k, data.grid.coord[i].z + l });
+
+	//Lay the blocks out first so the arrays are allocated once. Each obstacle is stored in only one grid square, so no list holds one twice
+	const int kKinds = 2; //Sphere obstacles and trigger volumes, one after another in the block's sphere arrays
+	vector <size_t> boxCount(data.near.size()), sphereCount(data.near.size() * kKinds);
+	size_t floats = 0, ids = 0;
+	for (size_t n = 0; n < data.near.size(); n++)
 	{
-		if (e->KeyHeld(kKeyBoost) && !boostLock && thrust.Length() > kBoostMinThrust) //When boost key is pressed, boost isn't locked and car isn't still
+		GridCoord c = data.near.coord[n];
+		for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const GridSquare* square = data.grid.Find({ c.x + k, c.z + l }))
 		{
-			if (boostTimer > 0)
-			{
-				boostMult = kBoostMult;
-				boostTimer -= fTime;
-			}
-			if (boostTimer <= 0) //If boost key is pressed too long overheat and lock the boost for 5 seconds
+			boxCount[n] += square->boxObstacle.size();
+			const SphereList* kinds[kKinds] = { &square->sphereObstacle, &square->trigger };
+			for (int t = 0; t < kKinds; t++) sphereCount[n * kKinds + t] += kinds[t]->size();
+		}
+		size_t boxes = PaddedCount((unsigned int)boxCount[n]), spheres = 0;
+		for (int t = 0; t < kKinds; t++) spheres += PaddedCount((unsigned int)sphereCount[n * kKinds + t]);
+		floats += boxes * 4 + spheres * 3;
+		ids += boxes + spheres;
+	}
+	data.nearData.assign(floats, 0.0f);
+	data.nearId.assign(ids, -1);
+
+	float* f = data.nearData.data();
+	int* id = data.nearId.data();
+	for (size_t n = 0; n < data.near.size(); n++)
+	{
+		GridCoord c = data.near.coord[n];
+		GridSquare &block = data.near.square[n];
+		size_t boxes = PaddedCount((unsigned int)boxCount[n]), spheres = 0;
+		for (int t = 0; t < kKinds; t++) spheres += PaddedCount((unsigned int)sphereCount[n * kKinds + t]);
+
+		//Boxes, one array per edge with padding that can't be overlapped
+		float* edge[4] = { f, f + boxes, f + boxes * 2, f + boxes * 3 };
+		for (size_t i = 0; i < boxes; i++)
+		{
+			edge[0][i] = edge[2][i] = kNoObstacle;
+			edge[1][i] = edge[3][i] = -kNoObstacle;
+		}
+		size_t b = 0;
+		for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const GridSquare* square = data.grid.Find({ c.x + k, c.z + l }))
+		{
+			const BoxList &list = square->boxObstacle;
+			for (size_t i = 0; i < list.size(); i++, b++)
 			{
-				boostMult = 1.0f;
-				boostTimer = kOverheatPenalty;
-				boostLock = 1;
-				drMult = 2.0f; //Double drag
+				edge[0][b] = list.xStart[i];
+				edge[1][b] = list.xEnd[i];
+				edge[2][b] = list.zStart[i];
+				edge[3][b] = list.zEnd[i];
+				id[b] = list.id[i];
 			}
 		}
-		else
+		block.boxObstacle = { edge[0], edge[1], edge[2], edge[3], id, boxCount[n] };
+
+		//Spheres of each kind, padded with ones too far away to reach
+		float* x = f + boxes * 4;
+		float* z = x + spheres;
+		float* r = z + spheres;
+		int* sphereId = id + boxes;
+		for (size_t i = 0; i < spheres; i++) x[i] = z[i] = kNoObstacle;
+		SphereList* lists[kKinds] = { &block.sphereObstacle, &block.trigger };
+		size_t first = 0;
+		for (int t = 0; t < kKinds; t++)
 		{
-			if (boostTimer < kBoostTime) //When key isn't pressed and boost timer isn't max increase it
+			size_t e = first;
+			for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const GridSquare* square = data.grid.Find({ c.x + k, c.z + l }))
 			{
-				boostTimer += fTime;
-				if (boostLock) if (boostTimer >= 0)
+				const SphereList* kinds[kKinds] = { &square->sphereObstacle, &square->trigger };
+				for (size_t i = 0; i < kinds[t]->size(); i++, e++)
 				{
-					boostLock = 0; //Remove lock after 5 seconds pass
-					drMult = 1.0f; //Drag goes back to normal
+					x[e] = kinds[t]->x[i];
+					z[e] = kinds[t]->z[i];
+					r[e] = kinds[t]->r[i];
+					sphereId[e] = kinds[t]->id[i];
 				}
 			}
-			else boostTimer = kBoostTime; //If went over max set to max
-			if (boostTimer >= 0) boostMult = 1.0f; //If not boosting and not overheat boost goes back to normal
-		}
-	}
-	else //Boost permanently disabled if HP is below 30%
-	{
-		if (boostTimer < 0 && boostTimer > kOverheatPenalty) //If player was in overheat make sure the drag goes back to normal first
-		{
-			boostTimer += fTime;
-		}
-		else
-		{
-			drMult = 1.0f;
-			boostTimer = -10.0f;
+			*lists[t] = { x + first, z + first, r + first, sphereId + first, sphereCount[n * kKinds + t] };
+			first += PaddedCount((unsigned int)sphereCount[n * kKinds + t]);
 		}
-		boostMult = 1.0f; //In case it was increased
-		boostLock = 1; //Keep locked
-	}
-}
-
-void HoverCar::Update(float frameTime, ICamera* *camera) //Actions performed every frame
-{
-	fTime = frameTime; //Get time to be used in movement
-
-	//Movement
-	ResetCollision();
-	fVector = FacingVector(dummy);
-	Move(); //Move the car according to its momentum
-	Rotate(); //Apply changes in rotation
-	Bobble(); //Up and down movement
-
-	//Damage
-	UpdateDamage();
 
-	//Particles
-	UpdateParticles(camera);
+		f += boxes * 4 + spheres * 3;
+		id += boxes + spheres;
+	}
 }
 
-//UI
-UI::UI(I3DEngine* e) //Constructor
+void MapLanes(TrackData &data, TrackList <TrackLink> links) //Bucket the lane samples by grid square and work out which samples of each pair of lanes are level with each other
 {
-	//Sprites
-	uiBack = e->CreateSprite(kSpriteUIback, kUIBackX, kWindowSize.z - kBackdropHeight, 0.2f);
-	uiFront = e->CreateSprite(kSpriteUIfront, 0.0f, kWindowSize.z - kBackdropHeight);
-	for (int i = 0; i < 5; i++) uiBoost[i] = e->CreateSprite(kSpriteUIboost[i], kUIBackX, kWindowSize.z - kBackdropHeight, 0.1f);
-	uiEnd = e->CreateSprite(kSpriteUIend, 0.0f, -kEndSpriteY); //Make sure it's not visible
-
-	//Fonts
-	uiStatusFont = e->LoadFont(kUIFont, kUIStatusFontSize);
-	uiFont = e->LoadFont(kUIFont, kUIFontSize);
-	uiEndFont = e->LoadFont(kUIFont, kUIEndFontSize);
+	data.laneCells = SparseGrid <vector <LanePoint>>();
+	data.laneCells.squareSize = data.grid.squareSize;
+	for (size_t l = 0; l < data.lane.size(); l++) for (size_t i = 0; i < data.lane[l].point.size(); i++)
+	{
+		data.laneCells.Add(data.laneCells.Coord(data.lane[l].point[i].x, data.lane[l].point[i].z)).push_back({ int(l), int(i) });
+	}
 
-	//Text
-	status << "Hit Space to Start";
-	lap << "Lap 1/" << kLaps;
+	size_t lanes = data.lane.size();
+	data.laneMap.assign(lanes, vector <vector <int>>(lanes));
+	for (size_t a = 0; a < lanes; a++) for (size_t b = 0; b < lanes; b++) if (a != b)
+	{
+		const LaneSpline &from = data.lane[a];
+		const LaneSpline &to = data.lane[b];
+		vector <int> &map = data.laneMap[a][b];
+		map.assign(from.point.size(), -1);
+
+		//Links pin distances on one lane to distances on the other, in order along the first lane
+		vector <pair <float, float>> pins;
+		for (size_t k = 0; k < links.size(); k++)
+		{
+			if (links[k].laneA == a && links[k].laneB == b) pins.push_back({ from.distance[links[k].waypointA * LaneSpline::kSteps], to.distance[links[k].waypointB * LaneSpline::kSteps] });
+			else if (links[k].laneA == b && links[k].laneB == a) pins.push_back({ from.distance[links[k].waypointB * LaneSpline::kSteps], to.distance[links[k].waypointA * LaneSpline::kSteps] });
+		}
+		sort(pins.begin(), pins.end());
 
-	health << kMaxHP << "/" << kMaxHP << "HP";
-	hpColour = kCyan;
+		for (size_t i = 0; i < from.point.size(); i++)
+		{
+			int j;
+			if (pins.empty()) j = data.NearestLane(from.point[i], int(b)).sample; //Without links the closest sample is level with it
+			else
+			{
+				//Spread the distance between the pins before and after the sample evenly over the other lane
+				float s = from.distance[i];
+				size_t next = upper_bound(pins.begin(), pins.end(), make_pair(s, 1e30f)) - pins.begin();
+				pair <float, float> p0 = next == 0 ? pins.back() : pins[next - 1];
+				pair <float, float> p1 = next == pins.size() ? pins.front() : pins[next];
+				float fromGap = fmod(p1.first - p0.first + from.Length(), from.Length());
+				float toGap = fmod(p1.second - p0.second + to.Length(), to.Length());
+				if (pins.size() == 1) //A single pin only lines the lanes up, so go round in proportion to their lengths
+				{
+					fromGap = from.Length();
+					toGap = to.Length();
+				}
+				float along = fmod(s - p0.first + from.Length(), from.Length());
+				j = to.Sample(fmod(p0.second + (fromGap > 0.0f ? along / fromGap : 0.0f) * toGap, to.Length()));
+			}
 
-	endStatus2 << "Press F1 to play again.";
+			Vector2D gap = from.point[i];
+			gap = gap - to.point[j];
+			if (gap.Length() <= kLaneSwitchGap * kLaneSwitchGap) map[i] = j; //Too far apart to switch between otherwise
+		}
+	}
 }
 
-void UI::Reset() //Reset the UI to its state from before the race started
+LanePoint TrackData::NearestLane(Vector2D p, int onlyLane) const //Closest lane sample to a point, or closest sample of one lane
 {
-	//Sprite reset
-	uiEnd->SetY(-kEndSpriteY); //Hide end text
-
-	//Text reset
-	status.str("");
-	status << "Hit Space to Start";
-
-	lap.str("");
-	lap << "Lap 1/" << kLaps;
-
-	health.str("");
-	health << kMaxHP << "/" << kMaxHP << "HP";
-	hpColour = kCyan;
-
-	//Time
-	countdown = -1.0f;
-	boostTimer = -1.0f;
+	LanePoint nearest = { -1, -1 };
+	float nearestDist = 0.0f;
 
-	//Other
-	end = 0;
-}
+	//Samples in the point's grid square and the ones around it first, then every sample if none of them were close enough
+	GridCoord gs = laneCells.Coord(p.x, p.z);
+	for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const vector <LanePoint>* found = laneCells.Find({ gs.x + k, gs.z + l }))
+	{
+		const vector <LanePoint> &cell = *found;
+		for (size_t i = 0; i < cell.size(); i++) if (onlyLane < 0 || cell[i].lane == onlyLane)
+		{
+			float d = (p - lane[cell[i].lane].point[cell[i].sample]).Length();
+			if (nearest.lane < 0 || d < nearestDist)
+			{
+				nearest = cell[i];
+				nearestDist = d;
+			}
+		}
+	}
+	if (nearest.lane >= 0 && nearestDist <= laneCells.squareSize * laneCells.squareSize) return nearest; //Anything closer would have been in the squares searched
 
-void UI::ShowEndStatus() //Make the end backdrop and text visible, triggered on death and race completion
-{
-	uiEnd->SetY(kEndSpriteY); //Make sprite visible
-	end = 1;
+	for (size_t l = 0; l < lane.size(); l++) if (onlyLane < 0 || int(l) == onlyLane) for (size_t i = 0; i < lane[l].point.size(); i++)
+	{
+		float d = (p - lane[l].point[i]).Length();
+		if (nearest.lane < 0 || d < nearestDist)
+		{
+			nearest = { int(l), int(i) };
+			nearestDist = d;
+		}
+	}
+	return nearest;
 }
 
-void UI::UpdateWinner(string name, Time t) //When the first car completes a race the end text is updated with its name and time
+SweepHit TrackData::Sweep(Vector2D from, Vector2D to, float radius) const //First sphere or box obstacle a circle runs into on its way between two points, from the near list if it stays in one square
 {
-	endStatus.str("");
-	endStatus << "RACE COMPLETE! " << name << " WON WITH A TIME OF " << setfill('0') << setw(2) << t.m << ":" << setfill('0') << setw(2) << t.s << ":" << setfill('0') << setw(2) << t.ms;
-}
-
+	GridCoord start = grid.Coord(from.x, from.z);
+	GridCoord end = grid.Coord(to.x, to.z);
+	if (start.x != end.x || start.z != end.z) return SweepSquares(from, to, radius); //Moves between squares can reach past one square's neighbours
 
-void UI::UpdateStatus(int nCheck, int cLap, int lastCheck) //Updates to the status message, triggered when crossing checpoints
-{
-	status.str("");
-	if (cLap > kLaps) status << "Race complete!";
-	else
+	SweepHit hit;
+	if (const GridSquare* square = near.Find(end))
 	{
-		if (nCheck == 0) nCheck = lastCheck; //If next lap is first in array then the one just passed was last in it
-		status << "Stage " << nCheck << " complete";
-
-		lap.str("");
-		lap << "Lap " << cLap << "/" << kLaps;
+		square->sphereObstacle.Sweep(from, to, radius, hit);
+		square->boxObstacle.Sweep(from, to, radius, hit);
 	}
-
+	return hit;
 }
 
-void UI::UpdateHP(int hp) //After a damage check the hp status is updated to show player's current hp
+int TrackData::Triggers(GridCoord square, Vector2D pos, float radius, int* inside, int maxInside) const //Ids of the trigger volumes a circle in a square is in, up to maxInside, from the square's near list
 {
-	if (hp < 0) hp = 0;
-	health.str("");
-	health << hp << "/" << kMaxHP << "HP";
-	if (hp < kMaxHP * kLowHP) hpColour = kMagenta; //If hp is low change colour of the text
+	const GridSquare* found = near.Find(square);
+	if (!found) return 0; //Squares with nothing around them don't have one
+
+	int count = found->trigger.Hits(pos, radius, inside, maxInside);
+	for (int i = 0; i < count; i++) inside[i] = found->trigger.id[inside[i]];
+	return count;
 }
 
-void UI::UpdateGeneral(float kmphSpeed, Time raceTime, int playerPos, int carNumber) //Update to speed, time elapsed and race position text
+SweepHit TrackData::SweepSquares(Vector2D from, Vector2D to, float radius) const //Same, going through every grid square the move passes near
 {
-	//Speed
-	speed.str("");
-	speed << round(kmphSpeed) << "km/h";
+	SweepHit hit;
 
-	//Time elapsed
-	time.str("");
-	time << setfill('0') << setw(2) << raceTime.m << ":" << setfill('0') << setw(2) << raceTime.s << ":" << setfill('0') << setw(2) << raceTime.ms;
+	//Obstacles are only stored in the square their centre is in, so search one square further than the move reaches
+	GridCoord low = grid.Coord(min(from.x, to.x), min(from.z, to.z));
+	GridCoord high = grid.Coord(max(from.x, to.x), max(from.z, to.z));
 
-	//Position in race
-	pos.str("");
-	pos << "Pos " << playerPos << "/" << carNumber;
+	//Spheres first, the same order the near lists hold them in, so both ways pick the same obstacle when two are hit at once
+	for (int x = low.x - 1; x <= high.x + 1; x++) for (int z = low.z - 1; z <= high.z + 1; z++) if (const GridSquare* square = grid.Find({ x, z })) square->sphereObstacle.Sweep(from, to, radius, hit);
+	for (int x = low.x - 1; x <= high.x + 1; x++) for (int z = low.z - 1; z <= high.z + 1; z++) if (const GridSquare* square = grid.Find({ x, z })) square->boxObstacle.Sweep(from, to, radius, hit);
+	return hit;
 }
 
-void UI::UpdateBoost(float bTime) //Boost bar update, takes player's boost time
+int CompileTrackTool(string levelFile, string trackFile) //Offline track compiler, reports how long both ways of loading take
 {
-	if (bTime < 0) boostTimer -= fTime; //The timer makes the overhead/boost down text flash, updated when it should be shown and flashing
-
-	boost.str(""); //Clear text
+	const int kLoadRuns = 20; //Each way of loading is timed this many times and averaged
 
-	if (bTime < 0 && boostTimer < 0) //Show text if timer is below 0
+	//Compile and save
+	vector <char> image;
+	size_t objectCount = 0;
 	{
-		if (bTime == -10) boost << "BOOST DOWN";
-		else boost << "OVERHEAT";
-
-		if (boostTimer <= -kBoostTextTime) boostTimer = kBoostTextFlashTime; //Reset timer
+		TrackBuilder builder;
+		if (!ParseLevel(levelFile, builder))
+		{
+			cout << "Could not read " << levelFile << endl;
+			return 1;
+		}
+		BakeTrack(builder, image);
+		objectCount = builder.objects.size();
 	}
+	const TrackHeader* header = (const TrackHeader*)&image[0];
 
-	float boostPerSec = kBoostLen / kBoostTime; //Length of the boost bar that's depleted each second of use
-	int colourIndex; //Used to change colour based on boost time left
-
-	//Depending on boost timer change colour of the boost bar
-	if (bTime >= kBoostLevel[0]) colourIndex = 0;
-	else if (bTime < kBoostLevel[3]) colourIndex = 4;
-	else if (bTime < kBoostLevel[2]) colourIndex = 3;
-	else if (bTime < kBoostLevel[1]) colourIndex = 2;
-	else if (bTime < kBoostLevel[0]) colourIndex = 1;
-
-	for (int i = 0; i < 5; i++)
+	if (!SaveTrack(trackFile, image))
 	{
-		if (i == colourIndex) uiBoost[i]->SetX(kUIBackX - kBoostTime * boostPerSec + bTime * boostPerSec); //If boost is being used (not at max time) the bar will gradually hide
-		else uiBoost[i]->SetX(0.0f); //Hide if not current colour
+		cout << "Could not write " << trackFile << endl;
+		return 1;
 	}
-}
 
-bool UI::Countdown() //Countdown at the start of race, returns true when it finishes
-{
-	countdown -= fTime; //Update countdown
-	status.str(""); //Clear string
-	if (countdown > 0)
-	{
-		status << ceil(countdown) << "...";
-		return 0;
-	}
-	else
+	//Time the text path (parse and bake in memory) against the binary path (map and validate)
+	double textTime = 0.0;
+	double binaryTime = 0.0;
+	for (int i = 0; i < kLoadRuns; i++)
 	{
-		status << "Go!";
-		return 1;
+		Track track;
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		bool loaded = CompileTrack(levelFile, track);
+		textTime += Milliseconds(start);
+		UnloadTrack(track);
+
+		start = chrono::high_resolution_clock::now();
+		loaded = loaded && MapTrack(trackFile, track);
+		binaryTime += Milliseconds(start);
+		UnloadTrack(track);
+
+		if (!loaded)
+		{
+			cout << "Could not load the compiled track back" << endl;
+			return 1;
+		}
 	}
-}
-
-void UI::GameOver() //Updates text and shows end status when the player dies
-{
-	status.str("");
-	status << "Game Over";
 
-	endStatus.str("");
-	endStatus << "GAME OVER";
-	ShowEndStatus();
+	cout << "Compiled " << levelFile << " into " << trackFile << ": " << objectCount << " objects, " << header->cells.count << " grid squares of " << header->gridSize << " units, "
+		<< image.size() << " bytes, version " << kTrackVersion << endl;
+	cout << "Text path (parse and bake):     " << textTime / kLoadRuns << " ms" << endl;
+	cout << "Binary path (map and validate): " << binaryTime / kLoadRuns << " ms" << endl;
+	return 0;
 }
 
-void UI::Update(float frameTime, float boostTime) //Display all UI text and update boost bar
+int CollisionBenchTool(string levelFile, int queries) //Times the obstacle tests against the one-struct-at-a-time loop they replaced
 {
-	fTime = frameTime;
-	UpdateBoost(boostTime);
-
-	//Print status
-	uiStatusFont->Draw(status.str(), kStatusX, kUITextHeight, kCyan, kLeft, kVCentre);
+	const int kBenchRuns = 20; //Every query is repeated this many times
+	const float kQuerySpread = 20.0f; //Queries are placed up to this far from a random object so that plenty of them hit something
+	const float kCarRad = 0.4f * 2.8f; //Hover car scale times its radius
 
-	//Print current lap
-	uiFont->Draw(lap.str(), kLapX, kUITextHeight - kUITextSpace, kCyan, kLeft, kVCentre);
+	//The builder keeps the old per square lists of structs, the track holds the new arrays
+	TrackBuilder builder;
+	if (!ParseLevel(levelFile, builder))
+	{
+		cout << "Could not read " << levelFile << endl;
+		return 1;
+	}
+	Track track;
+	BakeTrack(builder, track.buffer);
+	track.image = &track.buffer[0];
+	track.size = track.buffer.size();
+
+	shared_ptr <const TrackData> data = ShareTrack(track);
+	const SparseGrid <GridSquare> &grid = data->grid;
+
+	//Car positions around the objects, each with a position it moved from
+	vector <Vector2D> pos;
+	vector <Vector2D> prevPos;
+	RandomStream random(1, streamTools, 0);
+	for (int i = 0; i < queries; i++)
+	{
+		const ObjectInstance &o = builder.objects[random.Int() % builder.objects.size()];
+		pos.push_back({ o.x + (random.Int() % 2001 - 1000) * 0.001f * kQuerySpread, o.z + (random.Int() % 2001 - 1000) * 0.001f * kQuerySpread });
+		prevPos.push_back({ pos.back().x + (random.Int() % 201 - 100) * 0.01f, pos.back().z + (random.Int() % 201 - 100) * 0.01f });
+	}
 
-	//Print current position in race
-	uiFont->Draw(pos.str(), kLapX, kUITextHeight + kUITextSpace, kCyan, kLeft, kVCentre);
+	//Each way gives every query a result made of the first box, sphere and trigger volume hit in each nearby square, summed into a checksum
+	long long oldSum = 0;
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (int run = 0; run < kBenchRuns; run++) for (int q = 0; q < queries; q++)
+	{
+		GridCoord gs = builder.grid.Coord(pos[q].x, pos[q].z);
+		for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const BuilderSquare* c = builder.grid.Find({ gs.x + k, gs.z + l }))
+		{
+			for (size_t j = 0; j < c->sphereObstacle.size(); j++) if (c->sphereObstacle[j].Collision(pos[q], kCarRad))
+			{
+				oldSum += j + 1;
+				break;
+			}
+			for (size_t j = 0; j < c->trigger.size(); j++) if (c->trigger[j].sphere.Collision(pos[q], kCarRad))
+			{
+				oldSum += j + 1;
+				break;
+			}
+			for (size_t j = 0; j < c->boxObstacle.size(); j++)
+			{
+				ColAxis a = c->boxObstacle[j].Collision(pos[q], prevPos[q], kCarRad);
+				if (a != none)
+				{
+					oldSum += (j + 1) * 4 + a;
+					break;
+				}
+			}
+		}
+	}
+	double oldTime = Milliseconds(start);
 
-	//Print hp amount 
-	uiFont->Draw(health.str(), kHealthX, kUITextHeight, hpColour, kLeft, kVCentre);
+	long long newSum = 0;
+	start = chrono::high_resolution_clock::now();
+	for (int run = 0; run < kBenchRuns; run++) for (int q = 0; q < queries; q++)
+	{
+		GridCoord gs = grid.Coord(pos[q].x, pos[q].z);
+		for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const GridSquare* found = grid.Find({ gs.x + k, gs.z + l }))
+		{
+			const GridSquare &square = *found;
+			const SphereList* spheres[2] = { &square.sphereObstacle, &square.trigger };
+			for (int s = 0; s < 2; s++)
+			{
+				int j = spheres[s]->FirstHit(pos[q], kCarRad);
+				if (j >= 0) newSum += j + 1;
+			}
+			int j = square.boxObstacle.FirstHit(pos[q], kCarRad);
+			if (j >= 0) newSum += (j + 1) * 4 + square.boxObstacle[j].Collision(pos[q], prevPos[q], kCarRad);
+		}
+	}
+	double newTime = Milliseconds(start);
+
+#if defined(OBSTACLE_AVX)
+	string width = "AVX, 8 obstacles per test";
+#elif defined(OBSTACLE_SSE)
+	string width = "SSE, 4 obstacles per test";
+#else
+	string width = "scalar, no SIMD in this build";
+#endif
+	cout << queries << " car positions x " << kBenchRuns << " runs, " << width << endl;
+	cout << "Structs, one at a time: " << oldTime * 1000000.0 / (double(queries) * kBenchRuns) << " ns per car" << endl;
+	cout << "Arrays, narrow phase:   " << newTime * 1000000.0 / (double(queries) * kBenchRuns) << " ns per car" << endl;
+	cout << "Results " << (oldSum == newSum ? "match" : "DIFFER") << " (checksum " << oldSum << ")" << endl;
+
+	//What a car does every tick: sweep from where it was to where it is, then find the trigger volumes around it. Each way sums the obstacle hit, when and on which side, and the types of the volumes it's in
+	long long squareSum = 0;
+	double squareTimes = 0.0;
+	start = chrono::high_resolution_clock::now();
+	for (int run = 0; run < kBenchRuns; run++) for (int q = 0; q < queries; q++)
+	{
+		SweepHit hit = data->SweepSquares(prevPos[q], pos[q], kCarRad);
+		unsigned int triggers = 0;
+		GridCoord gs = grid.Coord(pos[q].x, pos[q].z);
+		for (int k = -1; k <= 1; k++) for (int l = -1; l <= 1; l++) if (const GridSquare* square = grid.Find({ gs.x + k, gs.z + l }))
+		{
+			int inside[kMaxTriggers];
+			int count = square->trigger.Hits(pos[q], kCarRad, inside, kMaxTriggers);
+			for (int j = 0; j < count; j++) triggers |= data->triggerType[square->trigger.id[inside[j]]];
+		}
+		squareSum += ((hit.index + 1) * 64 + hit.axis * 16 + hit.box * 8) * 32 + triggers;
+		squareTimes += hit.time;
+	}
+	double squareTime = Milliseconds(start);
 
-	//Print current speed
-	uiFont->Draw(speed.str(), kSpeedX, kUITextHeight - kUITextSpace, kCyan, kLeft, kVCentre);
+	long long nearSum = 0;
+	double nearTimes = 0.0;
+	start = chrono::high_resolution_clock::now();
+	for (int run = 0; run < kBenchRuns; run++) for (int q = 0; q < queries; q++)
+	{
+		SweepHit hit = data->Sweep(prevPos[q], pos[q], kCarRad);
+		unsigned int triggers = 0;
+		int inside[kMaxTriggers];
+		int count = data->Triggers(grid.Coord(pos[q].x, pos[q].z), pos[q], kCarRad, inside, kMaxTriggers);
+		for (int j = 0; j < count; j++) triggers |= data->triggerType[inside[j]];
+		nearSum += ((hit.index + 1) * 64 + hit.axis * 16 + hit.box * 8) * 32 + triggers;
+		nearTimes += hit.time;
+	}
+	double nearTime = Milliseconds(start);
 
-	//Print current time
-	uiFont->Draw(time.str(), kSpeedX, kUITextHeight + kUITextSpace, kCyan, kLeft, kVCentre);
+	bool nearMatch = squareSum == nearSum && squareTimes == nearTimes;
+	cout << "Tick query, 3x3 squares: " << squareTime * 1000000.0 / (double(queries) * kBenchRuns) << " ns per car" << endl;
+	cout << "Tick query, near list:   " << nearTime * 1000000.0 / (double(queries) * kBenchRuns) << " ns per car (" << data->near.size() << " lists, "
+		<< (data->nearData.size() * sizeof(float) + data->nearId.size() * sizeof(int)) / 1024 << " KB)" << endl;
+	cout << "Results " << (nearMatch ? "match" : "DIFFER") << " (checksum " << squareSum << ")" << endl;
 
-	//Print boost status
-	uiStatusFont->Draw(boost.str(), kBoostX, kUITextHeight, kMagenta, kCentre, kVCentre);
+	return oldSum == newSum && nearMatch ? 0 : 1;
+}
 
-	//At the end of the race, display winner and their time
-	if (end)
+//Replays
+Replay::~Replay() //Stop the encoder
+{
+	if (!encoder.joinable()) return;
 	{
-		uiEndFont->Draw(endStatus.str(), int(kWindowSize.x / 2), kEndTextY, kMagenta, kCentre, kVCentre);
-		uiStatusFont->Draw(endStatus2.str(), int(kWindowSize.x / 2), kEndText2Y, kCyan, kCentre, kVCentre);
+		lock_guard <mutex> guard(encodeLock);
+		encodeQuit = true;
 	}
+	encodeWake.notify_all();
+	encoder.join();
 }
 
-//Camera
-Camera::Camera(I3DEngine* e, IMesh* dummyMesh, HoverCar player) //Constructor
+void Replay::Begin(unsigned int raceSeed, float rate, int cars, const TrackData &track) //Start a new recording
 {
-	camera = e->CreateCamera(kManual, 0.0f, 0.0f, 0.0f);
-	dummy = dummyMesh->CreateModel();
-	camera->AttachToParent(dummy);
-	dummy->AttachToParent(player.dummy);
-	SetMode(0);
+	Flush();
+	seed = raceSeed;
+	simRate = rate;
+	carCount = cars;
+	trackHash = track.hash;
+
+	input.clear();
+	input.reserve(size_t(simRate * 60.0f * 10.0f)); //Ten minutes of ticks before it has to grow
+	keyTick.clear();
+	keyframe.clear();
+	last.data.clear();
 }
 
-void Camera::Controls(I3DEngine* e, HoverCar *player) //Take key input to move the camera and change its modes
+void Replay::Record(Race &race, PlayerInput keys) //Keep the keys a tick is about to use, and take a keyframe every kKeyframeTime seconds
 {
-	//Movement
-	if (e->KeyHeld(kKeyCameraUp)) dummy->MoveLocalZ(kCameraSpeed * fTime);
-	if (e->KeyHeld(kKeyCameraDown)) dummy->MoveLocalZ(-kCameraSpeed * fTime);
-	if (e->KeyHeld(kKeyCameraLeft)) dummy->MoveLocalX(-kCameraSpeed * fTime);
-	if (e->KeyHeld(kKeyCameraRight)) dummy->MoveLocalX(kCameraSpeed * fTime);
+	input.push_back(keys.Pack()); //A store into room reserved for minutes of ticks, cheaper than reading the clock around it, so only keyframes are timed
+	if (race.tick % max(1, int(kKeyframeTime * simRate)) != 0) return;
 
-	if (dummy->GetY() < kYLimit) camera->SetY(kYLimit);
-
-	//Rotation
-	dummy->ResetOrientation();
-	mouseMoveX += e->GetMouseMovementX();
-	mouseMoveY += e->GetMouseMovementY();
-	dummy->RotateLocalY(mouseMoveX * kCameraRotation);
-	dummy->RotateLocalX(mouseMoveY * kCameraRotation);
-
-	if (mouseMoveY < -kCameraLimit) mouseMoveY = -kCameraLimit;
-	else if (mouseMoveY > kCameraLimit) mouseMoveY = kCameraLimit;
-
-	//Mouse capture
-	if (e->KeyHit(kKeyCameraCapture)) mouseCaptureOn = !mouseCaptureOn;
-	if (mouseCaptureOn) e->StartMouseCapture();
-	else e->StopMouseCapture();
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	Flush(); //Keyframes are seconds apart, so the last one is long done
+	next.data.clear();
+	race.Serialize(next);
+	keyTick.push_back(race.tick);
 
-	//Chase mode
-	if (e->KeyHit(kKeyCameraChase))
-	{
-		SetMode(0);
-		dummy->DetachFromParent();
-		dummy->AttachToParent((*player).dummy);
-	}
-	//First person mode
-	else if (e->KeyHit(kKeyCameraFP))
+	if (!encoder.joinable()) encoder = thread(&Replay::Encode, this);
 	{
-		SetMode(1);
-		dummy->DetachFromParent();
-		dummy->AttachToParent((*player).car);
+		lock_guard <mutex> guard(encodeLock);
+		encodePending = true;
 	}
-	//Free mode
-	else if (e->KeyHit(kKeyCameraFree))
+	recordTime += Milliseconds(start);
+	encodeWake.notify_all();
+}
+
+void Replay::Encode() //Loop of the encoder thread
+{
+	unique_lock <mutex> guard(encodeLock);
+	while (true)
 	{
-		SetMode(2);
-		dummy->DetachFromParent();
+		encodeWake.wait(guard, [this] { return encodePending || encodeQuit; });
+		if (!encodePending) return;
+
+		//Next and the keyframe list are only touched by the tick thread after Flush, so they're encoded without the lock
+		guard.unlock();
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		keyframe.push_back(vector <char>());
+		EncodeDelta(next.data, last.data, keyframe.back(), changes);
+		last.data.swap(next.data); //Next keeps the old buffer for the following keyframe
+		encodeTime += Milliseconds(start);
+		guard.lock();
+
+		encodePending = false;
+		encodeWake.notify_all();
 	}
 }
 
-void Camera::SetMode(int i) //Use the passed index to select one of the modes and set the camera position and rotation accordingly
+void Replay::Flush() //Wait until every keyframe taken so far is encoded
 {
-	dummy->SetLocalPosition(kCameraModes[i].pos.x, kCameraModes[i].pos.y, kCameraModes[i].pos.z);
-	mouseMoveX = kCameraModes[i].mouseX;
-	mouseMoveY = kCameraModes[i].mouseY;
-	modeIndex = i;
+	unique_lock <mutex> guard(encodeLock);
+	encodeWake.wait(guard, [this] { return !encodePending; });
 }
 
-void Camera::Shake() //Trigger camera shaking
+PlayerInput Replay::Input(long long tick) //Keys used by a tick
 {
-	shakeTimer = kShakeDuration;
+	PlayerInput keys;
+	if (tick >= 0 && tick < Ticks()) keys.Unpack(input[size_t(tick)]);
+	return keys;
+}
 
-	if (modeIndex == 1) yGoal = -kShakeFPHeight;
-	else yGoal = -kShakeHeight;
+void Replay::Keyframe(int index, SimState &state) //Rebuild a keyframe from the differences before it
+{
+	Flush();
+	state.data.clear();
+	for (int i = 0; i <= index; i++) DecodeDelta(keyframe[i], state.data);
+	state.Load();
 }
 
-void Camera::Update(I3DEngine* e, float frameTime, HoverCar *player) //Update frame time and take input
+void Replay::Seek(Race &race, long long tick) //Restore the last keyframe before a tick and simulate up to it
 {
-	fTime = frameTime;
-	Controls(e, player);
+	if (keyTick.empty()) return; //The keyframe list itself may still be growing on the encoder
+	if (tick < 0) tick = 0;
+	if (tick > Ticks()) tick = Ticks();
 
-	//Shake the camera
-	shakeTimer -= fTime;
-	if (shakeTimer > 0.0f)
+	//Restore a keyframe unless the race is already between the nearest one and the tick
+	int k = int(upper_bound(keyTick.begin(), keyTick.end(), tick) - keyTick.begin()) - 1;
+	if (race.tick > tick || race.tick < keyTick[k])
 	{
-		if (modeIndex == 1) //If in first person mode shake less
-		{
-			if (camera->GetLocalY() > kShakeFPHeight) yGoal = -kShakeFPHeight;
-			else if (camera->GetLocalY() < -kShakeFPHeight) yGoal = kShakeFPHeight;
-		}
-		else
-		{
-			if (camera->GetLocalY() > kShakeHeight) yGoal = -kShakeHeight;
-			else if (camera->GetLocalY() < -kShakeHeight) yGoal = kShakeHeight;
-		}
+		SimState state;
+		Keyframe(k, state);
+		race.Serialize(state);
 	}
-	else yGoal = 0.0f;
 
-	if (modeIndex == 1)
+	//Simulate the rest of the way without drawing anything
+	const float simStep = 1.0f / simRate;
+	while (race.tick < tick) race.Tick(simStep, Input(race.tick));
+
+	//Bring the HUD up to date with the restored race
+	race.hud.Reset();
+	race.hud.UpdateStatus(race.cars[0].nextCheck, race.cars[0].lap, race.checkpoint.size());
+	race.hud.UpdateHP(max(race.cars[0].hp, 0));
+}
+
+bool Replay::Save(string file) //Write the replay to a file
+{
+	Flush();
+	//Header
+	vector <char> out = { 'H', 'R', 'R', 'P' };
+	PutNumber(out, kReplayVersion);
+	PutNumber(out, seed);
+	PutNumber(out, (unsigned long long)(simRate * 1000.0f));
+	PutNumber(out, carCount);
+	PutNumber(out, trackHash);
+
+	//Keys, stored as runs since they're held for many ticks at a time
+	PutNumber(out, input.size());
+	for (size_t i = 0; i < input.size();)
 	{
-		if (camera->GetLocalY() > yGoal) camera->MoveLocalY(-kShakeFPSpeed * fTime);
-		else if (camera->GetLocalY() < yGoal) camera->MoveLocalY(kShakeFPSpeed * fTime);
+		size_t run = 1;
+		while (i + run < input.size() && input[i + run] == input[i]) run++;
+		out.push_back(char(input[i]));
+		PutNumber(out, run);
+		i += run;
 	}
-	else
+
+	//Keyframes
+	PutNumber(out, keyframe.size());
+	for (size_t i = 0; i < keyframe.size(); i++)
 	{
-		if (camera->GetLocalY() > yGoal) camera->MoveLocalY(-kShakeSpeed * fTime);
-		else if (camera->GetLocalY() < yGoal) camera->MoveLocalY(kShakeSpeed * fTime);
+		PutNumber(out, keyTick[i]);
+		PutNumber(out, keyframe[i].size());
+		out.insert(out.end(), keyframe[i].begin(), keyframe[i].end());
 	}
 
-	if (yGoal == 0.0f && pow(camera->GetLocalY() - yGoal, 2) < pow(kShakeSpeed * fTime, 2)) camera->SetLocalY(0);
+	//Hash of everything before it, so a damaged file is never played
+	unsigned long long check = Hash(&out[0], out.size());
+	out.insert(out.end(), (const char*)&check, (const char*)&check + sizeof(check));
+
+	ofstream f(file, ios::binary);
+	if (!f) return false;
+	f.write(&out[0], out.size());
+	return bool(f);
 }
 
-//Collision detection
-BoundingBox::BoundingBox(float xPos, float zPos, float halfWidth, float halfLength) //Constructor
+bool Replay::Load(string file) //Read a replay, false if it's missing, from an older version or damaged
 {
-	Initialise(xPos, zPos, halfWidth, halfLength);
+	ifstream f(file, ios::binary);
+	if (!f) return false;
+	vector <char> in((istreambuf_iterator <char>(f)), istreambuf_iterator <char>());
+	if (in.size() < 4 + sizeof(unsigned long long) || string(&in[0], 4) != "HRRP") return false;
+
+	unsigned long long check; //Hash of everything before it
+	memcpy(&check, &in[in.size() - sizeof(check)], sizeof(check));
+	in.resize(in.size() - sizeof(check));
+	if (Hash(&in[0], in.size()) != check) return false;
+
+	//Header
+	size_t pos = 4;
+	if (GetNumber(in, pos) != kReplayVersion) return false;
+	seed = (unsigned int)GetNumber(in, pos);
+	simRate = GetNumber(in, pos) / 1000.0f;
+	unsigned long long cars = GetNumber(in, pos);
+	trackHash = GetNumber(in, pos);
+	if (!(simRate > 0.0f) || cars < 1 || cars > kMaxRaceCars) return false;
+	carCount = int(cars);
+
+	//Keys, the runs have to add up to the tick count before any room is made for them
+	unsigned long long ticks = GetNumber(in, pos);
+	size_t runs = pos;
+	for (unsigned long long i = 0; i < ticks;)
+	{
+		if (pos >= in.size()) return false; //Keys stop before the last tick
+		pos++;
+		unsigned long long run = GetNumber(in, pos);
+		if (run == 0 || run > ticks - i) return false;
+		i += run;
+	}
+
+	//Keyframes, each takes at least two bytes and there's one every kKeyframeTime seconds from the first tick
+	unsigned long long keyframes = GetNumber(in, pos);
+	double interval = max(1.0f, floor(kKeyframeTime * simRate)); //Ticks between keyframes, the same as Record
+	if (keyframes == 0 || keyframes > (in.size() - pos) / 2 || double(ticks) > double(keyframes) * interval) return false;
+
+	input.resize(size_t(ticks));
+	for (size_t i = 0; i < input.size();)
+	{
+		unsigned char keys = (unsigned char)in[runs++];
+		size_t run = size_t(GetNumber(in, runs));
+		for (size_t j = 0; j < run; j++) input[i++] = keys;
+	}
+
+	keyframe.resize(size_t(keyframes));
+	keyTick.resize(keyframe.size());
+	for (size_t i = 0; i < keyframe.size(); i++)
+	{
+		keyTick[i] = (long long)GetNumber(in, pos);
+		size_t size = size_t(GetNumber(in, pos));
+		if (double(keyTick[i]) != double(i) * interval || size > in.size() - pos) return false;
+		keyframe[i].assign(in.begin() + pos, in.begin() + pos + size);
+		pos += size;
+	}
+	return true;
 }
 
-void BoundingBox::Initialise(float xPos, float zPos, float halfWidth, float halfLength) //Separated to make an early definition possible (needed for checkpoints)
+void PutNumber(vector <char> &out, unsigned long long n) //Append a number using as few bytes as it needs
 {
-	xStart = xPos - halfWidth;
-	xEnd = xPos + halfWidth;
-	zStart = zPos - halfLength;
-	zEnd = zPos + halfLength;
+	//Seven bits per byte, the top bit is set on every byte but the last
+	while (n >= 0x80)
+	{
+		out.push_back(char((n & 0x7F) | 0x80));
+		n >>= 7;
+	}
+	out.push_back(char(n));
 }
 
-ColAxis BoundingBox::Collision(HoverCar *car) //Collision detection with a hover car, returns collision direction
+unsigned long long GetNumber(const vector <char> &in, size_t &pos) //Read a number written by PutNumber
 {
-	if (((*car).dummy->GetX() + (*car).r) > xStart && ((*car).dummy->GetX() - (*car).r) < xEnd && ((*car).dummy->GetZ() + (*car).r) > zStart && ((*car).dummy->GetZ() - (*car).r) < zEnd)
+	unsigned long long n = 0;
+	for (int shift = 0; pos < in.size() && shift < 64; shift += 7)
 	{
-		if ((*car).prevPos.x + (*car).r > xStart && (*car).prevPos.x - (*car).r < xEnd &&
-			!((*car).prevPos.z + (*car).r > zStart && (*car).prevPos.z - (*car).r < zEnd)) return colZ; //If X overlaps col was on Z axis 
-		else if ((*car).prevPos.z + (*car).r > zStart && (*car).prevPos.z - (*car).r < zEnd &&
-			!((*car).prevPos.x + (*car).r > xStart && (*car).prevPos.x - (*car).r < xEnd)) return colX; //If Z then X axis
-		else return both; //If collided at an angle then collision was on both axes
+		unsigned char b = (unsigned char)in[pos++];
+		n |= (unsigned long long)(b & 0x7F) << shift;
+		if (!(b & 0x80)) break;
 	}
-	else return none;
+	return n;
 }
 
-BoundingSphere::BoundingSphere(float xPos, float zPos, float radius) //Constructor
+void EncodeDelta(const vector <char> &state, const vector <char> &previous, vector <char> &out, vector <char> &changes) //Run length encode the bytes that changed since the previous state, changes is scratch space kept between calls
 {
-	x = xPos;
-	z = zPos;
-	r = pow(radius, 2);
+	const size_t kMinGap = 4; //Unchanged runs shorter than this are cheaper to store along with the changed bytes around them
+
+	//The state is XORed with the previous one in one pass, so unchanged bytes become zeros and are stored as run lengths
+	size_t size = state.size();
+	size_t common = min(size, previous.size());
+	changes.resize(size);
+	for (size_t i = 0; i < common; i++) changes[i] = char(state[i] ^ previous[i]);
+	for (size_t i = common; i < size; i++) changes[i] = state[i]; //Bytes past the end of the previous state are encoded against zero
+	const char* c = size > 0 ? &changes[0] : nullptr;
+
+	PutNumber(out, size);
+	size_t i = 0;
+	while (i < size)
+	{
+		//Most of the state doesn't change, so unchanged runs are skipped eight bytes at a time
+		size_t start = i;
+		unsigned long long word;
+		while (i + 8 <= size && (memcpy(&word, c + i, 8), word == 0)) i += 8;
+		while (i < size && c[i] == 0) i++;
+		PutNumber(out, i - start);
+
+		start = i;
+		size_t gap = 0;
+		while (i < size && gap < kMinGap)
+		{
+			if (c[i] == 0) gap++;
+			else gap = 0;
+			i++;
+		}
+		if (gap == kMinGap) i -= gap; //Leave the unchanged run for the next pass
+		else if (i == size) while (i > start && c[i - 1] == 0) i--;
+
+		PutNumber(out, i - start);
+		out.insert(out.end(), c + start, c + i);
+	}
 }
 
-bool BoundingSphere::Collision(HoverCar *car) //Collision detection with a hover car
+void DecodeDelta(const vector <char> &delta, vector <char> &state) //Turn the previous state into the one a delta was made from
 {
-	return (pow(x - (*car).dummy->GetX(), 2) + pow(z - (*car).dummy->GetZ(), 2) - r - pow((*car).r, 2)) < 0; //Returns true if distance is smaller than 0
+	size_t pos = 0;
+	size_t size = size_t(GetNumber(delta, pos));
+	state.resize(size, 0); //Bytes past the end of the previous state were encoded against zero
+
+	size_t i = 0;
+	while (i < size && pos < delta.size())
+	{
+		i += size_t(GetNumber(delta, pos));
+		size_t changed = size_t(GetNumber(delta, pos));
+		for (size_t j = 0; j < changed && i < size && pos < delta.size(); j++) state[i++] ^= delta[pos++];
+	}
 }
 
-//Objects
-Object::Object(IMesh* mesh, float x, float y, float z, float r) //Constructor
+unsigned long long Hash(const char* data, size_t size) //FNV-1a hash, used to match replays to tracks and to compare simulation states
 {
-	m = mesh->CreateModel(x, y, z);
-	m->RotateLocalY(r);
+	unsigned long long h = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
 }
 
-Checkpoint::Checkpoint(IMesh* checkpointMesh, IMesh* crossMesh, float x, float y, float z, float r) //Constructor
+int ReplayCheckTool(string replayFile, int threads) //Play a replay through, then seek around it and check every seek ends in the same state, and play it again with the tick's tasks on more threads and on the simulation thread
 {
-	m = checkpointMesh->CreateModel(x, y, z);
-	m->RotateLocalY(r);
+	const int kSeeks = 8; //Seeks to evenly spaced points, each followed by simulating to the end
 
-	cross = crossMesh->CreateModel(x, -kCrossHeight, z); //Cross spawned underground so that it's invisible
-	cross->RotateLocalY(r);
-	cross->Scale(kCrossScale);
+	Replay replay;
+	if (!replay.Load(replayFile))
+	{
+		cout << "Could not read " << replayFile << endl;
+		return 1;
+	}
 
-	if (r != 0 && r != 180)
+	bool mapped;
+	shared_ptr <const TrackData> track = LoadTrackData(kLevelFile, kTrackFile, mapped);
+	if (!track)
+	{
+		cout << "Could not load " << kLevelFile << endl;
+		return 1;
+	}
+	if (track->hash != replay.trackHash)
 	{
-		check.Initialise(m->GetX(), m->GetZ(), kCheckpointWidth, kCheckpointLen - kCheckpointRad * 2.0f); //Increase Z by length if the checkpoint is not at an angle
-		checkWide.Initialise(m->GetX(), m->GetZ(), kCheckpointWidth, kCheckpointLen * 3.0f); //Wider version for the AI because they're stupid
+		cout << replayFile << " was recorded on a different track" << endl;
+		return 1;
 	}
-	else
+
+	//Same set up as the game, without the scenery
+	I3DEngine* engine = New3DEngine(kTLX);
+	Race race;
+	race.Build(engine, track, replay.carCount, true, replay.seed);
+
+	//Play through from the start, checking the race against every keyframe on the way
+	const float simStep = 1.0f / replay.simRate;
+	int mismatches = 0;
+	SimState keyframe;
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	for (size_t k = 0; k < replay.keyTick.size(); k++)
+	{
+		while (race.tick < replay.keyTick[k]) race.Tick(simStep, replay.Input(race.tick));
+
+		SimState state;
+		race.Serialize(state);
+		DecodeDelta(replay.keyframe[k], keyframe.data); //Each keyframe is the difference from the one before
+		if (state.data != keyframe.data) mismatches++;
+	}
+	while (race.tick < replay.Ticks()) race.Tick(simStep, replay.Input(race.tick));
+	double playTime = Milliseconds(start);
+
+	SimState end;
+	race.Serialize(end);
+	unsigned long long endHash = Hash(&end.data[0], end.data.size());
+
+	//Seek back to points through the race and play on to the end from each
+	double seekTime = 0.0;
+	int seekMismatches = 0;
+	for (int i = 0; i < kSeeks; i++)
+	{
+		long long tick = replay.Ticks() * (2 * i + 1) / (2 * kSeeks); //Not on keyframe ticks, so each seek has some simulating to do
+		start = chrono::high_resolution_clock::now();
+		replay.Seek(race, tick);
+		seekTime += Milliseconds(start);
+
+		replay.Seek(race, replay.Ticks());
+		SimState state;
+		race.Serialize(state);
+		if (Hash(&state.data[0], state.data.size()) != endHash) seekMismatches++;
+	}
+
+	//Play it through again with the tick's tasks spread across the threads and every car detected by its own task, which has to give the same race
+	ThreadPool pool(max(threads, 1));
+	race.pool = &pool;
+	race.carsPerTask = 1;
+	int threadMismatches = 0;
+	start = chrono::high_resolution_clock::now();
+	replay.Seek(race, 0);
+	for (size_t k = 0; k < replay.keyTick.size(); k++)
+	{
+		while (race.tick < replay.keyTick[k]) race.Tick(simStep, replay.Input(race.tick));
+
+		SimState state;
+		race.Serialize(state);
+		replay.Keyframe(int(k), keyframe);
+		if (Hash(&state.data[0], state.data.size()) != Hash(&keyframe.data[0], keyframe.data.size())) threadMismatches++;
+	}
+	while (race.tick < replay.Ticks()) race.Tick(simStep, replay.Input(race.tick));
+	double threadTime = Milliseconds(start);
+	SimState threadEnd;
+	race.Serialize(threadEnd);
+	if (Hash(&threadEnd.data[0], threadEnd.data.size()) != endHash) threadMismatches++;
+
+	//And once more with the race on a simulation thread, drawing its snapshots from this one as the game does. Every snapshot has to be whole and newer than the one before
+	race.pool = nullptr;
+	race.carsPerTask = kCarsPerTask;
+	replay.Seek(race, 0);
+	int snapshotMismatches = 0;
+	long long snapshotsDrawn = 0;
+	long long lastTick = -1;
+	start = chrono::high_resolution_clock::now();
 	{
-		check.Initialise(m->GetX(), m->GetZ(), kCheckpointLen - kCheckpointRad * 2.0f, kCheckpointWidth); //Increase X by length if the checkpoint is at an angle
-		checkWide.Initialise(m->GetX(), m->GetZ(), kCheckpointLen * 3.0f, kCheckpointWidth); //Wider for the AI
+		SimThread sim(&race, &replay, true, simStep);
+		auto draw = [&]()
+		{
+			const WorldSnapshot* snapshot = sim.snapshots.Acquire();
+			if (snapshot->tick != snapshot->commands || snapshot->tick < lastTick || int(snapshot->cars.size()) != race.numOfCars) snapshotMismatches++;
+			lastTick = snapshot->tick;
+			snapshotsDrawn++;
+			sim.snapshots.Release();
+		};
+
+		sim.Start(true);
+		for (long long t = 0; t < replay.Ticks(); t++)
+		{
+			sim.Push({ 0, 0 }); //Playback ticks use the replay's keys
+			draw();
+		}
+		while (sim.done.load() < replay.Ticks()) draw();
+		sim.Stop();
 	}
+	double simThreadTime = Milliseconds(start);
+	SimState simEnd;
+	race.Serialize(simEnd);
+	if (Hash(&simEnd.data[0], simEnd.data.size()) != endHash) snapshotMismatches++;
+
+	size_t keyframeBytes = 0;
+	for (size_t i = 0; i < replay.keyframe.size(); i++) keyframeBytes += replay.keyframe[i].size();
+
+	cout << replayFile << ": " << replay.Ticks() << " ticks (" << replay.Ticks() / replay.simRate << " s), " << replay.keyframe.size() << " keyframes of "
+		<< end.data.size() << " bytes stored in " << keyframeBytes / max(size_t(1), replay.keyframe.size()) << " bytes each on average" << endl;
+	cout << "Played through in " << playTime << " ms, keyframes " << (mismatches == 0 ? "match" : "DIFFER") << endl;
+	cout << "Average seek " << seekTime / kSeeks << " ms, seeks " << (seekMismatches == 0 ? "end in the same state" : "DIFFER") << endl;
+	cout << "Played through on " << pool.Threads() << " threads in " << threadTime << " ms, keyframe and end hashes " << (threadMismatches == 0 ? "match" : "DIFFER") << endl;
+	cout << "Played through on a simulation thread in " << simThreadTime << " ms, " << snapshotsDrawn << " snapshots drawn, snapshots and end hash " << (snapshotMismatches == 0 ? "match" : "DIFFER") << endl;
+
+	engine->Delete();
+	return mismatches == 0 && seekMismatches == 0 && threadMismatches == 0 && snapshotMismatches == 0 ? 0 : 1;
 }
 
-void Checkpoint::ShowCross() //Show a cross to signify that the checkpoint has been crossed
+//Simulation thread
+WorldSnapshot& SnapshotBuffer::Back() //Slot the simulation can fill, waits if the render thread is still drawing from it
 {
-	cross->SetLocalY(kCrossHeight);
-	timer = kCrossTime;
+	writing = 1 - max(published.load(), 0); //Never the latest, so the render thread always has a finished snapshot to draw
+	while (reading.load() == writing) this_thread::yield(); //Only while a frame's models are being moved, which is short
+	return slot[writing];
 }
 
-void Checkpoint::HideCross() //Hide the cross underground
+void SnapshotBuffer::Publish() //Make the slot Back returned the latest
 {
-	cross->SetLocalY(-kCrossHeight);
+	published.store(writing);
 }
 
-void Checkpoint::Update(float fTime) //Update cross timer and hide it when time runs out
+const WorldSnapshot* SnapshotBuffer::Acquire() //Latest snapshot, which isn't written to until Release, null before the first one
 {
-	if (timer > 0.0f)
+	//Claim the latest slot, then check it's still the latest. If it is, the simulation either saw the claim or is filling the other slot
+	int r;
+	do
 	{
-		timer -= fTime;
-		if (timer <= 0.0f) HideCross();
-	}
+		r = published.load();
+		if (r < 0) return nullptr;
+		reading.store(r);
+	} while (published.load() != r);
+	return &slot[r];
 }
 
-Bomb::Bomb(IMesh* bombMesh, IMesh* particleMesh, float x, float z, float r) //Constructor
+void SnapshotBuffer::Release() //Done drawing from the snapshot
 {
-	bomb = bombMesh->CreateModel(x, kBombYPos, z);
-	bomb->Scale(kBombScale);
-	bomb->RotateX(kBombXRot);
+	reading.store(-1);
+}
 
-	colSphere.push_back(BoundingSphere(x, z, kBombRadius));
-	explosionRange.push_back(BoundingSphere(x, z, kExplosionRadius));
-	explosionParticles.push_back(ExplosionEmitter(particleMesh, { x, kBombYPos, z }));
+SimThread::SimThread(Race* simRace, Replay* simReplay, bool play, float step) //Constructor
+{
+	race = simRace;
+	replay = simReplay;
+	playback = play;
+	simStep = step;
 }
 
-void Bomb::Trigger() //Trigger the explosion
+void SimThread::Start(bool threaded) //Publish the starting state, and hand the race to a thread of its own if threaded
 {
-	bomb->SetSkin(kExplosionSkin);
-	state = exploding;
-	eTime = kExplosionTime;
+	Publish();
+	if (!threaded) return;
+
+	worker = thread(&SimThread::Run, this);
 }
 
-void Bomb::Explosion() //Change state to inactive if explosion ended
+void SimThread::Push(SimCommand c) //Queue a command for the simulation thread, or carry it out straight away if there isn't one
 {
-	if (eTime < 0.0f)
+	long long n = pushed.load();
+	if (!worker.joinable())
 	{
-		state = inactive;
-		Deactivate();
+		Do(c);
+		pushed.store(n + 1);
+		done.store(n + 1);
+		Publish();
+		return;
 	}
+
+	while (n - done.load() >= kQueueSize) this_thread::yield(); //The simulation is a whole ring behind, wait for it so no tick is lost
+	queue[n % kQueueSize] = c;
+	pushed.store(n + 1);
 }
 
-void Bomb::Deactivate() //Hide the bomb and set a cooldown
+void SimThread::Stop() //Let the simulation thread finish the queue and wait for it
 {
-	bomb->SetY(-20.0f);
-	cd = kCooldown;
+	if (!worker.joinable()) return;
+	quit.store(true);
+	worker.join();
 }
 
-void Bomb::Reset() //Activate the bomb and put it in sight
+void SimThread::Run() //Loop of the simulation thread
 {
-	bomb->SetY(kBombYPos);
-	bomb->SetSkin(kDefSkin);
-	state = active;
+	int idle = 0; //Loops without a command, it sleeps once it has been idle for a while so it doesn't hold a core between frames
+	while (true)
+	{
+		long long next = done.load();
+		if (next == pushed.load())
+		{
+			if (quit.load() && next == pushed.load()) break; //Pushed is read again, anything pushed before quit was set has to be done first
+			if (++idle < kSimSpins) this_thread::yield();
+			else this_thread::sleep_for(chrono::microseconds(kSimSleep));
+			continue;
+		}
+		idle = 0;
+
+		Do(queue[next % kQueueSize]);
+		done.store(next + 1);
+		if (next + 1 == pushed.load()) Publish(); //Only the latest state is worth drawing
+	}
 }
 
-void Bomb::Update(float fTime, ICamera* camera) //Update timers and explosion particles
+void SimThread::Do(SimCommand c) //Seek or run a tick
 {
-	if (state == exploding)
+	PROFILE_SCOPE("Tick");
+	if (c.seek != 0)
 	{
-		explosionParticles[0].Update(fTime, &camera, 1);
-		eTime -= fTime;
-		Explosion();
+		replay->Seek(*race, race->tick + c.seek);
+		return;
 	}
-	else explosionParticles[0].Update(fTime, &camera, 0);
 
-	if (state == inactive)
+	PlayerInput input;
+	input.Unpack(c.keys);
+	if (!playback)
 	{
-		cd -= fTime;
-		if (cd < 0.0f) Reset();
+		replay->Record(*race, input); //Keep the keys this tick uses
+		race->Tick(simStep, input);
 	}
+	else if (race->tick < replay->Ticks()) race->Tick(simStep, replay->Input(race->tick)); //Play the recorded keys until they run out
 }
 
-
-//Particles
-void Particle::CreateParticle(IMesh* particleMesh, string skin, Vector3D particleOrigin, float originRadius, Vector3D startVelocity, float minLifetime, float maxLifetime, float minVelocity,
-	ParticleType pType, float pAngle) //Create a new particle model and set its skin and variables
+void SimThread::Publish() //Snapshot the race for the render thread
 {
-	particle = particleMesh->CreateModel();
-	particle->SetSkin(skin);
-
-	origin = particleOrigin;
-	radius = originRadius;
-
-	sv = startVelocity;
-	angle = pAngle;
+	PROFILE_SCOPE("Snapshot");
+	WorldSnapshot &snapshot = snapshots.Back();
+	race->Capture(snapshot);
+	snapshot.commands = done.load();
+	snapshots.Publish();
+}
 
-	maxLife = maxLifetime;
-	minLife = minLifetime;
-	minVel = pow(minVelocity, 2);
+//Batch simulation
+bool WorkQueue::Pop(int &task, bool back) //Take a task from either end, false if the queue is empty
+{
+	lock_guard <mutex> guard(lock);
+	if (tasks.empty()) return false;
 
-	Spawn();
+	if (back)
+	{
+		task = tasks.back();
+		tasks.pop_back();
+	}
+	else
+	{
+		task = tasks.front();
+		tasks.pop_front();
+	}
+	return true;
 }
 
-float Particle::RandomAngle(float angle) //Generate a random angle within a specified range
+void WorkQueue::Push(int task) //Add a task to the front, where the worker takes its next one from
 {
-	return (rand() % int(angle * 2000)) / 1000.0f - angle;
+	lock_guard <mutex> guard(lock);
+	tasks.push_front(task);
 }
 
-void Particle::Spawn(Vector2D momentum) //Reset a particle's position and velocity
+void RunParallel(int taskCount, int threadCount, function <void(int)> task) //Run tasks 0 to taskCount - 1 on a pool of threads that steal work from each other
 {
-	float distFromOrigin = float((rand() % int(radius * 100.0f)) / 100.0f); //Random distance from origin
+	if (threadCount > taskCount) threadCount = taskCount;
+	if (threadCount < 1) return;
 
-	Vector3D pPos = { origin.x + distFromOrigin * float(cos(rand())), origin.y, origin.z + distFromOrigin * float(cos(rand())) };
-	particle->SetPosition(pPos.x, pPos.y, pPos.z);
+	//Each worker starts with an even block of the tasks, so neighbouring tasks usually run on the same thread
+	vector <WorkQueue> queues(threadCount);
+	for (int i = 0; i < taskCount; i++) queues[int((long long)i * threadCount / taskCount)].tasks.push_back(i);
 
-	if (type == fire) totalLife = float(rand() % (int((maxLife - minLife) * 1000)) / 1000.0f) * (radius / distFromOrigin); //Gives fire a triangle shape
-	else totalLife = float(rand() % (int((maxLife - minLife) * 1000)) / 1000.0f);
-	life = 0.0f;
+	auto worker = [&](int w)
+	{
+		int t;
+		while (true)
+		{
+			bool found = queues[w].Pop(t, false);
+			for (int i = 1; !found && i < threadCount; i++) found = queues[(w + i) % threadCount].Pop(t, true); //Steal from the far end of another worker's queue
+			if (!found) return; //Nothing is added once the pool starts, so empty queues mean the work is done
+
+			task(t);
+		}
+	};
 
-	v = sv + sv * Vector3D{ momentum.x, 0.0f, momentum.z };
+	vector <thread> workers;
+	for (int w = 1; w < threadCount; w++) workers.push_back(thread(worker, w));
+	worker(0); //The calling thread works too
+	for (size_t w = 0; w < workers.size(); w++) workers[w].join();
+}
 
-	if (angle != 0)
+ThreadPool::ThreadPool(int threadCount) //Start threadCount - 1 workers, the thread calling Run is the last one
+{
+	next = 0;
+	for (int w = 1; w < threadCount; w++) workers.push_back(thread(&ThreadPool::Work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
 	{
-		v.x += RandomAngle(angle);
-		v.z += RandomAngle(angle);
+		lock_guard <mutex> guard(lock);
+		quit = true;
 	}
+	wake.notify_all();
+	for (size_t w = 0; w < workers.size(); w++) workers[w].join();
 }
 
-void Particle::Update(float fTime, Vector3D acceleration, Vector3D partOrigin, ICamera* *camera, bool isActive, Vector2D momentum, Vector3D newStartingVelocity) //Update orientation and velocity, 
-																																								//move and respawn after death
+void ThreadPool::Run(int taskCount, function <void(int)> task) //Run tasks 0 to taskCount - 1 on every thread of the pool, returns once they're all done
 {
-	//Turn to camera
-	particle->LookAt(*camera);
-
-	//Update velocity
-	v = v + acceleration * fTime;
+	if (workers.empty() || taskCount < 2) //Not worth waking anyone
+	{
+		for (int t = 0; t < taskCount; t++) task(t);
+		return;
+	}
 
-	//Update origin
-	origin = partOrigin;
+	{
+		lock_guard <mutex> guard(lock);
+		job = task;
+		jobTasks = taskCount;
+		next = 0;
+		working = int(workers.size());
+		generation++;
+	}
+	wake.notify_all();
+	Take(); //The calling thread works too
 
-	//Move the particle according to velocity
-	if (particle->GetY() > 0.0f) particle->Move(v.x * fTime, v.y * fTime, v.z * fTime); //If not hidden (dead) keep moving
+	unique_lock <mutex> guard(lock);
+	done.wait(guard, [this] { return working == 0; });
+}
 
-	//Update life and kill the particle
-	life += fTime;
-	if (life > totalLife || v.Length() <= minVel)
+void ThreadPool::Work() //Loop of each worker
+{
+	long long seen = 0;
+	while (true)
 	{
-		if (isActive)
 		{
-			Spawn(momentum);
-			if (newStartingVelocity.Length() > 0.0f) sv = newStartingVelocity;
+			unique_lock <mutex> guard(lock);
+			wake.wait(guard, [&] { return quit || generation != seen; });
+			if (quit) return;
+			seen = generation;
 		}
-		else particle->MoveY(-100.0f); //If particles aren't actively spawned, hide from sight
+
+		Take();
+
+		lock_guard <mutex> guard(lock);
+		if (--working == 0) done.notify_one();
 	}
 }
 
-//Emitters
-ExplosionEmitter::ExplosionEmitter(IMesh* explosionMesh, Vector3D emitterOrigin, float explosionRadius, float velocityRatio) //Constructor
+void ThreadPool::Take() //Run tasks of the current job until there are none left
 {
-	radius = explosionRadius;
-	velRatio = velocityRatio;
-
-	eMesh = explosionMesh;
-	origin = emitterOrigin;
+	for (int t = next++; t < jobTasks; t = next++) job(t);
 }
 
-void ExplosionEmitter::NewParticle() //Add a new particle to to the array of particles
+//Task graph
+void TaskGraph::Clear() //Remove every task
 {
-	int skinIndex = rand() % explosionSkin.size();
-
-	sVelocity = NewSV();
-
-	particle[particleIndex].CreateParticle(eMesh, explosionSkin[skinIndex], { origin.x, kParticleHeight, origin.z }, radius, sVelocity, kMinLife, kMaxLife, kMinVel, explosion);
-	particleIndex++;
+	tasks.clear();
+	pending.reset();
 }
 
-Vector3D ExplosionEmitter::NewSV() //Generate a random starting vector so that the explosion particles can shoot in any direction
+int TaskGraph::Add(const char* name, function <void()> run, vector <int> after) //Add a task that runs once the given ones are done, returns its number
 {
-	//Create a randomised vector
-	int range = 100;
-	Vector3D v = { float(rand() % range) - float(range / 2), float(rand() % range), float(rand() % range) - float(range / 2) };
+	int t = int(tasks.size());
+	for (size_t i = 0; i < after.size(); i++) tasks[after[i]].next.push_back(t); //Only earlier tasks, so the graph can't have a cycle
 
-	//Normalise, multiply by speed and return
-	return v.Normal() * kStartSpeed;
+	GraphTask task;
+	task.name = name;
+	task.run = run;
+	task.after = after;
+	tasks.push_back(task);
+
+	pending.reset(new atomic <int>[tasks.size()]);
+	return t;
 }
 
-void ExplosionEmitter::Update(float fTime, ICamera* *camera, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
+void TaskGraph::Run(ThreadPool* pool) //Run every task once, on the pool's threads if there is one
 {
-	//Time
-	timer += fTime;
+	if (timing) runs++;
 
-	//Add new particles if limit hasn't been reached
-	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	int threads = pool ? pool->Threads() : 1;
+	if (threads == 1) //The order they were added in already has every task after the ones it depends on
 	{
-		NewParticle();
-		timer = 0.0f;
+		for (size_t t = 0; t < tasks.size(); t++) Execute(int(t));
+		return;
 	}
 
-	//Update existing particles
-	if (particleIndex > 0) for (int i = 0; i < particleIndex; i++)
+	if (int(queues.size()) != threads) queues = vector <WorkQueue>(threads);
+	for (size_t t = 0; t < tasks.size(); t++) pending[t] = int(tasks[t].after.size());
+	left = int(tasks.size());
+	queued = 0;
+	for (int t = int(tasks.size()) - 1; t >= 0; t--) if (tasks[t].after.empty()) Ready(0, t); //Backwards, so the first one is at the front
+
+	pool->Run(threads, [this](int w) { Work(w); });
+}
+
+void TaskGraph::Work(int w) //Loop of each thread, w is its queue
+{
+	int threads = int(queues.size());
+	while (left > 0)
 	{
-		Vector3D velChange = particle[i].v * kAcceleration;
-		particle[i].Update(fTime, velChange, { origin.x, kParticleHeight, origin.z }, camera, isActive, momentum, NewSV());
+		int t;
+		bool found = queues[w].Pop(t, false);
+		for (int i = 1; !found && i < threads; i++) found = queues[(w + i) % threads].Pop(t, true); //Steal from the far end of another thread's queue
+		if (!found) //Everything ready is being run, park instead of spinning on a core the busy threads could use
+		{
+			unique_lock <mutex> guard(parkLock);
+			parked++;
+			wake.wait(guard, [this] { return queued > 0 || left == 0; });
+			parked--;
+			continue;
+		}
+
+		queued--;
+		Execute(t);
+		for (size_t i = 0; i < tasks[t].next.size(); i++) if (--pending[tasks[t].next[i]] == 0) Ready(w, tasks[t].next[i]); //This thread takes the tasks it freed up next
+		if (--left == 0) Wake(true); //Let the parked threads leave the run
 	}
 }
 
-void ExplosionEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
+void TaskGraph::Ready(int w, int t) //Queue a task whose dependencies have all finished, waking a parked thread for it
 {
-	//Set origin to a new one
-	origin = particleOrigin;
+	queues[w].Push(t);
+	queued++;
+	Wake(false);
 }
 
-SmokeEmitter::SmokeEmitter(IMesh* fireMesh, Vector3D emitterOrigin, float smokeRadius, float velocityRatio) //Constructor
+void TaskGraph::Wake(bool all) //Wake one or every parked thread, if there are any
 {
-	radius = smokeRadius;
-	velRatio = velocityRatio;
-
-	sMesh = fireMesh;
-	origin = emitterOrigin;
+	if (parked == 0) return; //A thread about to park checks queued and left after counting itself, so it can't miss the change made before this
+	lock_guard <mutex> guard(parkLock);
+	if (all) wake.notify_all();
+	else wake.notify_one();
 }
 
-void SmokeEmitter::NewParticle() //Add a new particle to to the array of particles
+void TaskGraph::Execute(int t) //Run a task, timing it if asked to
 {
-	int skinIndex = rand() % smokeSkin.size();
+	GraphTask &task = tasks[t];
+	PROFILE_SCOPE(task.name);
 
-	particle[particleIndex].CreateParticle(sMesh, smokeSkin[skinIndex], origin, radius, { sVelocity.x, sVelocity.y * velRatio, sVelocity.z }, kMinLife, kMaxLife, kMinVel, smoke, kAngle);
-	particleIndex++;
+	if (timing)
+	{
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		task.run();
+		task.time += Milliseconds(start);
+	}
+	else task.run();
 }
 
-void SmokeEmitter::Update(float fTime, ICamera* *camera, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
+double TaskGraph::CriticalPath(vector <char> &onPath) const //Longest chain of tasks by their average times in milliseconds, marking the tasks on it
 {
-	//Time
-	timer += fTime;
-
-	//Add new particles if limit hasn't been reached
-	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	//Tasks come after the ones they depend on, so one pass finds when each would finish with unlimited threads
+	vector <double> finish(tasks.size());
+	vector <int> from(tasks.size(), -1); //Dependency that finishes last
+	int last = -1;
+	for (size_t t = 0; t < tasks.size(); t++)
 	{
-		NewParticle();
-		timer = 0.0f;
+		double ready = 0.0;
+		for (size_t i = 0; i < tasks[t].after.size(); i++) if (finish[tasks[t].after[i]] > ready)
+		{
+			ready = finish[tasks[t].after[i]];
+			from[t] = tasks[t].after[i];
+		}
+		finish[t] = ready + tasks[t].time / max(runs, 1LL);
+		if (last < 0 || finish[t] > finish[last]) last = int(t);
 	}
 
-	//Update existing particles
-	Vector3D velChange = kAcceleration;
+	onPath.assign(tasks.size(), 0);
+	for (int t = last; t >= 0; t = from[t]) onPath[t] = 1;
+	return last < 0 ? 0.0 : finish[last];
+}
 
-	if (particleIndex > 0) for (int i = 0; i < particleIndex; i++)
+#ifdef HEADLESS
+int BatchTool(int argc, char* argv[]) //Run many races with only computer controlled cars across all cores and write the results to a CSV file
+{
+	//Options
+	int races = 100;
+	int carCount = kMaxCars;
+	unsigned int seed = 1; //Race i is seeded with seed + i, so any race can be run again on its own
+	int threads = int(thread::hardware_concurrency());
+	float simRate = kSimRate; //Coarser ticks run the races faster
+	string outFile = kBatchFile;
+#ifdef PROFILING
+	string traceFile = kTraceFile;
+#endif
+	for (int i = 1; i + 1 < argc; i += 2)
 	{
-		particle[i].Update(fTime, velChange, origin, camera, isActive, momentum);
+		string option = argv[i];
+		if (option == "-batch") races = atoi(argv[i + 1]);
+		else if (option == "-cars") carCount = atoi(argv[i + 1]);
+		else if (option == "-seed") seed = (unsigned int)atoll(argv[i + 1]);
+		else if (option == "-threads") threads = atoi(argv[i + 1]);
+		else if (option == "-rate") simRate = float(atof(argv[i + 1]));
+		else if (option == "-out") outFile = argv[i + 1];
+#ifdef PROFILING
+		else if (option == "-trace") traceFile = argv[i + 1];
+#endif
+	}
+	if (races < 1) races = 1;
+	carCount = min(max(carCount, 1), kMaxRaceCars);
+	if (threads < 1) threads = 1;
+	if (simRate <= 0.0f) simRate = kSimRate;
+
+	//The track is loaded once and only read by the races
+	bool mapped;
+	shared_ptr <const TrackData> track = LoadTrackData(kLevelFile, kTrackFile, mapped);
+	if (!track)
+	{
+		cout << "Could not load " << kLevelFile << endl;
+		return 1;
 	}
-}
 
-void SmokeEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
-{
-	//Set origin to a new one
-	origin = particleOrigin;
-}
+	//Every race writes its own rows, so the file is in race order whichever thread ran each one
+	vector <string> rows(races);
+	const float simStep = 1.0f / simRate;
+	const long long tickLimit = (long long)(kBatchTimeLimit * simRate);
 
-FireEmitter::FireEmitter(IMesh* fireMesh, Vector3D emitterOrigin, float fireRadius, float velocityRatio) //Constructor
-{
-	radius = fireRadius;
-	velRatio = velocityRatio;
+	chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+	RunParallel(races, threads, [&](int r)
+	{
+		PROFILE_SCOPE("Race");
 
-	fMesh = fireMesh;
-	origin = emitterOrigin;
-}
+		//Each race has its own engine, which holds nothing but the scene, so races don't share any state
+		I3DEngine* engine = New3DEngine(kTLX);
+		Race race;
+		race.Build(engine, track, carCount, false, seed + r);
 
-void FireEmitter::NewParticle() //Add a new particle to to the array of particles
-{
-	int skinIndex = rand() % fireSkin.size();
+		PlayerInput input;
+		input.startHit = true; //Start the countdown straight away
+		while (!race.Finished() && race.tick < tickLimit)
+		{
+			race.Tick(simStep, input);
+			input.ClearHits();
+		}
 
-	particle[particleIndex].CreateParticle(fMesh, fireSkin[skinIndex], origin, radius, { sVelocity.x, sVelocity.y * velRatio, sVelocity.z }, kMinLife, kMaxLife, kMinVel, fire);
-	particleIndex++;
-}
+		stringstream out;
+		race.WriteResults(out, r, seed + r);
+		rows[r] = out.str();
 
-void FireEmitter::NewParticle2() //Add a new particle to to the second array of particles
-{
-	int skinIndex = rand() % fire2Skin.size();
+		engine->Delete();
+	});
+	double runTime = Milliseconds(start);
 
-	particle2[particleIndex2].CreateParticle(fMesh, fire2Skin[skinIndex], origin, radius, { sVelocity2.x, sVelocity2.y * velRatio, sVelocity2.z }, kMinLife2, kMaxLife2, kMinVel2, fire);
-	particleIndex2++;
+	ofstream file(outFile);
+	if (!file)
+	{
+		cout << "Could not write " << outFile << endl;
+		return 1;
+	}
+	file << "race,seed,car,place,finished,time";
+	for (int i = 1; i <= kLaps; i++) file << ",lap" << i;
+	file << ",collisions,died,hp\n";
+	for (int i = 0; i < races; i++) file << rows[i];
+
+	cout << races << " races of " << carCount << " cars on " << min(threads, races) << " threads in " << runTime << " ms (" << races / (runTime / 1000.0) << " races per second), results in " << outFile << endl;
+#ifdef PROFILING
+	if (WriteChromeTrace(traceFile)) cout << "Profile written to " << traceFile << endl; //Each worker thread gets its own row
+#endif
+
+	return 0;
 }
 
-void FireEmitter::Update(float fTime, ICamera* *camera, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
+int AIBenchTool(int carCount, int ticks) //Times the batched AI steering and movement against the one car at a time functions and checks both drive the cars the same way
 {
-	//Time
-	timer += fTime;
-	timer2 += fTime;
+	const float kTolerance = 0.001f; //Largest difference allowed in any position, momentum, rotation or goal
+	carCount = min(max(carCount, 1), kMaxRaceCars);
+	if (ticks < 1) ticks = 1;
 
-	//Add new particles if limit hasn't been reached
-	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+	bool mapped;
+	shared_ptr <const TrackData> track = LoadTrackData(kLevelFile, kTrackFile, mapped);
+	if (!track)
 	{
-		NewParticle();
-		timer = 0.0f;
+		cout << "Could not load " << kLevelFile << endl;
+		return 1;
 	}
-	if (isActive && particleIndex2 < kMaxParticles2 - 1 && timer2 > kFrequency)
+
+	//Two copies of the same race with only computer controlled cars, already past the countdown
+	I3DEngine* engine[2];
+	Race race[2];
+	for (int k = 0; k < 2; k++)
 	{
-		NewParticle2();
-		timer2 = 0.0f;
+		engine[k] = New3DEngine(kTLX);
+		race[k].Build(engine[k], track, carCount, false, 1);
+		race[k].gameState = race[k].raceState = GameState::race;
 	}
 
-	//Update existing particles
-	Vector3D velChange = kGravity;
+	//Only steering and movement are timed, the rest of the tick is left out so nothing else moves the cars
+	const float simStep = 1.0f / kSimRate;
+	double time[2] = { 0.0, 0.0 };
+	for (int t = 0; t < ticks; t++) for (int k = 0; k < 2; k++)
+	{
+		vector <HoverCar> &cars = race[k].cars;
+		for (int i = 0; i < carCount; i++) cars[i].BeginTick(simStep);
+		race[k].Rank();
+
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		if (k == 0)
+		{
+			for (int i = 0; i < carCount; i++) cars[i].AIFollowPath();
+			for (int i = 0; i < carCount; i++)
+			{
+				cars[i].ResetCollision();
+				cars[i].Move();
+			}
+		}
+		else
+		{
+			race[k].carBatch.Steer(cars, carCount, false, simStep);
+			for (int i = 0; i < carCount; i++) cars[i].ResetCollision();
+			race[k].carBatch.Move(cars, carCount, simStep);
+		}
+		time[k] += Milliseconds(start);
+
+		for (int i = 0; i < carCount; i++) cars[i].fVector = FacingVector(cars[i].yaw); //The part of the car update the next tick's thrust needs
+	}
+
+	float maxDiff = 0.0f;
+	for (int i = 0; i < carCount; i++)
+	{
+		const HoverCar &a = race[0].cars[i];
+		const HoverCar &b = race[1].cars[i];
+		float diff[] = { a.pos.x - b.pos.x, a.pos.z - b.pos.z, a.momentum.x - b.momentum.x, a.momentum.z - b.momentum.z, a.yaw - b.yaw, a.boostMult - b.boostMult, a.goalDist - b.goalDist };
+		for (size_t j = 0; j < sizeof(diff) / sizeof(diff[0]); j++) maxDiff = max(maxDiff, fabs(diff[j]));
+		if (a.goalSample != b.goalSample) maxDiff = max(maxDiff, 1.0f); //A goal on a different sample is always a mismatch
+	}
+
+	cout << carCount << " cars x " << ticks << " ticks" << endl;
+	cout << "One car at a time: " << time[0] * 1000000.0 / (double(carCount) * ticks) << " ns per car per tick" << endl;
+	cout << "Batched arrays:    " << time[1] * 1000000.0 / (double(carCount) * ticks) << " ns per car per tick" << endl;
+	cout << "Largest difference " << maxDiff << (maxDiff <= kTolerance ? ", within " : ", MORE than ") << kTolerance << endl;
+
+	for (int k = 0; k < 2; k++) engine[k]->Delete();
+	return maxDiff <= kTolerance ? 0 : 1;
+}
 
-	if (particleIndex > 0) for (int i = 0; i < particleIndex; i++)
+int TickBenchTool(int carCount, int ticks, int maxThreads) //Times every task of the tick and the critical path through them, then the whole tick on 1 to maxThreads threads, checking each gives the same race
+{
+	carCount = min(max(carCount, 1), kMaxRaceCars);
+	if (ticks < 1) ticks = 1;
+	if (maxThreads < 1) maxThreads = 1;
+
+	bool mapped;
+	shared_ptr <const TrackData> track = LoadTrackData(kLevelFile, kTrackFile, mapped);
+	if (!track)
 	{
-		particle[i].Update(fTime, velChange, origin, camera, isActive, momentum);
+		cout << "Could not load " << kLevelFile << endl;
+		return 1;
 	}
-	if (particleIndex2 > 0) for (int i = 0; i < particleIndex2; i++)
+
+	//The same race with only computer controlled cars on 1, 2, 4... threads
+	const float simStep = 1.0f / kSimRate;
+	double oneThread = 0.0; //Milliseconds per tick on one thread
+	unsigned long long firstHash = 0;
+	int mismatches = 0;
+	cout << carCount << " cars x " << ticks << " ticks" << endl;
+	for (int threads = 1; ; threads = min(threads * 2, maxThreads))
 	{
-		particle2[i].Update(fTime, velChange, origin, camera, isActive, momentum);
+		I3DEngine* engine = New3DEngine(kTLX);
+		Race race;
+		race.Build(engine, track, carCount, false, 1);
+		ThreadPool pool(threads);
+		race.pool = &pool;
+		race.graph.timing = true; //Every run pays for the timing, so the runs compare fairly
+
+		PlayerInput input;
+		input.startHit = true; //Start the countdown straight away
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for (int t = 0; t < ticks; t++)
+		{
+			race.Tick(simStep, input);
+			input.ClearHits();
+		}
+		double tickTime = Milliseconds(start) / ticks;
+
+		SimState state;
+		race.Serialize(state);
+		unsigned long long hash = Hash(&state.data[0], state.data.size());
+		if (threads == 1) firstHash = hash;
+		else if (hash != firstHash) mismatches++;
+
+		//Each task's average time on one thread, with the ones on the critical path starred. With unlimited threads a tick can't take less than that path
+		if (threads == 1)
+		{
+			const TaskGraph &graph = race.graph;
+			vector <char> onPath;
+			double path = graph.CriticalPath(onPath);
+			double work = 0.0;
+			for (size_t t = 0; t < graph.tasks.size(); t++) work += graph.tasks[t].time / graph.runs;
+
+			for (size_t t = 0; t < graph.tasks.size(); t++)
+			{
+				double average = graph.tasks[t].time / graph.runs;
+				cout << (onPath[t] ? " * " : "   ") << left << setw(16) << graph.tasks[t].name << right << setw(10) << fixed << setprecision(2) << average * 1000.0 << " us"
+					<< setw(7) << setprecision(1) << average * 100.0 / work << "%" << endl;
+			}
+			cout.unsetf(ios::floatfield);
+			cout << setprecision(6) << "Work " << work * 1000.0 << " us per tick, critical path " << path * 1000.0 << " us, so at most " << work / path << " times faster on any number of threads" << endl;
+			oneThread = tickTime;
+		}
+		cout << threads << (threads == 1 ? " thread:  " : " threads: ") << tickTime * 1000.0 << " us per tick, " << oneThread / tickTime << " times as fast as one thread, race "
+			<< (hash == firstHash ? "the same" : "DIFFERS") << endl;
+
+		engine->Delete();
+		if (threads == maxThreads) break;
 	}
+
+	cout << "Tasks run on " << thread::hardware_concurrency() << " hardware threads" << endl;
+	return mismatches == 0 ? 0 : 1;
 }
 
-void FireEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
+int RandomBenchTool(int count, int rounds) //Times filling count random numbers at once against drawing them one at a time and checks both give the same numbers
 {
-	//Set origin to a new one
-	origin = particleOrigin;
+	if (count < 1) count = 1;
+	if (rounds < 1) rounds = 1;
+
+	//Two copies of the same stream, the sums keep the compiler from dropping the work
+	RandomStream random[2] = { RandomStream(1, streamTools, 0), RandomStream(1, streamTools, 0) };
+	vector <float> numbers[2] = { vector <float>(count), vector <float>(count) };
+	double sum[2] = { 0.0, 0.0 };
+	double time[2] = { 0.0, 0.0 };
+	int mismatches = 0;
+	for (int r = 0; r < rounds; r++)
+	{
+		chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; i++) numbers[0][i] = random[0].Float();
+		time[0] += Milliseconds(start);
+
+		start = chrono::high_resolution_clock::now();
+		random[1].Fill(&numbers[1][0], count);
+		time[1] += Milliseconds(start);
+
+		for (int i = 0; i < count; i++)
+		{
+			sum[0] += numbers[0][i];
+			sum[1] += numbers[1][i];
+			if (numbers[0][i] != numbers[1][i]) mismatches++;
+		}
+	}
+
+	cout << rounds << " rounds of " << count << " numbers, averaging " << sum[0] / (double(count) * rounds) << endl;
+	cout << "One at a time: " << time[0] * 1000000.0 / (double(count) * rounds) << " ns per number" << endl;
+	cout << "Filled:        " << time[1] * 1000000.0 / (double(count) * rounds) << " ns per number" << endl;
+	cout << (mismatches == 0 && random[0].counter == random[1].counter ? "Both give the same numbers" : "Numbers DIFFER") << endl;
+	return mismatches == 0 && random[0].counter == random[1].counter ? 0 : 1;
 }
+#endif
 
-ExhaustEmitter::ExhaustEmitter(IMesh* exhaustMesh, Vector3D emitterOrigin, float exhaustRadius, float velocityRatio) //Constructor
+bool FileNewer(string file, string than) //True if the first file was modified after the second one
 {
-	radius = exhaustRadius;
-	velRatio = velocityRatio;
+	struct stat fileInfo;
+	struct stat thanInfo;
+	if (stat(file.c_str(), &fileInfo) != 0 || stat(than.c_str(), &thanInfo) != 0) return false;
+	return fileInfo.st_mtime > thanInfo.st_mtime;
+}
 
-	eMesh = exhaustMesh;
-	origin = emitterOrigin;
+double Milliseconds(chrono::high_resolution_clock::time_point start) //Time passed since a given point
+{
+	return chrono::duration <double, milli>(chrono::high_resolution_clock::now() - start).count();
 }
 
-void ExhaustEmitter::NewParticle() //Add a new particle to to the array of particles
+#ifdef PROFILING
+//Profiling
+ProfileScope::ProfileScope(const char* scopeName)
 {
-	int skinIndex = rand() % exhaustSkin.size();
+	buffer = ThreadProfile();
+	name = scopeName;
+	buffer->depth++;
+	start = ProfileNow();
+}
 
-	particle[particleIndex].CreateParticle(eMesh, exhaustSkin[skinIndex], origin, radius, { sVelocity.x, sVelocity.y * velRatio, sVelocity.z }, kMinLife, kMaxLife, kMinVel, exhaust, kAngle);
-	particleIndex++;
+ProfileScope::~ProfileScope()
+{
+	long long end = ProfileNow();
+	buffer->depth--;
+	buffer->events[buffer->count % ProfileBuffer::kSize] = { name, start, end, buffer->depth };
+	buffer->count++;
 }
 
-void ExhaustEmitter::Update(float fTime, ICamera* *camera, bool isActive, Vector2D momentum) //Spawn more particles and update the existing ones
+long long ProfileNow() //Nanoseconds since the program started
 {
-	//Time
-	timer += fTime;
-	timer2 += fTime;
+	static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+	return chrono::duration_cast <chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+}
 
-	//Add new particles if limit hasn't been reached
-	if (isActive && particleIndex < kMaxParticles - 1 && timer > kFrequency)
+ProfileBuffer* ThreadProfile() //The calling thread's buffer, made the first time it times something
+{
+	if (!threadProfile)
 	{
-		NewParticle();
-		timer = 0.0f;
+		lock_guard <mutex> guard(profileLock);
+		profileBuffers.push_back(unique_ptr <ProfileBuffer>(new ProfileBuffer));
+		threadProfile = profileBuffers.back().get();
+		threadProfile->thread = int(profileBuffers.size());
 	}
+	return threadProfile;
+}
 
-	//Update existing particles
-	Vector3D velChange = kGravity;
-
-	if (particleIndex > 0) for (int i = 0; i < particleIndex; i++)
+bool WriteChromeTrace(string file) //Write every buffered scope in the Chrome trace format, to be opened in chrome://tracing or ui.perfetto.dev
+{
+	ofstream out(file);
+	if (!out) return false;
+	out << fixed << setprecision(3); //Times are in microseconds
+
+	lock_guard <mutex> guard(profileLock);
+	out << "{\"traceEvents\":[";
+	bool first = true;
+	for (size_t i = 0; i < profileBuffers.size(); i++)
 	{
-		particle[i].Update(fTime, velChange, origin, camera, isActive, momentum);
+		const ProfileBuffer &buffer = *profileBuffers[i];
+		unsigned long long oldest = buffer.count > ProfileBuffer::kSize ? buffer.count - ProfileBuffer::kSize : 0; //Anything before this was overwritten
+		for (unsigned long long j = oldest; j < buffer.count; j++)
+		{
+			const ProfileEvent &e = buffer.events[j % ProfileBuffer::kSize];
+			out << (first ? "\n" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer.thread
+				<< ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << (e.end - e.start) / 1000.0 << "}";
+			first = false;
+		}
 	}
+	out << "\n],\"displayTimeUnit\":\"ms\"}" << endl;
+	return bool(out);
 }
 
-void ExhaustEmitter::UpdateOrigin(Vector3D particleOrigin) //Change origin position if it had moved
+ProfileSummary::ProfileSummary(I3DEngine* e)
 {
-	//Set origin to a new one
-	origin = particleOrigin;
+	font = e->LoadFont(kFont, kFontSize);
 }
 
-//Conversion
-Time GetTime(float seconds)//Given a number of seconds return time in hours, minutes and seconds
+void ProfileSummary::Update(float frameTime) //Recount the calling thread's scopes every kRefresh seconds and draw the result
 {
-	int s = int(floor(seconds));
-	int ms = int((seconds - s) * 100);
-	if (s > 0)
+	timer += frameTime;
+	if (timer >= kRefresh)
 	{
-		int m = s / 60;
-		return { m, s % 60, ms };
+		timer = 0.0f;
+
+		//Total time of each scope, told apart by name and depth, over the window
+		struct Total
+		{
+			const char* name;
+			int depth;
+			long long first; //Earliest start, so scopes are listed in the order they run with nested ones under their parents
+			long long time;
+		};
+		vector <Total> totals;
+		int frames = 0; //Outermost scopes, one per frame when the main loop is timed
+
+		//Only whole frames are counted, from the first one to start inside the window to the last one to end
+		const ProfileBuffer &buffer = *ThreadProfile();
+		long long windowStart = ProfileNow() - kWindow;
+		long long from = -1;
+		long long to = -1;
+		unsigned long long oldest = buffer.count > ProfileBuffer::kSize ? buffer.count - ProfileBuffer::kSize : 0;
+		if (oldest > 0) windowStart = max(windowStart, buffer.events[oldest % ProfileBuffer::kSize].end); //Earlier scopes may have been overwritten
+		for (unsigned long long i = buffer.count; i > oldest; i--)
+		{
+			const ProfileEvent &e = buffer.events[(i - 1) % ProfileBuffer::kSize];
+			if (e.end < windowStart) break;
+			if (e.depth == 0 && e.start >= windowStart)
+			{
+				if (to < 0) to = e.end;
+				from = e.start;
+				frames++;
+			}
+		}
+
+		for (unsigned long long i = buffer.count; i > oldest && frames > 0; i--)
+		{
+			const ProfileEvent &e = buffer.events[(i - 1) % ProfileBuffer::kSize];
+			if (e.end < from) break;
+			if (e.start < from || e.end > to) continue;
+
+			size_t j = 0;
+			while (j < totals.size() && (totals[j].name != e.name || totals[j].depth != e.depth)) j++;
+			if (j == totals.size()) totals.push_back({ e.name, e.depth, e.start, 0 });
+			totals[j].first = e.start;
+			totals[j].time += e.end - e.start;
+		}
+		sort(totals.begin(), totals.end(), [](const Total &a, const Total &b) { return a.first < b.first; });
+
+		lines.clear();
+		for (size_t i = 0; i < totals.size(); i++)
+		{
+			stringstream line;
+			line << string(totals[i].depth * 2, ' ') << totals[i].name << " " << fixed << setprecision(3) << totals[i].time / 1000000.0 / max(frames, 1) << " ms";
+			lines.push_back(line.str());
+		}
 	}
-	else return { 0, 0, ms };
-}
 
-Vector2D GetCoord(float x, float z) //Used to obtain coordinates based on a position
-{
-	return { floor((x + kTerrainSize / 2) / kGridSize), floor((z + kTerrainSize / 2) / kGridSize) };
-}
\ No newline at end of file
+	for (size_t i = 0; i < lines.size(); i++) font->Draw(lines[i], kX, kY + kLineHeight * int(i), kWhite);
+}
+#endif